@@ -25,10 +25,15 @@
 #ifndef FLASHCACHE_H
 #define FLASHCACHE_H
 
-#define FLASHCACHE_VERSION		1
+#define FLASHCACHE_VERSION		7
 
 #define DEV_PATHLEN	128
 
+/* Dirty summary bits in the superblock, see FLASHCACHE_SB_SUMMARY */
+#define FLASHCACHE_SB_SUMMARY_BITS	1024
+/* Formatted bits of a lazily created cache, see FLASHCACHE_SB_LAZY */
+#define FLASHCACHE_SB_FORMAT_BITS	256
+
 #ifdef __KERNEL__
 
 /* Like ASSERT() but always compiled in */
@@ -108,12 +113,21 @@
 #define FLASHCACHE_MAX_ASSOC	8192
 #define FLASHCACHE_LRU_NULL	0xFFFF
 
-/* Cache block metadata structure */
+/* 
+ * Cache block metadata structure.
+ * The dbn (sector number of the cached block) of each block is kept apart
+ * from the rest of the block state, in the dense dmc->cache_tag[] array. 
+ * Scans that only look at state (free slot search, dirty block selection) 
+ * or only at dbns (overlap detection) then touch less of the memory, and 
+ * the cacheblock shrinks to 8 bytes.
+ * Since the set a block lives in is a function of its dbn, the dbn is not
+ * stored in full. The tag is the dbn with the set number bits squeezed 
+ * out, see flashcache_dbn_to_tag() below, which fits in 32 bits.
+ */
 struct cacheblock {
 	u_int16_t	cache_state;
 	int16_t 	nr_queued;	/* jobs in pending queue */
 	u_int16_t	lru_prev, lru_next;
-	sector_t 	dbn;	/* Sector number of the cached block */
 #ifdef FLASHCACHE_DO_CHECKSUMS
 	u_int64_t 	checksum;
 #endif
@@ -124,56 +138,58 @@ struct cache_set {
 	u_int32_t		set_clean_next;
 	u_int32_t		clean_inprog;
 	u_int32_t		nr_dirty;
+	u_int32_t		nr_unaligned;	/* VALID blocks with a dbn that isn't block aligned */
 	u_int16_t		lru_head, lru_tail;
 };
 
 /*
- * Cache context
+ * Per set cache state (block states, the set's LRU/FIFO, dbn hash and 
+ * counters, and the md sector heads for its blocks) is protected by one of
+ * an array of striped spinlocks. Padded so stripes don't share a cacheline.
  */
-struct cache_c {
-	struct dm_target	*tgt;
-	
-	struct dm_dev 		*disk_dev;   /* Source device */
-	struct dm_dev 		*cache_dev; /* Cache device */
+#define FLASHCACHE_LOCK_STRIPES		128
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
-	struct dm_kcopyd_client *kcp_client; /* Kcopyd client for writing back data */
-#else
-	struct kcopyd_client *kcp_client; /* Kcopyd client for writing back data */
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
-	struct dm_io_client *io_client; /* Client memory pool*/
-#endif
+struct flashcache_stripe {
+	spinlock_t		lock;
+} ____cacheline_aligned_in_smp;
 
-	spinlock_t		cache_spin_lock;
-
-	struct cacheblock	*cache;	/* Hash table for cache blocks */
-	struct cache_set	*cache_sets;
-	struct cache_md_sector_head *md_sectors_buf;
-	
-	sector_t size;			/* Cache size */
-	unsigned int assoc;		/* Cache associativity */
-	unsigned int block_size;	/* Cache block size */
-	unsigned int block_shift;	/* Cache block size in bits */
-	unsigned int block_mask;	/* Cache block mask */
-	unsigned int consecutive_shift;	/* Consecutive blocks size in bits */
-
-	wait_queue_head_t destroyq;	/* Wait queue for I/O completion */
-	/* XXX - Updates of nr_jobs should happen inside the lock. But doing it outside
-	   is OK since the filesystem is unmounted at this point */
-	atomic_t nr_jobs;		/* Number of I/O jobs */
-	atomic_t fast_remove_in_prog;
+/*
+ * IOs waiting on a busy block are hashed by cache block, with a bucket per
+ * run of 1 << FLASHCACHE_PENDING_SHIFT blocks, so the table grows with the
+ * cache and a chain only holds the jobs of a few blocks. A bucket never 
+ * spans lock stripes, its stripe lock protects it.
+ */
+#define FLASHCACHE_PENDING_SHIFT	3
+#define FLASHCACHE_PENDING_BUCKETS(dmc)	\
+	(((dmc)->size + (1 << FLASHCACHE_PENDING_SHIFT) - 1) >> FLASHCACHE_PENDING_SHIFT)
 
-	int	dirty_thresh_set;	/* Per set dirty threshold to start cleaning */
-	int	max_clean_ios_set;	/* Max cleaning IOs per set */
-	int	max_clean_ios_total;	/* Total max cleaning IOs */
-	int	clean_inprog;
-	int	sync_index;
-	int	nr_dirty;
+/*
+ * Deferred job lists (IO completions that need process context, md 
+ * updates). Each cache has a set per CPU, and a job is queued on the set
+ * of the CPU that completed its IO and run by that CPU's thread of the 
+ * cache's own workqueue, so one cache's completions never wait behind 
+ * another's. The lists are lockless stacks : jobs are pushed with cmpxchg
+ * and the worker takes the whole list with one xchg.
+ */
+struct flashcache_job_queue {
+	struct kcached_job	*md_complete_jobs;
+	struct kcached_job	*pending_jobs;
+	struct kcached_job	*md_io_jobs;
+	struct kcached_job	*uncached_io_complete_jobs;
+	struct kcached_job	*readfill_jobs;	/* Staged, see push_readfill() */
+	struct work_struct	work;
+	struct cache_c		*dmc;
+};
 
-	int	md_sectors;		/* Numbers of metadata sectors, including header */
+/* Most md sectors group committed with one write, see flashcache_md_commit() */
+#define FLASHCACHE_MD_COMMIT_MAX	128
+#define FLASHCACHE_MD_WRITE_HIST	8	/* log2(FLASHCACHE_MD_COMMIT_MAX) + 1 */
 
-	/* Stats */
+/*
+ * Event counters. Each CPU bumps its own copy, so counting never writes a 
+ * shared cacheline, and readers sum the copies (flashcache_get_stats()).
+ */
+struct flashcache_stats {
 	unsigned long reads;		/* Number of reads */
 	unsigned long writes;		/* Number of writes */
 	unsigned long read_hits;	/* Number of cache hits */
@@ -184,7 +200,7 @@ struct cache_c {
 	unsigned long wr_invalidates;	/* Number of write invalidations */
 	unsigned long rd_invalidates;	/* Number of read invalidations */
 	unsigned long pending_inval;	/* Invalidations due to concurrent ios on same block */
-	unsigned long cached_blocks;	/* Number of cached blocks */
+	unsigned long aligned_inval_skips;	/* Overlap searches skipped for aligned ios */
 #ifdef FLASHCACHE_DO_CHECKSUMS
 	unsigned long checksum_store;
 	unsigned long checksum_valid;
@@ -195,8 +211,19 @@ struct cache_c {
 	unsigned long noroom;		/* No room in set */
 	unsigned long md_write_dirty;	/* Metadata sector writes dirtying block */
 	unsigned long md_write_clean;	/* Metadata sector writes cleaning block */
+	unsigned long md_write_fence;	/* Metadata sector writes ahead of a slot reuse */
+	unsigned long md_write_warm;	/* Metadata sector writes of readfilled slots */
+	unsigned long md_summary_writes;	/* Superblock writes of the dirty summary */
+	unsigned long md_formats;	/* Summary runs of a lazy cache formatted */
+	unsigned long md_load_waits;	/* IOs held until their sets were loaded */
+	unsigned long md_load_passthru;	/* Reads sent to disk, their sets not loaded yet */
 	unsigned long md_write_batch;	/* How many md updates did we batch ? */
 	unsigned long md_ssd_writes;	/* How many md ssd writes did we do ? */
+	unsigned long md_alloc_waits;	/* Md writes that waited for a sector buffer */
+	unsigned long md_journal_writes;	/* Journal records written */
+	unsigned long md_journal_entries;	/* Updates carried by those */
+	unsigned long md_checkpoints;	/* Journal checkpoints */
+	unsigned long md_write_size[FLASHCACHE_MD_WRITE_HIST];	/* Md writes by log2 md blocks */
 	unsigned long pid_drops;
 	unsigned long pid_adds;
 	unsigned long pid_dels;
@@ -205,7 +232,7 @@ struct cache_c {
 	unsigned long uncached_reads, uncached_writes;
 	unsigned long disk_reads, disk_writes;
 	unsigned long ssd_reads, ssd_writes;
-	unsigned long ssd_readfills, ssd_readfill_unplugs;
+	unsigned long ssd_readfills, ssd_readfill_unplugs, ssd_readfill_merges;
 
 	unsigned long clean_set_calls;
 	unsigned long clean_set_less_dirty;
@@ -213,7 +240,148 @@ struct cache_c {
 	unsigned long clean_set_ios;
 	unsigned long set_limit_reached;
 	unsigned long total_limit_reached;
-	unsigned long pending_jobs_count;
+};
+
+struct flashcache_cpu_stats {
+	struct flashcache_stats	stats;
+	unsigned long		size_hist[33];	/* IOs by size in sectors */
+};
+
+/*
+ * Cache context
+ */
+struct cache_c {
+	struct dm_target	*tgt;
+	
+	struct dm_dev 		*disk_dev;   /* Source device */
+	struct dm_dev 		*cache_dev; /* Cache device */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	struct dm_kcopyd_client *kcp_client; /* Kcopyd client for writing back data */
+#else
+	struct kcopyd_client *kcp_client; /* Kcopyd client for writing back data */
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	struct dm_io_client *io_client; /* Client memory pool*/
+#endif
+
+	spinlock_t		cache_spin_lock;	/* Pid lists */
+	struct flashcache_stripe *stripes;	/* Per set state, see above */
+	unsigned int		nr_stripes;	/* Power of 2 */
+	unsigned int		stripe_shift;	/* Blocks per stripe in bits */
+
+	struct cacheblock	*cache;	/* Hash table for cache blocks */
+	u_int32_t		*cache_tag;	/* Set relative dbn of each block */
+	struct cache_set	*cache_sets;
+	u_int16_t		*hash_buckets;	/* Per set dbn hash heads */
+	u_int16_t		*hash_next;	/* Per block dbn hash chain */
+	unsigned int		hash_bits;	/* log2(hash buckets per set) */
+	unsigned long		*free_map;	/* Bit per block, set if INVALID */
+	unsigned long		*dirty_map;	/* Bit per block, set if DIRTY */
+	struct cache_md_sector_head *md_sectors_buf;	/* One per md block */
+	mempool_t		*md_sector_pool;	/* Md sector write buffers */
+	
+	sector_t size;			/* Cache size */
+	unsigned int assoc;		/* Cache associativity */
+	unsigned int block_size;	/* Cache block size */
+	unsigned int block_shift;	/* Cache block size in bits */
+	unsigned int block_mask;	/* Cache block mask */
+	unsigned int consecutive_shift;	/* Consecutive blocks size in bits */
+	unsigned int set_hash;		/* dbn -> set mapping, FLASHCACHE_SET_HASH_* */
+	unsigned int granule_shift;	/* Set hash granule (in blocks) in bits */
+	unsigned int set_shift;		/* block_shift + granule_shift */
+
+	struct workqueue_struct	*kcached_wq;	/* Runs the deferred jobs */
+	struct flashcache_job_queue *job_queues;	/* Per CPU */
+	/* One thread for md work that sleeps, off the kcached workers */
+	struct workqueue_struct	*md_wq;
+	/* Md writes waiting on md_wq for a sector buffer */
+	spinlock_t		md_alloc_lock;
+	struct kcached_job	*md_alloc_jobs;
+	struct work_struct	md_alloc_work;
+
+	wait_queue_head_t destroyq;	/* Wait queue for I/O completion */
+	/* XXX - Updates of nr_jobs should happen inside the lock. But doing it outside
+	   is OK since the filesystem is unmounted at this point */
+	atomic_t nr_jobs;		/* Number of I/O jobs */
+	atomic_t fast_remove_in_prog;
+
+	int	dirty_thresh_set;	/* Per set dirty threshold to start cleaning */
+	int	max_clean_ios_set;	/* Max cleaning IOs per set */
+	int	max_clean_ios_total;	/* Total max cleaning IOs */
+	atomic_t clean_inprog;
+	int	sync_index;
+	atomic_t nr_dirty;
+
+	int	md_sectors;		/* Numbers of metadata sectors, including header */
+	unsigned int md_block_size;	/* Md block (unit of md IO) in sectors */
+	/* Md sectors ready to write, waiting for others to group commit with */
+	spinlock_t		md_commit_lock;
+	struct kcached_job	*md_commit_jobs;
+	int			md_commit_nr;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	struct work_struct	md_commit_work;
+#else
+	struct delayed_work	md_commit_work;
+#endif
+	struct flashcache_journal *journal;	/* NULL if the cache has no md journal */
+	unsigned long		*md_changed;	/* Bit per md block changed since load */
+	/* Warm caches (FLASHCACHE_SB_WARM) only */
+	int			warm;
+	unsigned long		*md_valid_map;	/* Bit per block, set if its slot may say VALID */
+	unsigned long		*md_warm_map;	/* Bit per md block with readfills not on flash */
+	int			warm_flush_stop;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	struct work_struct	warm_flush_work;
+#else
+	struct delayed_work	warm_flush_work;
+#endif
+	int			md_stale;	/* Slot table on flash is behind, even where unchanged */
+	/* 
+	 * Dirty summary (FLASHCACHE_SB_SUMMARY), NULL counts for warm caches.
+	 * md_summary_count[bit] is the number of slots under a summary bit
+	 * that may say DIRTY on flash. A WRITECACHE md update waits on 
+	 * md_summary_waiters until its bit is in md_summary_flash.
+	 */
+	spinlock_t		md_summary_lock;
+	int			*md_summary_count;
+	unsigned int		md_summary_shift;
+	unsigned long		md_summary_want[BITS_TO_LONGS(FLASHCACHE_SB_SUMMARY_BITS)];
+	unsigned long		md_summary_flash[BITS_TO_LONGS(FLASHCACHE_SB_SUMMARY_BITS)];
+	struct kcached_job	*md_summary_waiters;
+	int			md_summary_inprog;
+	int			md_summary_loading;	/* Counts incomplete, never clear a bit */
+	/* 
+	 * Lazily created caches (FLASHCACHE_SB_LAZY). A run is formatted by 
+	 * the summary work before its bit first goes on flash.
+	 */
+	int			md_lazy;
+	unsigned long		md_formatted[BITS_TO_LONGS(FLASHCACHE_SB_FORMAT_BITS)];
+	struct work_struct	md_summary_work;
+	/* 
+	 * Background md load (sysctl background_load). The slot table is read
+	 * a chunk (METADATA_IO_BLOCKSIZE, whole sets) at a time while the
+	 * cache is up. IOs to sets not loaded yet wait on md_load_bios, but
+	 * reads of chunks without DIRTY blocks go to disk. See 
+	 * flashcache_md_load_map().
+	 */
+	int			md_loading;
+	struct flashcache_md_load *md_load;
+	spinlock_t		md_load_lock;
+	int			md_load_chunk_slots;
+	unsigned long		*md_load_done;	/* Bit per chunk, its sets are set up */
+	unsigned long		*md_load_dirty;	/* Bit per chunk that may hold DIRTY blocks */
+	unsigned long		*md_load_failed;	/* Bit per chunk that could not be read */
+	int			md_load_error;	/* Some chunk failed, don't md_store() */
+	struct bio		*md_load_bios[2];	/* Held on bi_next, [1] if uncacheable */
+	struct bio		**md_load_bios_tail[2];
+	wait_queue_head_t	md_load_wait;	/* Woken when md_loading is cleared */
+
+	/* Stats */
+	struct flashcache_cpu_stats *cpu_stats;	/* Per CPU, summed when read */
+	atomic_t cached_blocks;		/* Number of cached blocks */
+	atomic_t pending_jobs_count;	/* IOs waiting on busy blocks */
+	int	pending_jobs_max;	/* High water mark of the above */
 
 	/* Errors */
 	int	disk_read_errors;
@@ -229,19 +397,21 @@ struct cache_c {
 #endif
 
 	/* State for doing readfills (batch writes to ssd) */
-	int readfill_in_prog;
-	struct kcached_job *readfill_queue;
+	unsigned long readfill_in_prog;	/* Bit 0 set while the worker runs */
+	int readfill_batch_max;		/* Most readfills taken at once */
 	struct work_struct readfill_wq;
 
-	unsigned long pid_expire_check;
-
+	/* Pid lists in the order added, and hashed by pid (indexed by list) */
 	struct flashcache_cachectl_pid *blacklist_head, *blacklist_tail;
 	struct flashcache_cachectl_pid *whitelist_head, *whitelist_tail;
 	int num_blacklist_pids, num_whitelist_pids;
-	unsigned long blacklist_expire_check, whitelist_expire_check;
+#define FLASHCACHE_PID_HASH_SIZE	64
+#define FLASHCACHE_PID_HASH(PID)	((PID) & (FLASHCACHE_PID_HASH_SIZE - 1))
+	struct hlist_head pid_hash[2][FLASHCACHE_PID_HASH_SIZE];
+	struct timer_list pid_expiry_timer;
 
-#define PENDING_JOB_HASH_SIZE		32
-	struct pending_job *pending_job_hashbuckets[PENDING_JOB_HASH_SIZE];
+	/* IOs waiting on busy blocks, see FLASHCACHE_PENDING_SHIFT */
+	struct pending_job **pending_job_buckets;
 	
 	struct cache_c	*next_cache;
 
@@ -257,9 +427,11 @@ struct cache_c {
 #define READFILL	5	/* Read Cache Miss Fill */
 #define INVALIDATE	6
 #define WRITEDISK_SYNC	7
+#define MDFENCE		8	/* Md write of the slot as INVALID before it is reused */
+#define MDFLUSH		9	/* Md write of readfilled slots (warm caches) */
 
 struct kcached_job {
-	struct list_head list;
+	struct kcached_job *qnext;	/* Job queue link */
 	struct cache_c *dmc;
 	struct bio *bio;	/* Original bio */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
@@ -274,6 +446,8 @@ struct kcached_job {
 	int 	error;
 	struct flash_cacheblock *md_sector;
 	struct bio_vec md_io_bvec;
+	struct bio_vec *readfill_bvecs;	/* Coalesced readfill write */
+	struct bio_vec *md_bvecs;	/* Group committed md write */
 	struct kcached_job *next;
 };
 
@@ -283,6 +457,7 @@ struct pending_job {
 	int	index;
 	struct pending_job *prev, *next;
 };
+
 #endif /* __KERNEL__ */
 
 /* States of a cache block */
@@ -293,14 +468,61 @@ struct pending_job {
 #define CACHEREADINPROG		0x0010	/* Read from cache in progress */
 #define CACHEWRITEINPROG	0x0020	/* Write to cache in progress */
 #define DIRTY			0x0040	/* Dirty, needs writeback to disk */
+#define MDFENCEINPROG		0x0080	/* Md write invalidating the slot in progress */
 
-#define BLOCK_IO_INPROG	(DISKREADINPROG | DISKWRITEINPROG | CACHEREADINPROG | CACHEWRITEINPROG)
+#define BLOCK_IO_INPROG	(DISKREADINPROG | DISKWRITEINPROG | CACHEREADINPROG | CACHEWRITEINPROG | \
+			 MDFENCEINPROG)
 
 /* Cache metadata is read by Flashcache utilities */
 #ifndef __KERNEL__
 typedef u_int64_t sector_t;
 #endif
 
+/*
+ * Set hash functions. The source device is carved into granules of 
+ * (1 << set_shift) sectors, granule g sitting in row (g / num_sets) and
+ * column (g % num_sets). The contiguous hash maps the column straight to a
+ * set, so granules num_sets apart always collide and a hot region bigger
+ * than a granule piles into consecutive sets in every row. The XOR folded 
+ * and multiplicative hashes rotate each row by a skew derived from the row
+ * number, so such regions spread out over different sets. A rotation keeps
+ * the mapping 1:1 within a row, so the set and the row (which the in-core 
+ * tag keeps) give back the granule.
+ * The hash and the granule are picked when the cache is created and are
+ * kept in the superblock. These are shared with the utilities.
+ */
+#define FLASHCACHE_SET_HASH_CONTIG	0
+#define FLASHCACHE_SET_HASH_XOR		1
+#define FLASHCACHE_SET_HASH_MULT	2
+#define FLASHCACHE_SET_HASH_MAX		FLASHCACHE_SET_HASH_MULT
+
+static inline unsigned long
+flashcache_set_skew(unsigned int set_hash, unsigned long row, unsigned long num_sets)
+{
+	u_int64_t r = row;
+
+	switch (set_hash) {
+	case FLASHCACHE_SET_HASH_XOR:
+		r ^= (r >> 32);
+		r ^= (r >> 16);
+		r ^= (r >> 8);
+		return (u_int32_t)r % num_sets;
+	case FLASHCACHE_SET_HASH_MULT:
+		return ((u_int32_t)r * 0x9e3779b1U) % num_sets;
+	}
+	return 0;
+}
+
+static inline unsigned long
+flashcache_hash_set(unsigned int set_hash, unsigned int set_shift,
+		    unsigned long num_sets, sector_t dbn)
+{
+	unsigned long granule = (unsigned long)(dbn >> set_shift);
+
+	return (granule % num_sets + 
+		flashcache_set_skew(set_hash, granule / num_sets, num_sets)) % num_sets;
+}
+
 /* On Flash (cache metadata) Structures */
 #define CACHE_MD_STATE_DIRTY		0xdeadbeef
 #define CACHE_MD_STATE_CLEAN		0xfacecafe
@@ -317,8 +539,35 @@ struct flash_superblock {
 	char disk_devname[DEV_PATHLEN];
 	sector_t disk_devsize;
 	u_int32_t cache_version;
+	u_int32_t cache_set_hash;	/* FLASHCACHE_SET_HASH_* (version >= 2) */
+	u_int32_t cache_set_granule;	/* Set hash granule in blocks (version >= 2) */
+	u_int32_t cache_journal_sectors;	/* Md journal size, 0 if none (version >= 3) */
+	u_int32_t cache_journal_gen;	/* Bumped on every load, stamped in journal records */
+	u_int32_t cache_md_block_size;	/* Md block in sectors (version >= 4) */
+	u_int32_t cache_flags;		/* FLASHCACHE_SB_* (version >= 5) */
+	u_int32_t cache_summary_shift;	/* log2 md blocks per summary bit (version >= 6) */
+	u_int32_t cache_summary[FLASHCACHE_SB_SUMMARY_BITS / 32];
+	u_int32_t cache_formatted[FLASHCACHE_SB_FORMAT_BITS / 32];	/* (version >= 7) */
 };
 
+/* 
+ * Clean blocks are kept across an unclean shutdown. A slot is only reused
+ * (or invalidated ahead of a disk write) once its md block no longer says
+ * VALID for it on flash, see flashcache_md_fence().
+ */
+#define FLASHCACHE_SB_WARM		0x0001
+/* 
+ * cache_summary is good, a clear bit means none of the slots in its run
+ * of md blocks says DIRTY. Only the flagged runs are read after a crash.
+ */
+#define FLASHCACHE_SB_SUMMARY		0x0002
+/* 
+ * Created without writing the slot table. Only the runs of md blocks set
+ * in cache_formatted (FLASHCACHE_SB_FORMAT_BITS of them, each a few dirty
+ * summary runs) have been written, the slots of the others are INVALID.
+ */
+#define FLASHCACHE_SB_LAZY		0x0004
+
 /* 
  * We do metadata updates only when a block trasitions from DIRTY -> CLEAN
  * or from CLEAN -> DIRTY. Consequently, on an unclean shutdown, we only
@@ -336,12 +585,76 @@ struct flash_cacheblock {
 };
 
 #define MD_BLOCKS_PER_SECTOR		(512 / (sizeof(struct flash_cacheblock)))
-#define INDEX_TO_MD_SECTOR(INDEX)	((INDEX) / MD_BLOCKS_PER_SECTOR)
-#define INDEX_TO_MD_SECTOR_OFFSET(INDEX)	((INDEX) % MD_BLOCKS_PER_SECTOR)
+
+/*
+ * The slot table is packed into md blocks, and an md update rewrites its
+ * whole md block. Caches before version 4 have 512 byte md blocks. A 
+ * version 4 cache can be created with 4KB md blocks instead, for ssds that
+ * work in 4KB pages. The superblock then has the first md block to 
+ * itself, and the slot table, the journal ring and the cached data all 
+ * start on a 4KB boundary.
+ */
+#define FLASHCACHE_MD_BLOCK_512		1
+#define FLASHCACHE_MD_BLOCK_4K		8
+#define MD_SLOTS_PER_BLOCK(MD_BLOCK_SIZE)	\
+	((MD_BLOCK_SIZE) * 512 / sizeof(struct flash_cacheblock))
+#define INDEX_TO_MD_BLOCK(DMC, INDEX)	((INDEX) / MD_SLOTS_PER_BLOCK((DMC)->md_block_size))
+#define INDEX_TO_MD_BLOCK_OFFSET(DMC, INDEX)	\
+	((INDEX) % MD_SLOTS_PER_BLOCK((DMC)->md_block_size))
+/* First sector of md block "MD_BLOCK", past the superblock's */
+#define MD_BLOCK_TO_SECTOR(DMC, MD_BLOCK)	(((MD_BLOCK) + 1) * (DMC)->md_block_size)
+/* The journal ring (if any) follows the slot table and one spare md block */
+#define MD_JOURNAL_START(DMC)	MD_BLOCK_TO_SECTOR(DMC, INDEX_TO_MD_BLOCK(DMC, (DMC)->size) + 1)
+/* Dirty summary bit covering the slot of block "INDEX" */
+#define INDEX_TO_MD_SUMMARY(DMC, INDEX)	(INDEX_TO_MD_BLOCK(DMC, INDEX) >> (DMC)->md_summary_shift)
+/* Formatted bit covering dirty summary bit "BIT" */
+#define MD_SUMMARY_TO_FORMAT(BIT)	\
+	((BIT) / (FLASHCACHE_SB_SUMMARY_BITS / FLASHCACHE_SB_FORMAT_BITS))
 
 #define METADATA_IO_BLOCKSIZE		(256*1024)
 #define METADATA_IO_BLOCKSIZE_SECT	(METADATA_IO_BLOCKSIZE / 512)
 
+/*
+ * Optional md journal. When the cache is created with one, DIRTY <-> CLEAN
+ * transitions are not written into the slot table (the flash_cacheblock
+ * array) right away. They are appended to 4KB records written in sequence
+ * to a ring that sits between the slot table and the cached data, and the
+ * md sectors they touched are written back (checkpointed) in the background
+ * before the ring wraps onto their records. On an unclean shutdown, the 
+ * records of the last run are replayed over the slot table at load.
+ * A record is valid if its magic, generation (the superblock's 
+ * cache_journal_gen) and crc32c (taken with crc = 0) match.
+ */
+#define FLASHCACHE_JOURNAL_MAGIC		0xf1a5c10d
+#define FLASHCACHE_JOURNAL_RECORD_SIZE		4096
+#define FLASHCACHE_JOURNAL_RECORD_SECT		(FLASHCACHE_JOURNAL_RECORD_SIZE / 512)
+#define FLASHCACHE_JOURNAL_DEF_SECT		2048	/* 1MB, 256 records */
+#define FLASHCACHE_JOURNAL_MIN_SECT		(4 * FLASHCACHE_JOURNAL_RECORD_SECT)
+#define FLASHCACHE_JOURNAL_MAX_SECT		65536	/* 32MB */
+
+struct flash_journal_header {
+	u_int64_t	seq;		/* Record number in this run, from 1 */
+	u_int32_t	gen;
+	u_int32_t	magic;
+	u_int32_t	nr_entries;
+	u_int32_t	crc;
+};
+
+struct flash_journal_entry {
+	sector_t	dbn;
+#ifdef FLASHCACHE_DO_CHECKSUMS
+	u_int64_t	checksum;
+#endif
+	u_int32_t	index;		/* Cache block */
+	u_int32_t	cache_state;	/* VALID | DIRTY, or VALID once cleaned */
+};
+
+#define FLASHCACHE_JOURNAL_ENTRIES					\
+	((FLASHCACHE_JOURNAL_RECORD_SIZE - sizeof(struct flash_journal_header)) / \
+	 sizeof(struct flash_journal_entry))
+#define FLASHCACHE_JOURNAL_RECORD_ENTRIES(HDR)	\
+	((struct flash_journal_entry *)((struct flash_journal_header *)(HDR) + 1))
+
 #ifdef __KERNEL__
 
 /* Cache persistence */
@@ -360,8 +673,47 @@ struct cache_md_sector_head {
 	struct kcached_job	*queued_updates, *md_io_inprog;
 };
 
+/*
+ * In-core md journal state (see FLASHCACHE_JOURNAL_MAGIC). Updates go into
+ * the record being filled while the other one is written, so one record 
+ * write is in flight at a time and everything that arrives meanwhile rides
+ * the next one. Updates that find the filling record full wait on the 
+ * waiters list. Record seq may only be written once records up to 
+ * seq - nr_records are checkpointed.
+ */
+struct flashcache_journal_record {
+	struct flash_journal_header	*header;	/* Page holding the record */
+	struct bio_vec			bvec;
+	int				slot;		/* Where in the ring */
+	struct kcached_job		*jobs, **jobs_tail;
+};
+
+struct flashcache_journal {
+	struct cache_c		*dmc;
+	spinlock_t		lock;
+	sector_t		start;		/* First sector of the ring */
+	int			nr_records;
+	u_int32_t		gen;		/* Stamped in every record */
+	struct flashcache_journal_record rec[2];
+	int			filling;	/* rec[filling] takes updates */
+	int			io_inprog;	/* rec[!filling] is being written */
+	struct kcached_job	*waiters, **waiters_tail;
+	u_int64_t		next_seq;	/* Of the next record written */
+	int			next_slot;
+	u_int64_t		done_seq;	/* Records up to here are on flash */
+	u_int64_t		ckpt_seq;	/* and up to here in the slot table */
+	int			ckpt_in_prog;
+	struct work_struct	ckpt_work;
+	int			nr_md_sectors;	/* Slot table md blocks */
+	unsigned long		*md_dirty;	/* Bit per slot table md block not checkpointed */
+	void			*ckpt_buf;	/* METADATA_IO_BLOCKSIZE */
+};
+
 #define MIN_JOBS 1024
 
+/* Md sector buffers held in reserve per cache, at most one per md sector */
+#define FLASHCACHE_MD_POOL_SIZE	256
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
 enum {
 	FLASHCACHE_WB_SYNC=1,
@@ -379,6 +731,12 @@ enum {
 	FLASHCACHE_WB_DO_FAST_REMOVE=13,
 	FLASHCACHE_WB_STOP_SYNC=14,
 	FLASHCACHE_WB_CACHE_ALL=15,
+	FLASHCACHE_WB_MD_COMMIT_USECS=16,
+	FLASHCACHE_WB_MD_COMMIT_MAX=17,
+	FLASHCACHE_WB_MD_STORE_INCREMENTAL=18,
+	FLASHCACHE_WB_WARM_FLUSH_SECS=19,
+	FLASHCACHE_WB_BACKGROUND_LOAD=20,
+	FLASHCACHE_WB_LAZY_CREATE=21,
 };
 #endif
 
@@ -389,6 +747,18 @@ enum {
 /* DM async IO mempool sizing */
 #define FLASHCACHE_ASYNC_SIZE 1024
 
+/* Slot table reads (METADATA_IO_BLOCKSIZE each) in flight at cache load */
+#define FLASHCACHE_MD_LOAD_DEPTH	16
+
+/* Slot table writes (METADATA_IO_BLOCKSIZE each) in flight at cache store */
+#define FLASHCACHE_MD_STORE_DEPTH	8
+
+/* Most readfills to adjacent cache blocks written out with one IO */
+#define FLASHCACHE_READFILL_MAX_RUN	16
+
+/* Most md blocks of readfilled slots written out per warm flush run */
+#define FLASHCACHE_WARM_FLUSH_MAX	1024
+
 enum {
 	FLASHCACHE_WHITELIST=0,
 	FLASHCACHE_BLACKLIST=1,
@@ -397,6 +767,8 @@ enum {
 struct flashcache_cachectl_pid {
 	pid_t					pid;
 	struct flashcache_cachectl_pid		*next, *prev;
+	struct hlist_node			hash;
+	struct rcu_head				rcu;
 	unsigned long				expiry;
 };
 
@@ -405,6 +777,106 @@ struct dbn_index_pair {
 	int		index;
 };
 
+/*
+ * A dbn maps to set flashcache_hash_set() (see below). Within a set, the 
+ * dbn is identified by its row ((dbn >> set_shift) / num_sets) and the low
+ * set_shift bits of the dbn, and that is what the 32 bit tag holds.
+ */
+static inline u_int32_t
+flashcache_dbn_to_tag(struct cache_c *dmc, sector_t dbn)
+{
+	unsigned long row;
+
+	row = (unsigned long)(dbn >> dmc->set_shift) / 
+		(unsigned long)(dmc->size >> dmc->consecutive_shift);
+	return (u_int32_t)(((sector_t)row << dmc->set_shift) | 
+			   (dbn & ((1UL << dmc->set_shift) - 1)));
+}
+
+static inline int
+flashcache_dbn_to_tag_overflows(struct cache_c *dmc, sector_t dbn)
+{
+	unsigned long row;
+
+	row = (unsigned long)(dbn >> dmc->set_shift) / 
+		(unsigned long)(dmc->size >> dmc->consecutive_shift);
+	return (row >> (32 - dmc->set_shift)) != 0;
+}
+
+static inline sector_t
+flashcache_tag_to_dbn(struct cache_c *dmc, int set, u_int32_t tag)
+{
+	unsigned long num_sets = dmc->size >> dmc->consecutive_shift;
+	unsigned long row = tag >> dmc->set_shift;
+	sector_t granule;
+
+	granule = (sector_t)row * num_sets + 
+		(set + num_sets - flashcache_set_skew(dmc->set_hash, row, num_sets)) % num_sets;
+	return (granule << dmc->set_shift) | (tag & ((1UL << dmc->set_shift) - 1));
+}
+
+/*
+ * Cached blocks start at the dbn of a full blocksize IO, which need not be
+ * block aligned. So a block overlapping an IO starting at io_start begins
+ * no earlier than this.
+ */
+static inline sector_t
+flashcache_overlap_start(struct cache_c *dmc, sector_t io_start)
+{
+	if (io_start > dmc->block_size - 1)
+		return (io_start - (dmc->block_size - 1)) & ~((sector_t)dmc->block_mask);
+	return 0;
+}
+
+static inline sector_t
+flashcache_get_dbn(struct cache_c *dmc, int index)
+{
+	return flashcache_tag_to_dbn(dmc, index >> dmc->consecutive_shift, 
+				     dmc->cache_tag[index]);
+}
+
+static inline void
+flashcache_set_dbn(struct cache_c *dmc, int index, sector_t dbn)
+{
+	dmc->cache_tag[index] = flashcache_dbn_to_tag(dmc, dbn);
+}
+
+/* 
+ * A stripe covers whole sets and whole md sectors, so a block, its set and 
+ * its md sector head are always under the same lock.
+ */
+static inline int
+flashcache_stripe(struct cache_c *dmc, int index)
+{
+	return (index >> dmc->stripe_shift) & (dmc->nr_stripes - 1);
+}
+
+static inline spinlock_t *
+flashcache_index_lock(struct cache_c *dmc, int index)
+{
+	return &dmc->stripes[flashcache_stripe(dmc, index)].lock;
+}
+
+static inline spinlock_t *
+flashcache_set_lock(struct cache_c *dmc, int set)
+{
+	return flashcache_index_lock(dmc, set * dmc->assoc);
+}
+
+/* 
+ * Completion (irq) paths count too, so hold off irqs across the update
+ * to keep the counts exact.
+ */
+#define FLASHCACHE_STATS_ADD(dmc, field, n)					\
+	do {									\
+		unsigned long __flags;						\
+										\
+		local_irq_save(__flags);					\
+		per_cpu_ptr((dmc)->cpu_stats, smp_processor_id())->stats.field += (n); \
+		local_irq_restore(__flags);					\
+	} while (0)
+#define FLASHCACHE_STATS_INC(dmc, field)	FLASHCACHE_STATS_ADD(dmc, field, 1)
+
 /* Error injection flags */
 #define READDISK_ERROR				0x00000001
 #define READCACHE_ERROR				0x00000002
@@ -435,6 +907,7 @@ void flashcache_dtr(struct dm_target *ti);
 
 int flashcache_status(struct dm_target *ti, status_type_t type,
 		      char *result, unsigned int maxlen);
+void flashcache_get_stats(struct cache_c *dmc, struct flashcache_stats *stats);
 struct kcached_job *flashcache_alloc_cache_job(void);
 void flashcache_free_cache_job(struct kcached_job *job);
 struct pending_job *flashcache_alloc_pending_job(struct cache_c *dmc);
@@ -445,37 +918,72 @@ void flashcache_store_checksum(struct kcached_job *job);
 int flashcache_validate_checksum(struct kcached_job *job);
 int flashcache_read_compute_checksum(struct cache_c *dmc, int index, void *block);
 #endif
-struct kcached_job *pop(struct list_head *jobs);
-void push(struct list_head *jobs, struct kcached_job *job);
+struct kcached_job *pop(struct kcached_job **jobs);
+void push(struct kcached_job *job, size_t list);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
-void do_work(void *unused);
+void do_work(void *data);
 #else
-void do_work(struct work_struct *unused);
+void do_work(struct work_struct *work);
 #endif
+void flashcache_job_queues_init(struct cache_c *dmc);
+int flashcache_job_queues_empty(struct cache_c *dmc);
 struct kcached_job *new_kcached_job(struct cache_c *dmc, struct bio* bio,
 				    int index);
 void push_pending(struct kcached_job *job);
-void push_io(struct kcached_job *job);
 void push_md_io(struct kcached_job *job);
 void push_md_complete(struct kcached_job *job);
 void push_uncached_io_complete(struct kcached_job *job);
-int flashcache_pending_empty(void);
-int flashcache_io_empty(void);
-int flashcache_md_io_empty(void);
-int flashcache_md_complete_empty(void);
+void push_readfill(struct kcached_job *job);
+int flashcache_readfills_staged(struct cache_c *dmc);
 void flashcache_md_write_done(struct kcached_job *job);
 void flashcache_do_pending(struct kcached_job *job);
 void flashcache_md_write(struct kcached_job *job);
 void flashcache_md_write_kickoff(struct kcached_job *job);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+void flashcache_md_commit_flush(struct cache_c *dmc);
+#else
+void flashcache_md_commit_flush(struct work_struct *work);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+void flashcache_md_alloc_wait(struct cache_c *dmc);
+#else
+void flashcache_md_alloc_wait(struct work_struct *work);
+#endif
+void flashcache_md_fill_sector(struct cache_c *dmc, struct flash_cacheblock *md_sector,
+			       int sector);
+int flashcache_journal_alloc(struct cache_c *dmc, sector_t start, int sectors);
+void flashcache_journal_destroy(struct cache_c *dmc);
+int flashcache_journal_flush_md(struct cache_c *dmc, int locked);
+int flashcache_md_summary_store(struct cache_c *dmc, unsigned long *summary);
+int flashcache_md_format(struct cache_c *dmc, unsigned long *summary);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+void flashcache_md_summary_update(struct cache_c *dmc);
+#else
+void flashcache_md_summary_update(struct work_struct *work);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+void flashcache_warm_flush(struct cache_c *dmc);
+#else
+void flashcache_warm_flush(struct work_struct *work);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 void flashcache_do_readfill(struct cache_c *dmc);
 #else
 void flashcache_do_readfill(struct work_struct *work);
 #endif
 void flashcache_uncached_io_complete(struct kcached_job *job);
 void flashcache_clean_set(struct cache_c *dmc, int set);
+int flashcache_md_load_map(struct cache_c *dmc, struct bio *bio, int uncacheable);
+int flashcache_md_load_bio_chunk(struct cache_c *dmc, struct bio *bio, 
+				 unsigned long *skip);
+void flashcache_md_load_release(struct cache_c *dmc, struct bio *bios, int uncacheable);
 void flashcache_sync_all(struct cache_c *dmc);
 void flashcache_reclaim_lru_movetail(struct cache_c *dmc, int index);
+void flashcache_hash_insert(struct cache_c *dmc, int index);
+void flashcache_hash_remove(struct cache_c *dmc, int index);
+int flashcache_hash_lookup(struct cache_c *dmc, int set, sector_t dbn);
+int flashcache_hash_overlap(struct cache_c *dmc, int set, sector_t io_start, 
+			    sector_t io_end);
 void flashcache_merge_writes(struct cache_c *dmc, 
 			     struct dbn_index_pair *writes_list, 
 			     int *nr_writes, int set);
@@ -486,6 +994,15 @@ int flashcache_dm_io_sync_vm(struct cache_c *dmc, struct io_region *where,
 int flashcache_dm_io_sync_vm(struct cache_c *dmc, struct dm_io_region *where, 
 			     int rw, void *data);
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+int flashcache_dm_io_async_vm(struct cache_c *dmc, unsigned int num_regions, 
+			      struct dm_io_region *where, int rw, 
+			      void *data, io_notify_fn fn, void *context);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+int flashcache_dm_io_async_vm(struct cache_c *dmc, unsigned int num_regions, 
+			      struct io_region *where, int rw, 
+			      void *data, io_notify_fn fn, void *context);
+#endif
 void flashcache_update_sync_progress(struct cache_c *dmc);
 void flashcache_unplug_device(struct block_device *bdev);
 void flashcache_enq_pending(struct cache_c *dmc, struct bio* bio,
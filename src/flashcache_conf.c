@@ -41,6 +41,9 @@
 #include <linux/delay.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/crc32c.h>
+#include <linux/kthread.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 #include "dm.h"
@@ -78,24 +81,25 @@ int sysctl_pid_expiry_check = 60;
 int sysctl_pid_do_expiry = 0;
 int sysctl_flashcache_fast_remove = 0;
 int sysctl_cache_all = 1;
+int sysctl_flashcache_md_commit_usecs = 0;
+int sysctl_flashcache_md_commit_max = 32;
+int sysctl_flashcache_md_store_incremental = 0;
+int sysctl_flashcache_warm_flush_secs = 5;
+int sysctl_flashcache_background_load = 0;
+int sysctl_flashcache_lazy_create = 0;
 
 struct cache_c *cache_list_head = NULL;
-struct work_struct _kcached_wq;
-u_int64_t size_hist[33];
 
 struct kmem_cache *_job_cache;
 mempool_t *_job_pool;
 struct kmem_cache *_pending_job_cache;
 mempool_t *_pending_job_pool;
+struct kmem_cache *_md_sector_cache;
+struct kmem_cache *_md_block_cache;
 
 atomic_t nr_cache_jobs;
 atomic_t nr_pending_jobs;
 
-extern struct list_head *_pending_jobs;
-extern struct list_head *_io_jobs;
-extern struct list_head *_md_io_jobs;
-extern struct list_head *_md_complete_jobs;
-
 static void flashcache_zero_stats(struct cache_c *dmc);
 
 struct flashcache_control_s {
@@ -459,6 +463,66 @@ static ctl_table flashcache_table[] = {
 		.mode		= 0644,
 		.proc_handler	= &proc_dointvec,
 	},
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+		.ctl_name	= FLASHCACHE_WB_MD_COMMIT_USECS,
+#endif
+		.procname	= "md_commit_usecs",
+		.data		= &sysctl_flashcache_md_commit_usecs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec,
+	},
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+		.ctl_name	= FLASHCACHE_WB_MD_COMMIT_MAX,
+#endif
+		.procname	= "md_commit_max",
+		.data		= &sysctl_flashcache_md_commit_max,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec,
+	},
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+		.ctl_name	= FLASHCACHE_WB_MD_STORE_INCREMENTAL,
+#endif
+		.procname	= "md_store_incremental",
+		.data		= &sysctl_flashcache_md_store_incremental,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec,
+	},
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+		.ctl_name	= FLASHCACHE_WB_WARM_FLUSH_SECS,
+#endif
+		.procname	= "warm_flush_secs",
+		.data		= &sysctl_flashcache_warm_flush_secs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec,
+	},
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+		.ctl_name	= FLASHCACHE_WB_BACKGROUND_LOAD,
+#endif
+		.procname	= "background_load",
+		.data		= &sysctl_flashcache_background_load,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec,
+	},
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+		.ctl_name	= FLASHCACHE_WB_LAZY_CREATE,
+#endif
+		.procname	= "lazy_create",
+		.data		= &sysctl_flashcache_lazy_create,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec,
+	},
   {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
 	.ctl_name = 0
@@ -549,17 +613,44 @@ flashcache_jobs_init(void)
 		return -ENOMEM;
 	}
 
+	/* Md sector buffers, aligned so that none straddles a page */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+	_md_sector_cache = kmem_cache_create("flashcache-md-sectors",
+					     512, 512, 0, NULL, NULL);
+#else
+	_md_sector_cache = kmem_cache_create("flashcache-md-sectors",
+					     512, 512, 0, NULL);
+#endif
+	if (!_md_sector_cache) {
+		mempool_destroy(_pending_job_pool);
+		kmem_cache_destroy(_pending_job_cache);
+		mempool_destroy(_job_pool);
+		kmem_cache_destroy(_job_cache);
+		return -ENOMEM;
+	}
+	/* And for caches with 4KB md blocks */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+	_md_block_cache = kmem_cache_create("flashcache-md-blocks",
+					    4096, 4096, 0, NULL, NULL);
+#else
+	_md_block_cache = kmem_cache_create("flashcache-md-blocks",
+					    4096, 4096, 0, NULL);
+#endif
+	if (!_md_block_cache) {
+		kmem_cache_destroy(_md_sector_cache);
+		mempool_destroy(_pending_job_pool);
+		kmem_cache_destroy(_pending_job_cache);
+		mempool_destroy(_job_pool);
+		kmem_cache_destroy(_job_cache);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
 static void 
 flashcache_jobs_exit(void)
 {
-	VERIFY(flashcache_pending_empty());
-	VERIFY(flashcache_io_empty());
-	VERIFY(flashcache_md_io_empty());
-	VERIFY(flashcache_md_complete_empty());
-
 	mempool_destroy(_job_pool);
 	kmem_cache_destroy(_job_cache);
 	_job_pool = NULL;
@@ -568,6 +659,10 @@ flashcache_jobs_exit(void)
 	kmem_cache_destroy(_pending_job_cache);
 	_pending_job_pool = NULL;
 	_pending_job_cache = NULL;
+	kmem_cache_destroy(_md_sector_cache);
+	_md_sector_cache = NULL;
+	kmem_cache_destroy(_md_block_cache);
+	_md_block_cache = NULL;
 }
 
 static int 
@@ -575,10 +670,43 @@ flashcache_kcached_init(struct cache_c *dmc)
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
 	int r;
+#endif
 
+	dmc->job_queues = alloc_percpu(struct flashcache_job_queue);
+	if (dmc->job_queues == NULL) {
+		DMERR("flashcache_kcached_init: Could not allocate job queues");
+		return -ENOMEM;
+	}
+	flashcache_job_queues_init(dmc);
+	/* One bound worker thread per CPU, jobs run where they were queued */
+	dmc->kcached_wq = create_workqueue("kcached");
+	if (dmc->kcached_wq == NULL) {
+		DMERR("flashcache_kcached_init: Could not create workqueue");
+		free_percpu(dmc->job_queues);
+		return -ENOMEM;
+	}
+	/* Md work that waits, for memory or on sync IO, so IO completions don't */
+	dmc->md_wq = create_singlethread_workqueue("flashcache_md");
+	if (dmc->md_wq == NULL) {
+		DMERR("flashcache_kcached_init: Could not create md workqueue");
+		destroy_workqueue(dmc->kcached_wq);
+		free_percpu(dmc->job_queues);
+		return -ENOMEM;
+	}
+	spin_lock_init(&dmc->md_alloc_lock);
+	dmc->md_alloc_jobs = NULL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&dmc->md_alloc_work, flashcache_md_alloc_wait, dmc);
+#else
+	INIT_WORK(&dmc->md_alloc_work, flashcache_md_alloc_wait);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
 	r = dm_io_get(FLASHCACHE_ASYNC_SIZE);
 	if (r) {
 		DMERR("flashcache_kcached_init: Could not resize dm io pool");
+		destroy_workqueue(dmc->md_wq);
+		destroy_workqueue(dmc->kcached_wq);
+		free_percpu(dmc->job_queues);
 		return r;
 	}
 #endif
@@ -593,116 +721,269 @@ flashcache_kcached_client_destroy(struct cache_c *dmc)
 {
 	/* Wait for all IOs */
 	wait_event(dmc->destroyq, !atomic_read(&dmc->nr_jobs));	
+	destroy_workqueue(dmc->md_wq);
+	destroy_workqueue(dmc->kcached_wq);
+	free_percpu(dmc->job_queues);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
 	dm_io_put(FLASHCACHE_ASYNC_SIZE);
 #endif
 }
 
 /*
- * Write out the metadata one sector at a time.
- * Then dump out the superblock.
+ * The slot table goes out a METADATA_IO_BLOCKSIZE buffer at a time, with
+ * up to FLASHCACHE_MD_STORE_DEPTH writes in flight. A buffer is filled 
+ * while the ones before it are being written, and the superblock only 
+ * goes out once all of them have completed.
+ */
+struct flashcache_md_store {
+	struct cache_c			*dmc;
+	spinlock_t			lock;
+	wait_queue_head_t		wait;
+	struct flashcache_md_store_buf	*free;
+	int				nr_busy;	/* Buffers being written */
+	int				write_errors;
+};
+
+struct flashcache_md_store_buf {
+	struct flashcache_md_store	*store;
+	struct flashcache_md_store_buf	*next;	/* Free list */
+	struct flash_cacheblock		*buf;	/* METADATA_IO_BLOCKSIZE */
+	int				md_block;	/* First md block in the buffer */
+	int				nr_md_blocks;
+};
+
+static void
+flashcache_md_store_callback(unsigned long error, void *context)
+{
+	struct flashcache_md_store_buf *sbuf = 
+		(struct flashcache_md_store_buf *)context;
+	struct flashcache_md_store *store = sbuf->store;
+	struct cache_c *dmc = store->dmc;
+	unsigned long flags;
+	int i;
+
+	if (error) {
+		DMERR("flashcache_md_store: Could not write out cache metadata sector %lu error %lu !",
+		      (unsigned long)MD_BLOCK_TO_SECTOR(dmc, sbuf->md_block), error);
+		/* Still not on flash, try these again on the next store */
+		if (dmc->md_changed)
+			for (i = 0 ; i < sbuf->nr_md_blocks ; i++)
+				set_bit(sbuf->md_block + i, dmc->md_changed);
+	}
+	spin_lock_irqsave(&store->lock, flags);
+	if (error)
+		store->write_errors++;
+	sbuf->next = store->free;
+	store->free = sbuf;
+	store->nr_busy--;
+	wake_up(&store->wait);
+	spin_unlock_irqrestore(&store->lock, flags);
+}
+
+/* 
+ * Has the md block changed since the slot table was last written out
+ * whole ? Clears the mark, the block is about to be written.
+ */
+static int
+flashcache_md_store_changed(struct cache_c *dmc, int md_block)
+{
+	int changed;
+
+	changed = test_and_clear_bit(md_block, dmc->md_changed);
+	/* Journaled updates the checkpoint hasn't written back yet */
+	if (dmc->journal && test_bit(md_block, dmc->journal->md_dirty))
+		changed = 1;
+	/* Never written since a lazy create */
+	if (dmc->md_lazy && 
+	    !test_bit(MD_SUMMARY_TO_FORMAT(md_block >> dmc->md_summary_shift), 
+		      dmc->md_formatted))
+		changed = 1;
+	return changed;
+}
+
+/* Whether the slot of block "index" is on flash, not so for the unformatted runs of a lazy cache */
+static int
+flashcache_md_formatted(struct cache_c *dmc, int index)
+{
+	return !dmc->md_lazy || 
+		test_bit(MD_SUMMARY_TO_FORMAT(INDEX_TO_MD_SUMMARY(dmc, index)), 
+			 dmc->md_formatted);
+}
+
+/* Record which runs of the slot table a lazily created cache has written */
+static void
+flashcache_md_lazy_header(struct cache_c *dmc, struct flash_superblock *header)
+{
+	int i;
+
+	if (!dmc->md_lazy)
+		return;
+	header->cache_flags |= FLASHCACHE_SB_LAZY;
+	header->cache_summary_shift = dmc->md_summary_shift;
+	memset(header->cache_formatted, 0, sizeof(header->cache_formatted));
+	for (i = 0 ; i < FLASHCACHE_SB_FORMAT_BITS ; i++)
+		if (test_bit(i, dmc->md_formatted))
+			header->cache_formatted[i / 32] |= 1 << (i % 32);
+}
+
+/*
+ * Write out the slot table, only the md blocks changed since the cache was
+ * loaded if md_store_incremental is set and the table on flash is known
+ * to be otherwise current. Then dump out the superblock.
  */
 static int 
 flashcache_md_store(struct cache_c *dmc)
 {
-	struct flash_cacheblock *meta_data_cacheblock, *next_ptr;
+	struct flashcache_md_store store;
+	struct flashcache_md_store_buf *sbuf;
 	struct flash_superblock *header;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 	struct io_region where;
 #else
 	struct dm_io_region where;
 #endif
-	int i, j;
+	int i;
 	int num_valid = 0, num_dirty = 0;
 	int error;
 	int write_errors = 0;
 	int sectors_written = 0, sectors_expected = 0; /* debug */
-	int slots_written = 0; /* How many cache slots did we fill in this MD io block ? */
-
-	meta_data_cacheblock = (struct flash_cacheblock *)vmalloc(METADATA_IO_BLOCKSIZE);
-	if (!meta_data_cacheblock) {
+	int nr_md_blocks = INDEX_TO_MD_BLOCK(dmc, dmc->size - 1) + 1;
+	int max_md_blocks = METADATA_IO_BLOCKSIZE_SECT / dmc->md_block_size;
+	int md_block, count;
+	int incremental;
+	unsigned long start = jiffies;
+	unsigned long summary[BITS_TO_LONGS(FLASHCACHE_SB_SUMMARY_BITS)];
+
+	/* Part of the table never made it in, leave the one on flash alone */
+	if (dmc->md_load_error) {
+		DMERR("flashcache_md_store: Slot table not fully loaded, not writing it out");
+		return 1;
+	}
+	memset(&store, 0, sizeof(struct flashcache_md_store));
+	store.dmc = dmc;
+	spin_lock_init(&store.lock);
+	init_waitqueue_head(&store.wait);
+	for (i = 0 ; i < FLASHCACHE_MD_STORE_DEPTH ; i++) {
+		sbuf = kzalloc(sizeof(struct flashcache_md_store_buf), GFP_KERNEL);
+		if (sbuf == NULL)
+			break;
+		sbuf->buf = (struct flash_cacheblock *)vmalloc(METADATA_IO_BLOCKSIZE);
+		if (sbuf->buf == NULL) {
+			kfree(sbuf);
+			break;
+		}
+		sbuf->store = &store;
+		sbuf->next = store.free;
+		store.free = sbuf;
+	}
+	/* Fewer buffers only mean fewer writes in flight */
+	if (store.free == NULL) {
 		DMERR("flashcache_md_store: Unable to allocate memory");
 		DMERR("flashcache_md_store: Could not write out cache metadata !");
 		return 1;
 	}	
 
-	where.bdev = dmc->cache_dev->bdev;
-	where.sector = 1;
-	slots_written = 0;
-	next_ptr = meta_data_cacheblock;
-	j = MD_BLOCKS_PER_SECTOR;
+	bitmap_zero(summary, FLASHCACHE_SB_SUMMARY_BITS);
 	for (i = 0 ; i < dmc->size ; i++) {
 		if (dmc->cache[i].cache_state & VALID)
 			num_valid++;
-		if (dmc->cache[i].cache_state & DIRTY)
+		if (dmc->cache[i].cache_state & DIRTY) {
 			num_dirty++;
-		next_ptr->dbn = dmc->cache[i].dbn;
+			set_bit(INDEX_TO_MD_SUMMARY(dmc, i), summary);
+		}
+	}
+	/* 
+	 * Checksums are updated on rewrites of VALID blocks without a hash
+	 * insert or remove, so with those the whole table has to go out.
+	 */
 #ifdef FLASHCACHE_DO_CHECKSUMS
-		next_ptr->checksum = dmc->cache[i].checksum;
-#endif
-		next_ptr->cache_state = dmc->cache[i].cache_state & 
-			(INVALID | VALID | DIRTY);
-		next_ptr++;
-		slots_written++;
-		j--;
-		if (j == 0) {
-			/* 
-			 * Filled the sector, goto the next sector.
-			 */
-			if (slots_written == MD_BLOCKS_PER_SECTOR * METADATA_IO_BLOCKSIZE_SECT) {
-				/*
-				 * Wrote out an entire metadata IO block, write the block to the ssd.
-				 */
-				where.count = slots_written / MD_BLOCKS_PER_SECTOR;
-				slots_written = 0;
-				sectors_written += where.count;	/* debug */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
-				error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, meta_data_cacheblock);
+	incremental = 0;
 #else
-				error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, meta_data_cacheblock);
+	incremental = sysctl_flashcache_md_store_incremental && 
+		dmc->md_changed && !dmc->md_stale;
 #endif
-				if (error) {
-					write_errors++;
-					DMERR("flashcache_md_store: Could not write out cache metadata sector %lu error %d !",
-					      where.sector, error);
-				}
-				where.sector += where.count;	/* Advance offset */
-			}
-			/* Move next slot pointer into next sector */
-			next_ptr = (struct flash_cacheblock *)
-				((caddr_t)meta_data_cacheblock + ((slots_written / MD_BLOCKS_PER_SECTOR) * 512));
-			j = MD_BLOCKS_PER_SECTOR;
+	/* The whole table going out, nothing is left to catch up on */
+	if (!incremental && dmc->md_changed)
+		memset(dmc->md_changed, 0, 
+		       BITS_TO_LONGS(nr_md_blocks) * sizeof(unsigned long));
+	where.bdev = dmc->cache_dev->bdev;
+	md_block = 0;
+	while (md_block < nr_md_blocks) {
+		if (incremental) {
+			/* Skip ahead to the next changed md block */
+			while (md_block < nr_md_blocks && 
+			       !flashcache_md_store_changed(dmc, md_block))
+				md_block++;
+			if (md_block == nr_md_blocks)
+				break;
 		}
-	}
-	if (next_ptr != meta_data_cacheblock) {
-		/* Write the remaining last sectors out */
-		VERIFY(slots_written > 0);
-		where.count = slots_written / MD_BLOCKS_PER_SECTOR;
-		if (slots_written % MD_BLOCKS_PER_SECTOR)
-			where.count++;
-		sectors_written += where.count;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
-		error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, meta_data_cacheblock);
+		/* Only we take buffers off the free list */
+		wait_event(store.wait, store.free != NULL);
+		spin_lock_irq(&store.lock);
+		sbuf = store.free;
+		store.free = sbuf->next;
+		store.nr_busy++;
+		spin_unlock_irq(&store.lock);
+		/* A run of md blocks, the whole rest of the table if not incremental */
+		count = 0;
+		do {
+			flashcache_md_fill_sector(dmc, 
+				(struct flash_cacheblock *)((caddr_t)sbuf->buf + 
+							    count * dmc->md_block_size * 512),
+				md_block + count);
+			count++;
+		} while (count < max_md_blocks && md_block + count < nr_md_blocks &&
+			 (!incremental || flashcache_md_store_changed(dmc, md_block + count)));
+		sbuf->md_block = md_block;
+		sbuf->nr_md_blocks = count;
+		where.sector = MD_BLOCK_TO_SECTOR(dmc, md_block);
+		where.count = count * dmc->md_block_size;
+		sectors_written += where.count;	/* debug */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+		dm_io_async_vm(1, &where, WRITE, sbuf->buf, 
+			       flashcache_md_store_callback, sbuf);
 #else
-		error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, meta_data_cacheblock);
+		flashcache_dm_io_async_vm(dmc, 1, &where, WRITE, sbuf->buf, 
+					  flashcache_md_store_callback, sbuf);
 #endif
-		if (error) {
-			write_errors++;
-				DMERR("flashcache_md_store: Could not write out cache metadata sector %lu error %d !",
-				      where.sector, error);
-		}
+		flashcache_unplug_device(where.bdev);
+		md_block += count;
+		/* 
+		 * An incremental run ends at a block that hasn't changed (its mark
+		 * is already clear), no need to look at it again.
+		 */
+		if (incremental && count < max_md_blocks)
+			md_block++;
+	}
+	wait_event(store.wait, store.nr_busy == 0);
+	/* The last callback may still be dropping the lock */
+	spin_lock_irq(&store.lock);
+	write_errors = store.write_errors;
+	spin_unlock_irq(&store.lock);
+	if (!incremental && write_errors == 0)
+		dmc->md_stale = 0;
+	/* The unformatted runs were written as changed */
+	if (dmc->md_lazy && write_errors == 0) {
+		bitmap_fill(dmc->md_formatted, FLASHCACHE_SB_FORMAT_BITS);
+		dmc->md_lazy = 0;
+	}
+	while ((sbuf = store.free) != NULL) {
+		store.free = sbuf->next;
+		vfree((void *)sbuf->buf);
+		kfree(sbuf);
 	}
 	/* Debug Tests */
-	sectors_expected = dmc->size / MD_BLOCKS_PER_SECTOR;
-	if (dmc->size % MD_BLOCKS_PER_SECTOR)
-		sectors_expected++;
-	if (sectors_expected != sectors_written) {
-		printk("flashcache_md_store" "Sector Mismatch ! sectors_expected=%d, sectors_written=%d\n",
-		       sectors_expected, sectors_written);
-		panic("flashcache_md_store: sector mismatch\n");
+	if (!incremental) {
+		sectors_expected = nr_md_blocks * dmc->md_block_size;
+		if (sectors_expected != sectors_written) {
+			printk("flashcache_md_store" "Sector Mismatch ! sectors_expected=%d, sectors_written=%d\n",
+			       sectors_expected, sectors_written);
+			panic("flashcache_md_store: sector mismatch\n");
+		}
 	}
-
-	vfree((void *)meta_data_cacheblock);
+	DMINFO("flashcache_md_store: %d of %d md sectors written in %ums", 
+	       sectors_written, nr_md_blocks * dmc->md_block_size,
+	       jiffies_to_msecs(jiffies - start));
 
 	header = (struct flash_superblock *)vmalloc(512);
 	if (!header) {
@@ -710,6 +991,7 @@ flashcache_md_store(struct cache_c *dmc)
 		DMERR("flashcache_md_store: Could not write out cache metadata !");
 		return 1;
 	}	
+	memset(header, 0, 512);
 	
 	/* Write the header out last */
 	if (write_errors == 0) {
@@ -727,6 +1009,27 @@ flashcache_md_store(struct cache_c *dmc)
 	header->cache_devsize = to_sector(dmc->cache_dev->bdev->bd_inode->i_size);
 	header->disk_devsize = to_sector(dmc->disk_dev->bdev->bd_inode->i_size);
 	header->cache_version = FLASHCACHE_VERSION;
+	header->cache_set_hash = dmc->set_hash;
+	header->cache_set_granule = 1 << dmc->granule_shift;
+	if (dmc->journal) {
+		header->cache_journal_sectors = 
+			dmc->journal->nr_records * FLASHCACHE_JOURNAL_RECORD_SECT;
+		header->cache_journal_gen = dmc->journal->gen;
+	} else {
+		header->cache_journal_sectors = 0;
+		header->cache_journal_gen = 0;
+	}
+	header->cache_md_block_size = dmc->md_block_size;
+	header->cache_flags = dmc->warm ? FLASHCACHE_SB_WARM : 0;
+	/* So a background load knows which chunks may hold DIRTY blocks */
+	if (dmc->md_summary_count && num_dirty) {
+		header->cache_flags |= FLASHCACHE_SB_SUMMARY;
+		header->cache_summary_shift = dmc->md_summary_shift;
+		for (i = 0 ; i < FLASHCACHE_SB_SUMMARY_BITS ; i++)
+			if (test_bit(i, summary))
+				header->cache_summary[i / 32] |= 1 << (i % 32);
+	}
+	flashcache_md_lazy_header(dmc, header);
 
 	DPRINTK("Store metadata to disk: block size(%u), cache size(%llu)" \
 	        "associativity(%u)",
@@ -763,8 +1066,200 @@ flashcache_md_store(struct cache_c *dmc)
 	return 0;
 }
 
+/*
+ * md blocks per dirty summary bit (log2). A bit covers whole slot table
+ * reads at load, and all of the slot table fits in the bits there are.
+ */
+static unsigned int
+flashcache_md_summary_shift(struct cache_c *dmc)
+{
+	int nr_md_blocks = INDEX_TO_MD_BLOCK(dmc, dmc->size - 1) + 1;
+	unsigned int shift = ffs(METADATA_IO_BLOCKSIZE_SECT / dmc->md_block_size) - 1;
+
+	while (((nr_md_blocks - 1) >> shift) >= FLASHCACHE_SB_SUMMARY_BITS)
+		shift++;
+	return shift;
+}
+
+/*
+ * Write the superblock of a live cache (DIRTY), with "summary" as its
+ * dirty summary.
+ */
+int
+flashcache_md_summary_store(struct cache_c *dmc, unsigned long *summary)
+{
+	struct flash_superblock *header;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+	struct io_region where;
+#else
+	struct dm_io_region where;
+#endif
+	int i, error;
+
+	header = (struct flash_superblock *)vmalloc(512);
+	if (!header) {
+		DMERR("flashcache_md_summary_store: Unable to allocate memory");
+		return -ENOMEM;
+	}
+	memset(header, 0, 512);
+	header->cache_sb_state = CACHE_MD_STATE_DIRTY;
+	header->block_size = dmc->block_size;
+	header->size = dmc->size;
+	header->assoc = dmc->assoc;
+	strncpy(header->disk_devname, dmc->disk_devname, DEV_PATHLEN);
+	strncpy(header->cache_devname, dmc->cache_devname, DEV_PATHLEN);
+	header->cache_devsize = to_sector(dmc->cache_dev->bdev->bd_inode->i_size);
+	header->disk_devsize = to_sector(dmc->disk_dev->bdev->bd_inode->i_size);
+	header->cache_version = FLASHCACHE_VERSION;
+	header->cache_set_hash = dmc->set_hash;
+	header->cache_set_granule = 1 << dmc->granule_shift;
+	if (dmc->journal) {
+		header->cache_journal_sectors = 
+			dmc->journal->nr_records * FLASHCACHE_JOURNAL_RECORD_SECT;
+		header->cache_journal_gen = dmc->journal->gen;
+	} else {
+		header->cache_journal_sectors = 0;
+		header->cache_journal_gen = 0;
+	}
+	header->cache_md_block_size = dmc->md_block_size;
+	header->cache_flags = FLASHCACHE_SB_SUMMARY;
+	header->cache_summary_shift = dmc->md_summary_shift;
+	for (i = 0 ; i < FLASHCACHE_SB_SUMMARY_BITS ; i++)
+		if (test_bit(i, summary))
+			header->cache_summary[i / 32] |= 1 << (i % 32);
+	flashcache_md_lazy_header(dmc, header);
+	where.bdev = dmc->cache_dev->bdev;
+	where.sector = 0;
+	where.count = 1;
+	error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, header);
+	if (error)
+		DMERR("flashcache_md_summary_store: Could not write cache superblock sector %lu error %d !",
+		      where.sector, error);
+	vfree((void *)header);
+	return error;
+}
+
+/*
+ * Lazily created caches. Write out the runs of the slot table under the 
+ * dirty summary bits in "summary" that haven't been yet, before the bits
+ * go on flash. None of their slots can say DIRTY on flash until then, and
+ * lazy caches aren't warm, so they go out INVALID. That needs no stripe 
+ * locks, the in-core state isn't looked at. Runs on md_wq, from the 
+ * summary work.
+ */
+int
+flashcache_md_format(struct cache_c *dmc, unsigned long *summary)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+	struct io_region where;
+#else
+	struct dm_io_region where;
+#endif
+	int nr_md_blocks = INDEX_TO_MD_BLOCK(dmc, dmc->size - 1) + 1;
+	int max_md_blocks = METADATA_IO_BLOCKSIZE_SECT / dmc->md_block_size;
+	int per_bit = (FLASHCACHE_SB_SUMMARY_BITS / FLASHCACHE_SB_FORMAT_BITS) << 
+		dmc->md_summary_shift;
+	int slots = MD_SLOTS_PER_BLOCK(dmc->md_block_size);
+	int bit, format_bit, md_block, end, count, i, j;
+	struct flash_cacheblock *md_sector;
+	void *buf = NULL;
+	int error = 0;
+
+	where.bdev = dmc->cache_dev->bdev;
+	for (bit = find_first_bit(summary, FLASHCACHE_SB_SUMMARY_BITS) ;
+	     bit < FLASHCACHE_SB_SUMMARY_BITS ;
+	     bit = find_next_bit(summary, FLASHCACHE_SB_SUMMARY_BITS, bit + 1)) {
+		format_bit = MD_SUMMARY_TO_FORMAT(bit);
+		if (test_bit(format_bit, dmc->md_formatted))
+			continue;
+		if (buf == NULL) {
+			buf = vmalloc(METADATA_IO_BLOCKSIZE);
+			if (buf == NULL) {
+				DMERR("flashcache_md_format: Unable to allocate memory");
+				return -ENOMEM;
+			}
+			memset(buf, 0, METADATA_IO_BLOCKSIZE);
+			for (i = 0 ; i < max_md_blocks ; i++) {
+				md_sector = (struct flash_cacheblock *)
+					((caddr_t)buf + i * dmc->md_block_size * 512);
+				for (j = 0 ; j < slots ; j++)
+					md_sector[j].cache_state = INVALID;
+			}
+		}
+		md_block = format_bit * per_bit;
+		end = min(nr_md_blocks, md_block + per_bit);
+		while (md_block < end) {
+			count = min(max_md_blocks, end - md_block);
+			where.sector = MD_BLOCK_TO_SECTOR(dmc, md_block);
+			where.count = count * dmc->md_block_size;
+			error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, buf);
+			if (error) {
+				DMERR("flashcache_md_format: Could not write cache metadata sector %lu error %d !",
+				      where.sector, error);
+				goto out;
+			}
+			md_block += count;
+		}
+		set_bit(format_bit, dmc->md_formatted);
+		FLASHCACHE_STATS_INC(dmc, md_formats);
+	}
+out:
+	vfree(buf);
+	return error;
+}
+
+/*
+ * Zero the journal ring of a new cache, so no stale record on the ssd can
+ * pass for one of ours.
+ */
+static int
+flashcache_journal_format(struct cache_c *dmc)
+{
+	struct flashcache_journal *jnl = dmc->journal;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+	struct io_region where;
+#else
+	struct dm_io_region where;
+#endif
+	int ring_sectors = jnl->nr_records * FLASHCACHE_JOURNAL_RECORD_SECT;
+	int i, error;
+
+	memset(jnl->ckpt_buf, 0, METADATA_IO_BLOCKSIZE);
+	where.bdev = dmc->cache_dev->bdev;
+	for (i = 0 ; i < ring_sectors ; i += where.count) {
+		where.sector = jnl->start + i;
+		where.count = min(ring_sectors - i, (int)METADATA_IO_BLOCKSIZE_SECT);
+		error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, jnl->ckpt_buf);
+		if (error) {
+			DMERR("flashcache_md_create: Could not write journal sector %lu error %d !",
+			      where.sector, error);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void flashcache_sets_parallel(struct cache_c *dmc, 
+				     void (*init)(struct cache_c *, int, int));
+
+/* Mark the slots of sets [start_set, end_set) INVALID, for a new cache */
+static void
+flashcache_md_create_init_range(struct cache_c *dmc, int start_set, int end_set)
+{
+	int i, end = end_set * dmc->assoc;
+
+	for (i = start_set * dmc->assoc ; i < end ; i++) {
+		dmc->cache_tag[i] = 0;
+#ifdef FLASHCACHE_DO_CHECKSUMS
+		dmc->cache[i].checksum = 0;
+#endif
+		dmc->cache[i].cache_state = INVALID;
+		dmc->cache[i].nr_queued = 0;
+	}
+}
+
 static int 
-flashcache_md_create(struct cache_c *dmc, int force)
+flashcache_md_create(struct cache_c *dmc, int force, int journal_sectors)
 {
 	struct flash_cacheblock *meta_data_cacheblock, *next_ptr;
 	struct flash_superblock *header;
@@ -778,6 +1273,7 @@ flashcache_md_create(struct cache_c *dmc, int force)
 	sector_t order;
 	int sectors_written = 0, sectors_expected = 0; /* debug */
 	int slots_written = 0; /* How many cache slots did we fill in this MD io block ? */
+	int slots_per_block = MD_SLOTS_PER_BLOCK(dmc->md_block_size);
 	
 	header = (struct flash_superblock *)vmalloc(512);
 	if (!header) {
@@ -808,12 +1304,14 @@ flashcache_md_create(struct cache_c *dmc, int force)
 	}
 	/* Compute the size of the metadata, including header. 
 	   Note dmc->size is in raw sectors */
-	dmc->md_sectors = INDEX_TO_MD_SECTOR(dmc->size / dmc->block_size) + 1 + 1;
-	dmc->size -= dmc->md_sectors;	/* total sectors available for cache */
+	order = dmc->size;
+	dmc->size /= dmc->block_size;
+	dmc->md_sectors = MD_JOURNAL_START(dmc) + journal_sectors;
+	dmc->size = order - dmc->md_sectors;	/* total sectors available for cache */
 	dmc->size /= dmc->block_size;
 	dmc->size = (dmc->size / dmc->assoc) * dmc->assoc;	
 	/* Recompute since dmc->size was possibly trunc'ed down */
-	dmc->md_sectors = INDEX_TO_MD_SECTOR(dmc->size) + 1 + 1;
+	dmc->md_sectors = MD_JOURNAL_START(dmc) + journal_sectors;
 	DMINFO("flashcache_md_create: md_sectors = %d\n", dmc->md_sectors);
 	dev_size = to_sector(dmc->cache_dev->bdev->bd_inode->i_size);
 	cache_size = dmc->md_sectors + (dmc->size * dmc->block_size);
@@ -824,27 +1322,34 @@ flashcache_md_create(struct cache_c *dmc, int force)
 		vfree((void *)header);
 		return 1;
 	}
-	order = dmc->size * sizeof(struct cacheblock);
+	order = dmc->size * (sizeof(struct cacheblock) + sizeof(u_int32_t));
 	DMINFO("Allocate %luKB (%luB per) mem for %lu-entry cache" \
 	       "(capacity:%luMB, associativity:%u, block size:%u " \
 	       "sectors(%uKB))",
-	       order >> 10, sizeof(struct cacheblock), dmc->size,
+	       order >> 10, sizeof(struct cacheblock) + sizeof(u_int32_t), dmc->size,
 	       cache_size >> (20-SECTOR_SHIFT), dmc->assoc, dmc->block_size,
 	       dmc->block_size >> (10-SECTOR_SHIFT));
-	dmc->cache = (struct cacheblock *)vmalloc(order);
-	if (!dmc->cache) {
+	dmc->cache = (struct cacheblock *)vmalloc(dmc->size * sizeof(struct cacheblock));
+	dmc->cache_tag = (u_int32_t *)vmalloc(dmc->size * sizeof(u_int32_t));
+	if (!dmc->cache || !dmc->cache_tag) {
 		vfree((void *)header);
+		vfree((void *)dmc->cache);
+		vfree((void *)dmc->cache_tag);
 		DMERR("flashcache_md_create: Unable to allocate cache md");
 		return 1;
 	}
 	/* Initialize the cache structs */
-	for (i = 0; i < dmc->size ; i++) {
-		dmc->cache[i].dbn = 0;
-#ifdef FLASHCACHE_DO_CHECKSUMS
-		dmc->cache[i].checksum = 0;
-#endif
-		dmc->cache[i].cache_state = INVALID;
-		dmc->cache[i].nr_queued = 0;
+	flashcache_sets_parallel(dmc, flashcache_md_create_init_range);
+	/* 
+	 * A lazy create only writes the superblock. Each run of the slot table
+	 * is written once a block in it is first dirtied (flashcache_md_format()),
+	 * or at remove. Warm caches keep the VALID slots, they need all of it.
+	 */
+	dmc->md_summary_shift = flashcache_md_summary_shift(dmc);
+	if (sysctl_flashcache_lazy_create && !dmc->warm) {
+		dmc->md_lazy = 1;
+		bitmap_zero(dmc->md_formatted, FLASHCACHE_SB_FORMAT_BITS);
+		goto journal;
 	}
 	meta_data_cacheblock = (struct flash_cacheblock *)vmalloc(METADATA_IO_BLOCKSIZE);
 	if (!meta_data_cacheblock) {
@@ -852,12 +1357,12 @@ flashcache_md_create(struct cache_c *dmc, int force)
 		DMERR("flashcache_md_store: Could not write out cache metadata !");
 		return 1;
 	}	
-	where.sector = 1;
+	where.sector = MD_BLOCK_TO_SECTOR(dmc, 0);
 	slots_written = 0;
 	next_ptr = meta_data_cacheblock;
-	j = MD_BLOCKS_PER_SECTOR;
+	j = slots_per_block;
 	for (i = 0 ; i < dmc->size ; i++) {
-		next_ptr->dbn = dmc->cache[i].dbn;
+		next_ptr->dbn = flashcache_get_dbn(dmc, i);
 #ifdef FLASHCACHE_DO_CHECKSUMS
 		next_ptr->checksum = dmc->cache[i].checksum;
 #endif
@@ -868,13 +1373,14 @@ flashcache_md_create(struct cache_c *dmc, int force)
 		j--;
 		if (j == 0) {
 			/* 
-			 * Filled the sector, goto the next sector.
+			 * Filled the md block, goto the next md block.
 			 */
-			if (slots_written == MD_BLOCKS_PER_SECTOR * METADATA_IO_BLOCKSIZE_SECT) {
+			if (slots_written == slots_per_block * 
+			    (METADATA_IO_BLOCKSIZE_SECT / dmc->md_block_size)) {
 				/*
 				 * Wrote out an entire metadata IO block, write the block to the ssd.
 				 */
-				where.count = slots_written / MD_BLOCKS_PER_SECTOR;
+				where.count = (slots_written / slots_per_block) * dmc->md_block_size;
 				slots_written = 0;
 				sectors_written += where.count;	/* debug */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
@@ -888,24 +1394,27 @@ flashcache_md_create(struct cache_c *dmc, int force)
 					vfree((void *)header);
 					vfree((void *)meta_data_cacheblock);
 					vfree(dmc->cache);
+					vfree(dmc->cache_tag);
 					DMERR("flashcache_md_create: Could not write  cache metadata sector %lu error %d !",
 					      where.sector, error);
 					return 1;
 				}
 				where.sector += where.count;	/* Advance offset */
 			}
-			/* Move next slot pointer into next sector */
+			/* Move next slot pointer into next md block */
 			next_ptr = (struct flash_cacheblock *)
-				((caddr_t)meta_data_cacheblock + ((slots_written / MD_BLOCKS_PER_SECTOR) * 512));
-			j = MD_BLOCKS_PER_SECTOR;
+				((caddr_t)meta_data_cacheblock + 
+				 (slots_written / slots_per_block) * dmc->md_block_size * 512);
+			j = slots_per_block;
 		}
 	}
 	if (next_ptr != meta_data_cacheblock) {
 		/* Write the remaining last sectors out */
 		VERIFY(slots_written > 0);
-		where.count = slots_written / MD_BLOCKS_PER_SECTOR;
-		if (slots_written % MD_BLOCKS_PER_SECTOR)
+		where.count = slots_written / slots_per_block;
+		if (slots_written % slots_per_block)
 			where.count++;
+		where.count *= dmc->md_block_size;
 		sectors_written += where.count;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
 		error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, meta_data_cacheblock);
@@ -916,60 +1425,725 @@ flashcache_md_create(struct cache_c *dmc, int force)
 			vfree((void *)header);
 			vfree((void *)meta_data_cacheblock);
 			vfree(dmc->cache);
+			vfree(dmc->cache_tag);
 			DMERR("flashcache_md_create: Could not write  cache metadata sector %lu error %d !",
 			      where.sector, error);
 			return 1;		
 		}
 	}
 	/* Debug Tests */
-	sectors_expected = dmc->size / MD_BLOCKS_PER_SECTOR;
-	if (dmc->size % MD_BLOCKS_PER_SECTOR)
+	sectors_expected = dmc->size / slots_per_block;
+	if (dmc->size % slots_per_block)
 		sectors_expected++;
+	sectors_expected *= dmc->md_block_size;
 	if (sectors_expected != sectors_written) {
 		printk("flashcache_md_create" "Sector Mismatch ! sectors_expected=%d, sectors_written=%d\n",
 		       sectors_expected, sectors_written);
 		panic("flashcache_md_create: sector mismatch\n");
 	}
-	vfree((void *)meta_data_cacheblock);
-	/* Write the header */
-	header->cache_sb_state = CACHE_MD_STATE_DIRTY;
-	header->block_size = dmc->block_size;
-	header->size = dmc->size;
-	header->assoc = dmc->assoc;
-	strncpy(header->disk_devname, dmc->disk_devname, DEV_PATHLEN);
-	strncpy(header->cache_devname, dmc->cache_devname, DEV_PATHLEN);
-	header->cache_devsize = to_sector(dmc->cache_dev->bdev->bd_inode->i_size);
-	header->disk_devsize = to_sector(dmc->disk_dev->bdev->bd_inode->i_size);
-	header->cache_version = FLASHCACHE_VERSION;
-	where.sector = 0;
-	where.count = 1;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
-	error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, header);
-#else
-	error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, header);
-#endif
-	if (error) {
-		vfree((void *)header);
-		vfree(dmc->cache);
-		DMERR("flashcache_md_create: Could not write cache superblock sector %lu error %d !",
-		      where.sector, error);
-		return 1;		
+	vfree((void *)meta_data_cacheblock);
+journal:
+	/* The journal ring sits between the slot table and the cached data */
+	if (journal_sectors) {
+		if (flashcache_journal_alloc(dmc, MD_JOURNAL_START(dmc), journal_sectors) ||
+		    flashcache_journal_format(dmc)) {
+			vfree((void *)header);
+			vfree(dmc->cache);
+			vfree(dmc->cache_tag);
+			DMERR("flashcache_md_create: Could not set up the md journal");
+			return 1;
+		}
+		dmc->journal->gen = 1;
+	}
+	/* Write the header */
+	header->cache_sb_state = CACHE_MD_STATE_DIRTY;
+	header->block_size = dmc->block_size;
+	header->size = dmc->size;
+	header->assoc = dmc->assoc;
+	strncpy(header->disk_devname, dmc->disk_devname, DEV_PATHLEN);
+	strncpy(header->cache_devname, dmc->cache_devname, DEV_PATHLEN);
+	header->cache_devsize = to_sector(dmc->cache_dev->bdev->bd_inode->i_size);
+	header->disk_devsize = to_sector(dmc->disk_dev->bdev->bd_inode->i_size);
+	header->cache_version = FLASHCACHE_VERSION;
+	header->cache_set_hash = dmc->set_hash;
+	header->cache_set_granule = 1 << dmc->granule_shift;
+	header->cache_journal_sectors = journal_sectors;
+	header->cache_journal_gen = journal_sectors ? dmc->journal->gen : 0;
+	header->cache_md_block_size = dmc->md_block_size;
+	header->cache_flags = dmc->warm ? FLASHCACHE_SB_WARM : 0;
+	flashcache_md_lazy_header(dmc, header);
+	where.sector = 0;
+	where.count = 1;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
+	error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, header);
+#else
+	error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, header);
+#endif
+	if (error) {
+		vfree((void *)header);
+		vfree(dmc->cache);
+		vfree(dmc->cache_tag);
+		DMERR("flashcache_md_create: Could not write cache superblock sector %lu error %d !",
+		      where.sector, error);
+		return 1;		
+	}
+	vfree((void *)header);
+	return 0;
+}
+
+struct flashcache_journal_seq {
+	u_int64_t	seq;
+	int		slot;
+};
+
+static int
+flashcache_journal_seq_cmp(const void *a, const void *b)
+{
+	const struct flashcache_journal_seq *x = a, *y = b;
+
+	if (x->seq < y->seq)
+		return -1;
+	return (x->seq > y->seq);
+}
+
+/*
+ * Replay the journal records of the last run over the slot table just 
+ * loaded, oldest first, and write the sectors they touch back so the ring
+ * can be reused. Only done after an unclean shutdown, so only the blocks 
+ * the journal leaves DIRTY are kept. A record that failed to write can 
+ * leave one from a ring's length back in its slot, the window skips it.
+ */
+static int
+flashcache_journal_replay(struct cache_c *dmc, u_int32_t gen, 
+			  int *num_valid, int *dirty_loaded, void *block)
+{
+	struct flashcache_journal *jnl = dmc->journal;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+	struct io_region where;
+#else
+	struct dm_io_region where;
+#endif
+	struct flashcache_journal_seq *seqs;
+	struct flash_journal_header *header;
+	struct flash_journal_entry *entry;
+	struct cacheblock *cacheblk;
+	int ring_sectors = jnl->nr_records * FLASHCACHE_JOURNAL_RECORD_SECT;
+	int i, j, nr_valid = 0, nr_replayed = 0, nr_entries = 0, error = 0;
+	u_int32_t crc;
+	void *ring;
+
+	ring = vmalloc(ring_sectors * 512);
+	seqs = (struct flashcache_journal_seq *)
+		vmalloc(jnl->nr_records * sizeof(struct flashcache_journal_seq));
+	if (!ring || !seqs) {
+		DMERR("flashcache_md_load: Unable to allocate memory");
+		error = -ENOMEM;
+		goto out;
+	}
+	where.bdev = dmc->cache_dev->bdev;
+	for (i = 0 ; i < ring_sectors ; i += where.count) {
+		where.sector = jnl->start + i;
+		where.count = min(ring_sectors - i, (int)METADATA_IO_BLOCKSIZE_SECT);
+		error = flashcache_dm_io_sync_vm(dmc, &where, READ, (caddr_t)ring + i * 512);
+		if (error) {
+			DMERR("flashcache_md_load: Could not read journal sector %lu error %d !",
+			      where.sector, error);
+			goto out;
+		}
+	}
+	for (i = 0 ; i < jnl->nr_records ; i++) {
+		header = (struct flash_journal_header *)
+			((caddr_t)ring + i * FLASHCACHE_JOURNAL_RECORD_SIZE);
+		if (header->magic != FLASHCACHE_JOURNAL_MAGIC || header->gen != gen ||
+		    header->nr_entries > FLASHCACHE_JOURNAL_ENTRIES)
+			continue;
+		crc = header->crc;
+		header->crc = 0;
+		if (crc32c(~0, header, FLASHCACHE_JOURNAL_RECORD_SIZE) != crc)
+			continue;
+		seqs[nr_valid].seq = header->seq;
+		seqs[nr_valid].slot = i;
+		nr_valid++;
+	}
+	sort(seqs, nr_valid, sizeof(struct flashcache_journal_seq), 
+	     flashcache_journal_seq_cmp, NULL);
+	for (i = 0 ; i < nr_valid ; i++) {
+		if (seqs[i].seq + jnl->nr_records <= seqs[nr_valid - 1].seq)
+			continue;
+		header = (struct flash_journal_header *)
+			((caddr_t)ring + seqs[i].slot * FLASHCACHE_JOURNAL_RECORD_SIZE);
+		entry = FLASHCACHE_JOURNAL_RECORD_ENTRIES(header);
+		for (j = 0 ; j < header->nr_entries ; j++, entry++) {
+			if (entry->index >= dmc->size)
+				continue;
+			cacheblk = &dmc->cache[entry->index];
+			if (cacheblk->cache_state & DIRTY)
+				(*dirty_loaded)--;
+			if (cacheblk->cache_state & VALID)
+				(*num_valid)--;
+			/* Warm caches keep the clean blocks too */
+			if ((entry->cache_state & DIRTY) || 
+			    (dmc->warm && (entry->cache_state & VALID))) {
+				cacheblk->cache_state = entry->cache_state & (VALID | DIRTY);
+				flashcache_set_dbn(dmc, entry->index, entry->dbn);
+#ifdef FLASHCACHE_DO_CHECKSUMS
+				error = flashcache_read_compute_checksum(dmc, entry->index, block);
+				if (error) {
+					DMERR("flashcache_md_load: Could not read cache block sector %lu error %d !",
+					      entry->dbn, error);
+					goto out;
+				}
+#endif
+				if (entry->cache_state & DIRTY)
+					(*dirty_loaded)++;
+				(*num_valid)++;
+			} else {
+				cacheblk->cache_state = INVALID;
+				dmc->cache_tag[entry->index] = 0;
+#ifdef FLASHCACHE_DO_CHECKSUMS
+				cacheblk->checksum = 0;
+#endif
+			}
+			set_bit(INDEX_TO_MD_BLOCK(dmc, entry->index), jnl->md_dirty);
+			nr_entries++;
+		}
+		nr_replayed++;
+	}
+	DMINFO("flashcache_md_load: Replayed %d md journal records, %d updates", 
+	       nr_replayed, nr_entries);
+	if (flashcache_journal_flush_md(dmc, 0)) {
+		DMERR("flashcache_md_load: Could not write back the md journal");
+		error = -EIO;
+	}
+out:
+	vfree(ring);
+	vfree((void *)seqs);
+	return error ? 1 : 0;
+}
+
+/*
+ * The slot table is read in METADATA_IO_BLOCKSIZE chunks, several at a 
+ * time. Each chunk is parsed into the incore metadata by a kcached worker
+ * as soon as its read completes, spread over the cpus, while the reads 
+ * behind it are still in flight. Chunks cover disjoint slots, so the 
+ * workers only share the counts.
+ */
+struct flashcache_md_load {
+	struct cache_c			*dmc;
+	spinlock_t			lock;
+	wait_queue_head_t		wait;
+	struct flashcache_md_load_chunk	*free;
+	int				nr_busy;	/* Chunks being read or parsed */
+	int				next_cpu;	/* Last cpu a chunk went to */
+	int				clean_shutdown;
+	int				warm;		/* Keep clean blocks after a crash */
+	int				error;
+	int				num_valid;
+	int				dirty_loaded;
+	/* Background load only (sysctl background_load) */
+	int				background;
+	int				nr_chunks;
+	int				next_chunk;	/* Sequential load cursor */
+	int				nr_skipped;	/* Chunks with no DIRTY blocks, not read */
+	unsigned long			*issued;	/* Bit per chunk read or skipped */
+	unsigned long			summary[BITS_TO_LONGS(FLASHCACHE_SB_SUMMARY_BITS)];
+	unsigned long			start;		/* jiffies */
+};
+
+struct flashcache_md_load_chunk {
+	struct flashcache_md_load	*load;
+	struct flashcache_md_load_chunk	*next;	/* Free list */
+	struct work_struct		work;
+	struct flash_cacheblock		*buf;	/* METADATA_IO_BLOCKSIZE */
+#ifdef FLASHCACHE_DO_CHECKSUMS
+	void				*block;	/* For checksumming cache blocks */
+#endif
+	sector_t			sector;
+	int				index;	/* First slot in the chunk */
+	int				nr_slots;
+	int				error;
+};
+
+static void flashcache_md_load_publish(struct flashcache_md_load *load, int index, 
+				       int nr_slots, int error);
+
+static void
+flashcache_md_load_chunk_free(struct flashcache_md_load_chunk *chunk)
+{
+	vfree((void *)chunk->buf);
+#ifdef FLASHCACHE_DO_CHECKSUMS
+	vfree(chunk->block);
+#endif
+	kfree(chunk);
+}
+
+static void
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+flashcache_md_load_parse(void *data)
+{
+	struct flashcache_md_load_chunk *chunk = (struct flashcache_md_load_chunk *)data;
+#else
+flashcache_md_load_parse(struct work_struct *work)
+{
+	struct flashcache_md_load_chunk *chunk = 
+		container_of(work, struct flashcache_md_load_chunk, work);
+#endif
+	struct flashcache_md_load *load = chunk->load;
+	struct cache_c *dmc = load->dmc;
+	int slots_per_block = MD_SLOTS_PER_BLOCK(dmc->md_block_size);
+	struct flash_cacheblock *next_ptr = chunk->buf;
+	int num_valid = 0, dirty_loaded = 0;
+	int error = chunk->error;
+	unsigned long flags;
+	int i, j;
+
+	if (error)
+		DMERR("flashcache_md_load: Could not read cache metadata sector %lu error %d !",
+		      chunk->sector, error);
+	for (i = chunk->index, j = 0 ; !error && j < chunk->nr_slots ; i++, j++) {
+		if ((j % slots_per_block) == 0) {
+			/* Move onto next md block */
+			next_ptr = (struct flash_cacheblock *)
+				((caddr_t)chunk->buf + 
+				 dmc->md_block_size * 512 * (j / slots_per_block));
+		}
+		dmc->cache[i].nr_queued = 0;
+		/* 
+		 * If unclean shutdown, only the DIRTY blocks are loaded, 
+		 * unless the cache is warm.
+		 */
+		if (load->clean_shutdown || (next_ptr->cache_state & DIRTY) ||
+		    (load->warm && (next_ptr->cache_state & VALID))) {
+			if (next_ptr->cache_state & DIRTY)
+				dirty_loaded++;
+			dmc->cache[i].cache_state = next_ptr->cache_state;
+			VERIFY((dmc->cache[i].cache_state & (VALID | INVALID)) 
+			       != (VALID | INVALID));
+			if (dmc->cache[i].cache_state & VALID)
+				num_valid++;
+			flashcache_set_dbn(dmc, i, next_ptr->dbn);
+#ifdef FLASHCACHE_DO_CHECKSUMS
+			if (load->clean_shutdown)
+				dmc->cache[i].checksum = next_ptr->checksum;
+			else {
+				error = flashcache_read_compute_checksum(dmc, i, chunk->block);
+				if (error)
+					DMERR("flashcache_md_load: Could not read cache block sector %lu error %d !",
+					      flashcache_get_dbn(dmc, i), error);
+			}
+#endif
+		} else {
+			dmc->cache[i].cache_state = INVALID;
+			dmc->cache_tag[i] = 0;
+#ifdef FLASHCACHE_DO_CHECKSUMS
+			dmc->cache[i].checksum = 0;
+#endif
+		}
+		next_ptr++;
+	}
+	if (load->background)
+		flashcache_md_load_publish(load, chunk->index, chunk->nr_slots, error);
+	spin_lock_irqsave(&load->lock, flags);
+	if (error && !load->error)
+		load->error = error;
+	load->num_valid += num_valid;
+	load->dirty_loaded += dirty_loaded;
+	chunk->next = load->free;
+	load->free = chunk;
+	load->nr_busy--;
+	wake_up(&load->wait);
+	spin_unlock_irqrestore(&load->lock, flags);
+}
+
+static void
+flashcache_md_load_callback(unsigned long error, void *context)
+{
+	struct flashcache_md_load_chunk *chunk = 
+		(struct flashcache_md_load_chunk *)context;
+	struct flashcache_md_load *load = chunk->load;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+	unsigned long flags;
+	int cpu;
+#endif
+
+	chunk->error = error;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+	/* Round robin the parsing over the cpus, not just the one taking the irqs */
+	spin_lock_irqsave(&load->lock, flags);
+	cpu = cpumask_next(load->next_cpu, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+	load->next_cpu = cpu;
+	spin_unlock_irqrestore(&load->lock, flags);
+	queue_work_on(cpu, load->dmc->kcached_wq, &chunk->work);
+#else
+	queue_work(load->dmc->kcached_wq, &chunk->work);
+#endif
+}
+
+static int
+flashcache_md_load_start(struct flashcache_md_load *load, struct cache_c *dmc,
+			 int clean_shutdown)
+{
+	struct flashcache_md_load_chunk *chunk;
+	int i;
+
+	memset(load, 0, sizeof(struct flashcache_md_load));
+	load->dmc = dmc;
+	load->clean_shutdown = clean_shutdown;
+	load->warm = dmc->warm;
+	load->next_cpu = -1;
+	spin_lock_init(&load->lock);
+	init_waitqueue_head(&load->wait);
+	for (i = 0 ; i < FLASHCACHE_MD_LOAD_DEPTH ; i++) {
+		chunk = kzalloc(sizeof(struct flashcache_md_load_chunk), GFP_KERNEL);
+		if (chunk == NULL)
+			break;
+		chunk->buf = (struct flash_cacheblock *)vmalloc(METADATA_IO_BLOCKSIZE);
+#ifdef FLASHCACHE_DO_CHECKSUMS
+		chunk->block = vmalloc(dmc->block_size * 512);
+		if (chunk->block == NULL) {
+			flashcache_md_load_chunk_free(chunk);
+			break;
+		}
+#endif
+		if (chunk->buf == NULL) {
+			flashcache_md_load_chunk_free(chunk);
+			break;
+		}
+		chunk->load = load;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+		INIT_WORK(&chunk->work, flashcache_md_load_parse, chunk);
+#else
+		INIT_WORK(&chunk->work, flashcache_md_load_parse);
+#endif
+		chunk->next = load->free;
+		load->free = chunk;
+	}
+	/* Fewer chunks only mean fewer reads in flight */
+	return (load->free == NULL);
+}
+
+/* 
+ * Issue the read of a chunk once one is free. Fails if a chunk failed,
+ * unless loading in the background, where only that chunk fails.
+ */
+static int
+flashcache_md_load_read(struct flashcache_md_load *load, 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+			struct io_region *where, 
+#else
+			struct dm_io_region *where, 
+#endif
+			int index, int nr_slots)
+{
+	struct flashcache_md_load_chunk *chunk;
+
+	/* Only we take chunks off the free list */
+	wait_event(load->wait, load->free != NULL);
+	spin_lock_irq(&load->lock);
+	if (load->error && !load->background) {
+		spin_unlock_irq(&load->lock);
+		return 1;
+	}
+	chunk = load->free;
+	load->free = chunk->next;
+	load->nr_busy++;
+	spin_unlock_irq(&load->lock);
+	chunk->sector = where->sector;
+	chunk->index = index;
+	chunk->nr_slots = nr_slots;
+	chunk->error = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+	dm_io_async_vm(1, where, READ, chunk->buf, flashcache_md_load_callback, chunk);
+#else
+	flashcache_dm_io_async_vm(load->dmc, 1, where, READ, chunk->buf, 
+				  flashcache_md_load_callback, chunk);
+#endif
+	flashcache_unplug_device(where->bdev);
+	return 0;
+}
+
+/* The slots of a chunk the dirty summary says has no DIRTY slots */
+static void
+flashcache_md_load_skip(struct cache_c *dmc, int index, int nr_slots)
+{
+	int i;
+
+	for (i = index ; i < index + nr_slots ; i++) {
+		dmc->cache[i].nr_queued = 0;
+		dmc->cache[i].cache_state = INVALID;
+		dmc->cache_tag[i] = 0;
+#ifdef FLASHCACHE_DO_CHECKSUMS
+		dmc->cache[i].checksum = 0;
+#endif
+	}
+}
+
+/* Wait for the chunks in flight to be parsed, and free them all */
+static int
+flashcache_md_load_finish(struct flashcache_md_load *load)
+{
+	struct flashcache_md_load_chunk *chunk;
+	int error;
+
+	wait_event(load->wait, load->nr_busy == 0);
+	/* The last worker may still be dropping the lock */
+	spin_lock_irq(&load->lock);
+	error = load->error;
+	spin_unlock_irq(&load->lock);
+	while ((chunk = load->free) != NULL) {
+		load->free = chunk->next;
+		flashcache_md_load_chunk_free(chunk);
+	}
+	return error;
+}
+
+static void flashcache_sets_init_range(struct cache_c *dmc, int start_set, int end_set);
+
+/* 
+ * Background load. Set up the sets of a chunk that has been read (or 
+ * fail the chunk), then retry the IOs held for it.
+ */
+static void
+flashcache_md_load_publish(struct flashcache_md_load *load, int index, 
+			   int nr_slots, int error)
+{
+	struct cache_c *dmc = load->dmc;
+	int chunk = index / dmc->md_load_chunk_slots;
+	struct bio *bios[2];
+	unsigned long flags;
+	int i;
+
+	if (error)
+		flashcache_md_load_skip(dmc, index, nr_slots);
+	else
+		flashcache_sets_init_range(dmc, index >> dmc->consecutive_shift,
+					   (index + nr_slots) >> dmc->consecutive_shift);
+	spin_lock_irqsave(&dmc->md_load_lock, flags);
+	if (error) {
+		set_bit(chunk, dmc->md_load_failed);
+		dmc->md_load_error = 1;
+	} else
+		set_bit(chunk, dmc->md_load_done);
+	for (i = 0 ; i < 2 ; i++) {
+		bios[i] = dmc->md_load_bios[i];
+		dmc->md_load_bios[i] = NULL;
+		dmc->md_load_bios_tail[i] = &dmc->md_load_bios[i];
+	}
+	spin_unlock_irqrestore(&dmc->md_load_lock, flags);
+	for (i = 0 ; i < 2 ; i++)
+		flashcache_md_load_release(dmc, bios[i], i);
+}
+
+/* 
+ * The next chunk to load, the first one an IO is held for, else the next
+ * in order. -1 once all have been issued.
+ */
+static int
+flashcache_md_load_next(struct flashcache_md_load *load)
+{
+	struct cache_c *dmc = load->dmc;
+	struct bio *bio;
+	int chunk = -1, i;
+
+	spin_lock_irq(&dmc->md_load_lock);
+	for (i = 0 ; i < 2 && chunk == -1 ; i++)
+		for (bio = dmc->md_load_bios[i] ; bio != NULL ; bio = bio->bi_next) {
+			chunk = flashcache_md_load_bio_chunk(dmc, bio, load->issued);
+			if (chunk != -1)
+				break;
+		}
+	if (chunk == -1) {
+		chunk = find_next_zero_bit(load->issued, load->nr_chunks, load->next_chunk);
+		if (chunk < load->nr_chunks)
+			load->next_chunk = chunk + 1;
+		else
+			chunk = -1;
+	}
+	if (chunk != -1)
+		set_bit(chunk, load->issued);
+	spin_unlock_irq(&dmc->md_load_lock);
+	return chunk;
+}
+
+/* 
+ * The background loader. Reads the slot table a chunk at a time, with up 
+ * to FLASHCACHE_MD_LOAD_DEPTH reads in flight, the parse workers set up 
+ * each chunk's sets as it comes in. 
+ */
+static int
+flashcache_md_loader(void *data)
+{
+	struct cache_c *dmc = (struct cache_c *)data;
+	struct flashcache_md_load *load = dmc->md_load;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+	struct io_region where;
+#else
+	struct dm_io_region where;
+#endif
+	int slots_per_block = MD_SLOTS_PER_BLOCK(dmc->md_block_size);
+	int chunk, index, nr_slots, i;
+	unsigned long flags;
+	int kick = 0;
+
+	where.bdev = dmc->cache_dev->bdev;
+	for (;;) {
+		/* Pick the chunk only once it can be read, IOs may want another by then */
+		wait_event(load->wait, load->free != NULL);
+		chunk = flashcache_md_load_next(load);
+		if (chunk == -1)
+			break;
+		index = chunk * dmc->md_load_chunk_slots;
+		nr_slots = dmc->md_load_chunk_slots;
+		if (index + nr_slots > dmc->size)
+			nr_slots = dmc->size - index;
+		if ((!load->clean_shutdown && !load->warm &&
+		     !test_bit(chunk, dmc->md_load_dirty)) ||
+		    !flashcache_md_formatted(dmc, index)) {
+			/* After a crash only DIRTY blocks are kept, there are none here */
+			flashcache_md_load_skip(dmc, index, nr_slots);
+			flashcache_md_load_publish(load, index, nr_slots, 0);
+			load->nr_skipped++;
+			continue;
+		}
+		where.sector = MD_BLOCK_TO_SECTOR(dmc, INDEX_TO_MD_BLOCK(dmc, index));
+		where.count = ((nr_slots + slots_per_block - 1) / slots_per_block) * 
+			dmc->md_block_size;
+		flashcache_md_load_read(load, &where, index, nr_slots);
+	}
+	flashcache_md_load_finish(load);
+	/* 
+	 * All the sets are up and the dirty summary counts complete, drop the
+	 * bits the old summary had that no slot needs. Not if a chunk failed,
+	 * its DIRTY slots were never counted.
+	 */
+	if (dmc->md_summary_count && !dmc->md_load_error) {
+		spin_lock_irqsave(&dmc->md_summary_lock, flags);
+		for (i = 0 ; i < FLASHCACHE_SB_SUMMARY_BITS ; i++)
+			if (dmc->md_summary_count[i] == 0)
+				clear_bit(i, dmc->md_summary_want);
+		dmc->md_summary_loading = 0;
+		if (!dmc->md_summary_inprog &&
+		    !bitmap_subset(dmc->md_summary_want, dmc->md_summary_flash, 
+				   FLASHCACHE_SB_SUMMARY_BITS)) {
+			dmc->md_summary_inprog = 1;
+			kick = 1;
+		}
+		spin_unlock_irqrestore(&dmc->md_summary_lock, flags);
+		if (kick)
+			queue_work(dmc->md_wq, &dmc->md_summary_work);
+	}
+	if (dmc->md_load_error)
+		DMERR("flashcache_md_loader: Some of the slot table could not be read, IOs to its sets fail");
+	DMINFO("flashcache_md_loader: Cache metadata loaded from disk with %d valid %d DIRTY blocks", 
+	       load->num_valid, load->dirty_loaded);
+	DMINFO("flashcache_md_loader: %lu blocks loaded in the background in %ums, %d of %d chunks skipped",
+	       dmc->size, jiffies_to_msecs(jiffies - load->start), 
+	       load->nr_skipped, load->nr_chunks);
+	vfree((void *)load->issued);
+	kfree(load);
+	/* flashcache_sync_for_remove() takes the lock after waking, it can free dmc then */
+	spin_lock_irq(&dmc->md_load_lock);
+	dmc->md_load = NULL;
+	dmc->md_loading = 0;
+	wake_up(&dmc->md_load_wait);
+	spin_unlock_irq(&dmc->md_load_lock);
+	return 0;
+}
+
+/* Undo flashcache_md_load_prepare(), before the loader starts */
+static void
+flashcache_md_load_destroy(struct cache_c *dmc)
+{
+	if (dmc->md_load != NULL) {
+		flashcache_md_load_finish(dmc->md_load);
+		vfree((void *)dmc->md_load->issued);
+		kfree(dmc->md_load);
+		dmc->md_load = NULL;
+	}
+	vfree((void *)dmc->md_load_done);
+	vfree((void *)dmc->md_load_dirty);
+	vfree((void *)dmc->md_load_failed);
+	dmc->md_load_done = dmc->md_load_dirty = dmc->md_load_failed = NULL;
+}
+
+/*
+ * Set up a background load of the slot table. "summary" is the dirty 
+ * summary in the superblock if there is a usable one, "no_dirty" is set 
+ * after a slow (clean) shutdown.
+ */
+static int
+flashcache_md_load_prepare(struct cache_c *dmc, int clean_shutdown, int no_dirty,
+			   unsigned long *summary)
+{
+	struct flashcache_md_load *load;
+	int chunk_slots = MD_SLOTS_PER_BLOCK(dmc->md_block_size) * 
+		(METADATA_IO_BLOCKSIZE_SECT / dmc->md_block_size);
+	int nr_chunks = (dmc->size + chunk_slots - 1) / chunk_slots;
+	int order = BITS_TO_LONGS(nr_chunks) * sizeof(unsigned long);
+	int chunk, bit, end;
+
+	load = (struct flashcache_md_load *)kmalloc(sizeof(struct flashcache_md_load), 
+						    GFP_KERNEL);
+	if (load == NULL)
+		return 1;
+	if (flashcache_md_load_start(load, dmc, clean_shutdown)) {
+		kfree(load);
+		return 1;
+	}
+	dmc->md_load = load;
+	load->background = 1;
+	load->nr_chunks = nr_chunks;
+	load->start = jiffies;
+	load->issued = (unsigned long *)vmalloc(order);
+	dmc->md_load_done = (unsigned long *)vmalloc(order);
+	dmc->md_load_dirty = (unsigned long *)vmalloc(order);
+	dmc->md_load_failed = (unsigned long *)vmalloc(order);
+	if (!load->issued || !dmc->md_load_done || !dmc->md_load_dirty || 
+	    !dmc->md_load_failed) {
+		flashcache_md_load_destroy(dmc);
+		return 1;
+	}
+	memset(load->issued, 0, order);
+	memset(dmc->md_load_done, 0, order);
+	memset(dmc->md_load_dirty, 0, order);
+	memset(dmc->md_load_failed, 0, order);
+	dmc->md_load_chunk_slots = chunk_slots;
+	/* Without a dirty summary, any chunk may hold DIRTY blocks */
+	if (no_dirty)
+		bitmap_zero(load->summary, FLASHCACHE_SB_SUMMARY_BITS);
+	else if (summary != NULL)
+		bitmap_copy(load->summary, summary, FLASHCACHE_SB_SUMMARY_BITS);
+	else
+		bitmap_fill(load->summary, FLASHCACHE_SB_SUMMARY_BITS);
+	for (chunk = 0 ; chunk < nr_chunks ; chunk++) {
+		if (!flashcache_md_formatted(dmc, chunk * chunk_slots))
+			continue;
+		end = (chunk + 1) * chunk_slots;
+		if (end > dmc->size)
+			end = dmc->size;
+		for (bit = INDEX_TO_MD_SUMMARY(dmc, chunk * chunk_slots) ;
+		     bit <= INDEX_TO_MD_SUMMARY(dmc, end - 1) ; bit++)
+			if (test_bit(bit, load->summary)) {
+				set_bit(chunk, dmc->md_load_dirty);
+				break;
+			}
 	}
-	vfree((void *)header);
 	return 0;
 }
 
 static int 
 flashcache_md_load(struct cache_c *dmc)
 {
-	struct flash_cacheblock *meta_data_cacheblock, *next_ptr;
+	struct flashcache_md_load load;
 	struct flash_superblock *header;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 	struct io_region where;
 #else
 	struct dm_io_region where;
 #endif
-	int i, j;
+	int i;
 	int size, slots_read;
 	int clean_shutdown;
 	int dirty_loaded = 0;
@@ -978,6 +2152,12 @@ flashcache_md_load(struct cache_c *dmc)
 	int error;
 	void *block;
 	int sectors_read = 0, sectors_expected = 0;	/* Debug */
+	int journal_sectors = 0;
+	int slots_per_block;
+	unsigned long start = jiffies;
+	unsigned long summary[BITS_TO_LONGS(FLASHCACHE_SB_SUMMARY_BITS)];
+	int use_summary = 0, sectors_skipped = 0;
+	int have_summary = 0, background = 0;
 	
 	header = (struct flash_superblock *)vmalloc(512);
 	if (!header) {
@@ -1028,21 +2208,112 @@ flashcache_md_load(struct cache_c *dmc)
 	dmc->size = header->size;
 	dmc->assoc = header->assoc;
 	dmc->consecutive_shift = ffs(dmc->assoc) - 1;
-	dmc->md_sectors = INDEX_TO_MD_SECTOR(dmc->size) + 1 + 1;
+	if (header->cache_version > FLASHCACHE_VERSION) {
+		vfree((void *)header);
+		DMERR("flashcache_md_load: Unknown cache version %u", 
+		      header->cache_version);
+		return 1;
+	}
+	if (header->cache_version >= 2) {
+		if (header->cache_set_hash > FLASHCACHE_SET_HASH_MAX ||
+		    !header->cache_set_granule ||
+		    (header->cache_set_granule & (header->cache_set_granule - 1)) ||
+		    header->cache_set_granule > dmc->assoc) {
+			vfree((void *)header);
+			DMERR("flashcache_md_load: Corrupt set hash in superblock");
+			return 1;
+		}
+		dmc->set_hash = header->cache_set_hash;
+		dmc->granule_shift = ffs(header->cache_set_granule) - 1;
+	} else {
+		/* Caches created before the set hash was selectable */
+		dmc->set_hash = FLASHCACHE_SET_HASH_CONTIG;
+		dmc->granule_shift = dmc->consecutive_shift;
+	}
+	dmc->set_shift = dmc->block_shift + dmc->granule_shift;
+	if (header->cache_version >= 3 && header->cache_journal_sectors) {
+		journal_sectors = header->cache_journal_sectors;
+		if (journal_sectors % FLASHCACHE_JOURNAL_RECORD_SECT ||
+		    journal_sectors < FLASHCACHE_JOURNAL_MIN_SECT ||
+		    journal_sectors > FLASHCACHE_JOURNAL_MAX_SECT) {
+			vfree((void *)header);
+			DMERR("flashcache_md_load: Corrupt md journal size in superblock");
+			return 1;
+		}
+	}
+	if (header->cache_version >= 4) {
+		dmc->md_block_size = header->cache_md_block_size;
+		if (dmc->md_block_size != FLASHCACHE_MD_BLOCK_512 &&
+		    dmc->md_block_size != FLASHCACHE_MD_BLOCK_4K) {
+			vfree((void *)header);
+			DMERR("flashcache_md_load: Corrupt md block size in superblock");
+			return 1;
+		}
+	} else
+		dmc->md_block_size = FLASHCACHE_MD_BLOCK_512;
+	if (header->cache_version >= 5)
+		dmc->warm = !!(header->cache_flags & FLASHCACHE_SB_WARM);
+	else
+		dmc->warm = 0;
+	if (dmc->warm && !clean_shutdown)
+		DMINFO("Warm cache, CLEAN blocks are kept too");
+	slots_per_block = MD_SLOTS_PER_BLOCK(dmc->md_block_size);
+	dmc->md_summary_shift = flashcache_md_summary_shift(dmc);
+	/* 
+	 * After a crash, only read the slot table where the dirty summary 
+	 * says there are DIRTY slots. Warm caches want the VALID ones too.
+	 */
+	if (header->cache_version >= 6 && !dmc->warm &&
+	    (header->cache_flags & FLASHCACHE_SB_SUMMARY) &&
+	    header->cache_summary_shift == dmc->md_summary_shift) {
+		have_summary = 1;
+		bitmap_zero(summary, FLASHCACHE_SB_SUMMARY_BITS);
+		for (i = 0 ; i < FLASHCACHE_SB_SUMMARY_BITS ; i++)
+			if (header->cache_summary[i / 32] & (1 << (i % 32)))
+				set_bit(i, summary);
+	}
+	use_summary = have_summary && !clean_shutdown;
+	/* Lazily created, only the formatted runs of the slot table are read */
+	dmc->md_lazy = 0;
+	if (header->cache_version >= 7 && (header->cache_flags & FLASHCACHE_SB_LAZY)) {
+		if (header->cache_summary_shift != dmc->md_summary_shift) {
+			vfree((void *)header);
+			DMERR("flashcache_md_load: Corrupt formatted runs in superblock");
+			return 1;
+		}
+		dmc->md_lazy = 1;
+		bitmap_zero(dmc->md_formatted, FLASHCACHE_SB_FORMAT_BITS);
+		for (i = 0 ; i < FLASHCACHE_SB_FORMAT_BITS ; i++)
+			if (header->cache_formatted[i / 32] & (1 << (i % 32)))
+				set_bit(i, dmc->md_formatted);
+	}
+	dmc->md_sectors = MD_JOURNAL_START(dmc) + journal_sectors;
 	DMINFO("flashcache_md_load: md_sectors = %d\n", dmc->md_sectors);
+	if (journal_sectors) {
+		if (flashcache_journal_alloc(dmc, MD_JOURNAL_START(dmc), journal_sectors)) {
+			vfree((void *)header);
+			DMERR("flashcache_md_load: Unable to allocate memory");
+			return 1;
+		}
+		/* A new run, its records must not be mistaken for the last one's */
+		dmc->journal->gen = header->cache_journal_gen + 1;
+	}
 	data_size = dmc->size * dmc->block_size;
-	order = dmc->size * sizeof(struct cacheblock);
+	order = dmc->size * (sizeof(struct cacheblock) + sizeof(u_int32_t));
 	DMINFO("Allocate %luKB (%ldB per) mem for %lu-entry cache" \
 	       "(capacity:%luMB, associativity:%u, block size:%u " \
 	       "sectors(%uKB))",
-	       order >> 10, sizeof(struct cacheblock), dmc->size,
+	       order >> 10, sizeof(struct cacheblock) + sizeof(u_int32_t), dmc->size,
 	       (dmc->md_sectors + data_size) >> (20-SECTOR_SHIFT), 
 	       dmc->assoc, dmc->block_size,
 	       dmc->block_size >> (10-SECTOR_SHIFT));
-	dmc->cache = (struct cacheblock *)vmalloc(order);
-	if (!dmc->cache) {
+	dmc->cache = (struct cacheblock *)vmalloc(dmc->size * sizeof(struct cacheblock));
+	dmc->cache_tag = (u_int32_t *)vmalloc(dmc->size * sizeof(u_int32_t));
+	if (!dmc->cache || !dmc->cache_tag) {
 		DMERR("load_metadata: Unable to allocate memory");
 		vfree((void *)header);
+		vfree((void *)dmc->cache);
+		vfree((void *)dmc->cache_tag);
 		return 1;
 	}
 	block = vmalloc(dmc->block_size * 512);
@@ -1050,105 +2321,99 @@ flashcache_md_load(struct cache_c *dmc)
 		DMERR("load_metadata: Unable to allocate memory");
 			vfree((void *)header);
 			vfree(dmc->cache);
+			vfree(dmc->cache_tag);
 			DMERR("flashcache_md_load: Could not read cache metadata sector %lu !",
 			      where.sector);
 			return 1;
 	}
+	/* The VALID blocks dropped are still VALID on flash */
+	dmc->md_stale = !clean_shutdown && !dmc->warm;
 	/* 
-	 * Read 1 sector of the metadata at a time and load up the
-	 * incore metadata struct.
+	 * Load in the background if asked to, unless the md journal has to be
+	 * replayed over the whole table first. A chunk has to hold whole sets.
 	 */
-	meta_data_cacheblock = (struct flash_cacheblock *)vmalloc(METADATA_IO_BLOCKSIZE);
-	if (!meta_data_cacheblock) {
+	if (sysctl_flashcache_background_load && !(dmc->journal && !clean_shutdown) &&
+	    (slots_per_block * (METADATA_IO_BLOCKSIZE_SECT / dmc->md_block_size)) % 
+	    dmc->assoc == 0) {
+		if (flashcache_md_load_prepare(dmc, clean_shutdown, 
+					       header->cache_sb_state == CACHE_MD_STATE_CLEAN,
+					       have_summary ? summary : NULL))
+			DMINFO("flashcache_md_load: Unable to allocate memory, not loading in the background");
+		else
+			background = 1;
+	}
+	if (background)
+		goto dirty_sb;
+	/* 
+	 * Read the metadata a METADATA_IO_BLOCKSIZE at a time, with up to
+	 * FLASHCACHE_MD_LOAD_DEPTH reads in flight, and load up the incore
+	 * metadata struct from each chunk as it comes in.
+	 */
+	if (flashcache_md_load_start(&load, dmc, clean_shutdown)) {
 		vfree((void *)header);
 		vfree(dmc->cache);
+		vfree(dmc->cache_tag);
 		vfree(block);
 		DMERR("flashcache_md_load: Unable to allocate memory");
 		return 1;
 	}
-	where.sector = 1;
+	where.sector = MD_BLOCK_TO_SECTOR(dmc, 0);
 	size = dmc->size;
 	i = 0;
 	while (size > 0) {
-		slots_read = min(size, (int)MD_BLOCKS_PER_SECTOR * METADATA_IO_BLOCKSIZE_SECT);
-		if (slots_read % MD_BLOCKS_PER_SECTOR)
-			where.count = 1 + (slots_read / MD_BLOCKS_PER_SECTOR);
+		slots_read = min(size, slots_per_block * 
+				 (int)(METADATA_IO_BLOCKSIZE_SECT / dmc->md_block_size));
+		if (slots_read % slots_per_block)
+			where.count = 1 + (slots_read / slots_per_block);
 		else
-			where.count = slots_read / MD_BLOCKS_PER_SECTOR;
+			where.count = slots_read / slots_per_block;
+		where.count *= dmc->md_block_size;
+		if ((use_summary && 
+		     !test_bit(INDEX_TO_MD_SUMMARY(dmc, i), summary)) ||
+		    !flashcache_md_formatted(dmc, i)) {
+			flashcache_md_load_skip(dmc, i, slots_read);
+			sectors_skipped += where.count;
+		} else if (flashcache_md_load_read(&load, &where, i, slots_read))
+			break;
 		sectors_read += where.count;	/* Debug */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
-		error = flashcache_dm_io_sync_vm(dmc, &where, READ, meta_data_cacheblock);
-#else
-		error = flashcache_dm_io_sync_vm(dmc, &where, READ, meta_data_cacheblock);
-#endif
-		if (error) {
-			vfree((void *)header);
-			vfree(dmc->cache);
-			vfree(block);
-			vfree((void *)meta_data_cacheblock);
-			DMERR("flashcache_md_load: Could not read cache metadata sector %lu error %d !",
-			      where.sector, error);
-			return 1;
-		}
 		where.sector += where.count;
-		next_ptr = meta_data_cacheblock;
-		for (j = 0 ; j < slots_read ; j++) {
-			if ((j % MD_BLOCKS_PER_SECTOR) == 0) {
-				/* Move onto next sector */
-				next_ptr = (struct flash_cacheblock *)
-					((caddr_t)meta_data_cacheblock + 512 * (j / MD_BLOCKS_PER_SECTOR));
-			}
-			dmc->cache[i].nr_queued = 0;
-			/* 
-			 * If unclean shutdown, only the DIRTY blocks are loaded.
-			 */
-			if (clean_shutdown || (next_ptr->cache_state & DIRTY)) {
-				if (next_ptr->cache_state & DIRTY)
-					dirty_loaded++;
-				dmc->cache[i].cache_state = next_ptr->cache_state;
-				VERIFY((dmc->cache[i].cache_state & (VALID | INVALID)) 
-				       != (VALID | INVALID));
-				if (dmc->cache[i].cache_state & VALID)
-					num_valid++;
-				dmc->cache[i].dbn = next_ptr->dbn;
-#ifdef FLASHCACHE_DO_CHECKSUMS
-				if (clean_shutdown)
-					dmc->cache[i].checksum = next_ptr->checksum;
-				else {
-					error = flashcache_read_compute_checksum(dmc, i, block);
-					if (error) {
-						vfree((void *)header);
-						vfree(dmc->cache);
-						vfree(block);
-						vfree((void *)meta_data_cacheblock);
-						DMERR("flashcache_md_load: Could not read cache block sector %lu error %d !",
-						      dmc->cache[i].dbn, error);
-						return 1;				
-					}						
-				}
-#endif
-			} else {
-				dmc->cache[i].cache_state = INVALID;
-				dmc->cache[i].dbn = 0;
-#ifdef FLASHCACHE_DO_CHECKSUMS
-				dmc->cache[i].checksum = 0;
-#endif
-			}
-			next_ptr++;
-			i++;
-		}
+		i += slots_read;
 		size -= slots_read;
 	}
+	error = flashcache_md_load_finish(&load);
+	if (error) {
+		vfree((void *)header);
+		vfree(dmc->cache);
+		vfree(dmc->cache_tag);
+		vfree(block);
+		return 1;
+	}
+	num_valid = load.num_valid;
+	dirty_loaded = load.dirty_loaded;
 	/* Debug Tests */
-	sectors_expected = dmc->size / MD_BLOCKS_PER_SECTOR;
-	if (dmc->size % MD_BLOCKS_PER_SECTOR)
+	sectors_expected = dmc->size / slots_per_block;
+	if (dmc->size % slots_per_block)
 		sectors_expected++;
+	sectors_expected *= dmc->md_block_size;
 	if (sectors_expected != sectors_read) {
 		printk("flashcache_md_load" "Sector Mismatch ! sectors_expected=%d, sectors_read=%d\n",
 		       sectors_expected, sectors_read);
 		panic("flashcache_md_load: sector mismatch\n");
 	}
-	vfree((void *)meta_data_cacheblock);
+	/* 
+	 * The slot table has to be up to date before the superblock moves
+	 * the journal on to the next run.
+	 */
+	if (dmc->journal && !clean_shutdown &&
+	    flashcache_journal_replay(dmc, header->cache_journal_gen,
+				      &num_valid, &dirty_loaded, block)) {
+		vfree((void *)header);
+		vfree(dmc->cache);
+		vfree(dmc->cache_tag);
+		vfree(block);
+		return 1;
+	}
+dirty_sb:
 	/* Before we finish loading, we need to dirty the suprtblock and 
 	   write it out */
 	header->size = dmc->size;
@@ -1160,6 +2425,22 @@ flashcache_md_load(struct cache_c *dmc)
 	header->cache_devsize = to_sector(dmc->cache_dev->bdev->bd_inode->i_size);
 	header->disk_devsize = to_sector(dmc->disk_dev->bdev->bd_inode->i_size);
 	header->cache_version = FLASHCACHE_VERSION;
+	header->cache_set_hash = dmc->set_hash;
+	header->cache_set_granule = 1 << dmc->granule_shift;
+	header->cache_journal_sectors = journal_sectors;
+	header->cache_journal_gen = journal_sectors ? dmc->journal->gen : 0;
+	header->cache_md_block_size = dmc->md_block_size;
+	header->cache_flags = dmc->warm ? FLASHCACHE_SB_WARM : 0;
+	/* Until the background load is done, the dirty summary can only grow */
+	if (background && !dmc->warm) {
+		header->cache_flags |= FLASHCACHE_SB_SUMMARY;
+		header->cache_summary_shift = dmc->md_summary_shift;
+		memset(header->cache_summary, 0, sizeof(header->cache_summary));
+		for (i = 0 ; i < FLASHCACHE_SB_SUMMARY_BITS ; i++)
+			if (test_bit(i, dmc->md_load->summary))
+				header->cache_summary[i / 32] |= 1 << (i % 32);
+	}
+	flashcache_md_lazy_header(dmc, header);
 	where.sector = 0;
 	where.count = 1;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
@@ -1168,8 +2449,10 @@ flashcache_md_load(struct cache_c *dmc)
 	error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, header);
 #endif
 	if (error) {
+		flashcache_md_load_destroy(dmc);
 		vfree((void *)header);
 		vfree(dmc->cache);
+		vfree(dmc->cache_tag);
 		vfree(block);
 		DMERR("flashcache_md_load: Could not write cache superblock sector %lu error %d !",
 		      where.sector, error);
@@ -1177,8 +2460,18 @@ flashcache_md_load(struct cache_c *dmc)
 	}
 	vfree((void *)header);
 	vfree(block);
+	if (background) {
+		DMINFO("flashcache_md_load: %lu blocks to load in the background", dmc->size);
+		return 0;
+	}
 	DMINFO("flashcache_md_load: Cache metadata loaded from disk with %d valid %d DIRTY blocks", 
 	       num_valid, dirty_loaded);
+	DMINFO("flashcache_md_load: %lu blocks (%luMB of metadata) loaded in %ums", 
+	       dmc->size, (unsigned long)(dmc->md_sectors >> (20-SECTOR_SHIFT)),
+	       jiffies_to_msecs(jiffies - start));
+	if (use_summary || dmc->md_lazy)
+		DMINFO("flashcache_md_load: %d of %d md sectors skipped, no DIRTY blocks or never written", 
+		       sectors_skipped, sectors_read);
 	return 0;
 }
 
@@ -1200,6 +2493,166 @@ flashcache_clean_all_sets(struct work_struct *work)
 		flashcache_clean_set(dmc, i);
 }
 
+/* Count "nr_dirty" DIRTY slots under dirty summary bit "bit" */
+static void
+flashcache_sets_init_summary(struct cache_c *dmc, int bit, int nr_dirty)
+{
+	unsigned long flags;
+
+	if (dmc->md_summary_count == NULL || nr_dirty == 0)
+		return;
+	spin_lock_irqsave(&dmc->md_summary_lock, flags);
+	dmc->md_summary_count[bit] += nr_dirty;
+	set_bit(bit, dmc->md_summary_want);
+	spin_unlock_irqrestore(&dmc->md_summary_lock, flags);
+}
+
+/*
+ * Set up the per set state (LRU, dbn hash, free and dirty maps and 
+ * counts) of sets [start_set, end_set) from the incore metadata. 
+ */
+static void
+flashcache_sets_init_range(struct cache_c *dmc, int start_set, int end_set)
+{
+	int set, i, end, nr_cached = 0, nr_dirty = 0;
+	int bit = -1, bit_dirty = 0;
+
+	for (set = start_set ; set < end_set ; set++) {
+		dmc->cache_sets[set].set_fifo_next = set * dmc->assoc;
+		dmc->cache_sets[set].set_clean_next = set * dmc->assoc;
+		dmc->cache_sets[set].nr_dirty = 0;
+		dmc->cache_sets[set].nr_unaligned = 0;
+		dmc->cache_sets[set].clean_inprog = 0;
+		dmc->cache_sets[set].lru_tail = FLASHCACHE_LRU_NULL;
+		dmc->cache_sets[set].lru_head = FLASHCACHE_LRU_NULL;
+		for (i = set << dmc->hash_bits ; i < (set + 1) << dmc->hash_bits ; i++)
+			dmc->hash_buckets[i] = FLASHCACHE_LRU_NULL;
+		end = (set + 1) * dmc->assoc;
+		for (i = set * dmc->assoc ; i < end ; i++) {
+			/* Push all blocks into the set specific LRUs */
+			dmc->cache[i].lru_prev = FLASHCACHE_LRU_NULL;
+			dmc->cache[i].lru_next = FLASHCACHE_LRU_NULL;
+			flashcache_reclaim_lru_movetail(dmc, i);
+			dmc->hash_next[i] = FLASHCACHE_LRU_NULL;
+			if (dmc->cache[i].cache_state & VALID) {
+				nr_cached++;
+				flashcache_hash_insert(dmc, i);
+				/* The slot table on flash matches the incore one */
+				if (dmc->warm)
+					set_bit(i, dmc->md_valid_map);
+			} else
+				set_bit(i, dmc->free_map);
+			if (dmc->cache[i].cache_state & DIRTY) {
+				set_bit(i, dmc->dirty_map);
+				dmc->cache_sets[set].nr_dirty++;
+				nr_dirty++;
+				/* Runs of slots share a summary bit, count a run at a time */
+				if (INDEX_TO_MD_SUMMARY(dmc, i) != bit) {
+					flashcache_sets_init_summary(dmc, bit, bit_dirty);
+					bit = INDEX_TO_MD_SUMMARY(dmc, i);
+					bit_dirty = 0;
+				}
+				bit_dirty++;
+			}
+		}
+	}
+	flashcache_sets_init_summary(dmc, bit, bit_dirty);
+	atomic_add(nr_cached, &dmc->cached_blocks);
+	atomic_add(nr_dirty, &dmc->nr_dirty);
+}
+
+struct flashcache_sets_work {
+	struct work_struct	work;
+	struct cache_c		*dmc;
+	void			(*init)(struct cache_c *, int, int);
+	int			start_set, end_set;
+	atomic_t		*pending;
+	struct completion	*done;
+};
+
+static void
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+flashcache_sets_worker(void *data)
+{
+	struct flashcache_sets_work *w = (struct flashcache_sets_work *)data;
+#else
+flashcache_sets_worker(struct work_struct *work)
+{
+	struct flashcache_sets_work *w = 
+		container_of(work, struct flashcache_sets_work, work);
+#endif
+
+	w->init(w->dmc, w->start_set, w->end_set);
+	if (atomic_dec_and_test(w->pending))
+		complete(w->done);
+}
+
+/*
+ * Sets are independent, so on a big cache split the in-core passes over
+ * them up between the kcached workers of all the online cpus. "init" is
+ * run on each range of sets, and must only touch state of those sets.
+ */
+static void
+flashcache_sets_parallel(struct cache_c *dmc, 
+			 void (*init)(struct cache_c *, int, int))
+{
+	struct flashcache_sets_work *works;
+	DECLARE_COMPLETION_ONSTACK(done);
+	atomic_t pending;
+	int nr_sets = dmc->size >> dmc->consecutive_shift;
+	int nr_works = num_online_cpus();
+	int per_work, cpu, i;
+
+	if (nr_works > nr_sets)
+		nr_works = nr_sets;
+	works = NULL;
+	if (nr_works > 1)
+		works = (struct flashcache_sets_work *)
+			kmalloc(nr_works * sizeof(struct flashcache_sets_work), GFP_KERNEL);
+	if (works == NULL) {
+		init(dmc, 0, nr_sets);
+		return;
+	}
+	per_work = (nr_sets + nr_works - 1) / nr_works;
+	atomic_set(&pending, nr_works);
+	i = 0;
+	for_each_online_cpu(cpu) {
+		if (i == nr_works)
+			break;
+		works[i].dmc = dmc;
+		works[i].init = init;
+		works[i].start_set = i * per_work;
+		works[i].end_set = min(nr_sets, (i + 1) * per_work);
+		works[i].pending = &pending;
+		works[i].done = &done;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+		INIT_WORK(&works[i].work, flashcache_sets_worker, &works[i]);
+#else
+		INIT_WORK(&works[i].work, flashcache_sets_worker);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+		queue_work_on(cpu, dmc->kcached_wq, &works[i].work);
+#else
+		queue_work(dmc->kcached_wq, &works[i].work);
+#endif
+		i++;
+	}
+	/* A cpu went offline under us, do what is left here */
+	if (i < nr_works) {
+		init(dmc, i * per_work, nr_sets);
+		if (atomic_sub_and_test(nr_works - i, &pending))
+			complete(&done);
+	}
+	wait_for_completion(&done);
+	kfree(works);
+}
+
+static void
+flashcache_sets_init(struct cache_c *dmc)
+{
+	flashcache_sets_parallel(dmc, flashcache_sets_init_range);
+}
+
 /*
  * Construct a cache mapping.
  *  arg[0]: path to source device
@@ -1209,15 +2662,23 @@ flashcache_clean_all_sets(struct work_struct *work)
  *  arg[3]: cache block size (in sectors)
  *  arg[4]: cache size (in blocks)
  *  arg[5]: cache associativity
+ *  arg[6]: set hash (0 contiguous, 1 xor folded, 2 multiplicative)
+ *  arg[7]: set hash granule (in blocks, power of 2, <= associativity)
+ *  arg[8]: md journal size (in sectors, 0 for none)
+ *  arg[9]: md block size (in sectors, 1 or 8)
+ *  arg[10]: warm, keep clean blocks across an unclean shutdown (0 or 1)
  */
 int 
 flashcache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
 	struct cache_c *dmc;
-	unsigned int consecutive_blocks;
+	unsigned int consecutive_blocks, set_granule;
 	sector_t i, order;
+	int nr_md_blocks;
 	int r = -EINVAL;
 	int persistence = 0;
+	int journal_sectors = 0;
+	unsigned long start = jiffies;
 
 	if (argc < 2) {
 		ti->error = "flashcache: Need at least 2 arguments";
@@ -1230,6 +2691,13 @@ flashcache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		r = ENOMEM;
 		goto bad;
 	}
+	dmc->cpu_stats = alloc_percpu(struct flashcache_cpu_stats);
+	if (dmc->cpu_stats == NULL) {
+		ti->error = "flashcache: Failed to allocate cache stats";
+		kfree(dmc);
+		r = -ENOMEM;
+		goto bad;
+	}
 
 	dmc->tgt = ti;
 
@@ -1351,14 +2819,70 @@ flashcache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	consecutive_blocks = dmc->assoc;
 	dmc->consecutive_shift = ffs(consecutive_blocks) - 1;
 
+	if (argc >= 7) {
+		if (sscanf(argv[6], "%u", &dmc->set_hash) != 1 ||
+		    dmc->set_hash > FLASHCACHE_SET_HASH_MAX) {
+			ti->error = "flashcache: Invalid set hash";
+			r = -EINVAL;
+			goto bad5;
+		}
+	} else
+		dmc->set_hash = FLASHCACHE_SET_HASH_CONTIG;
+
+	if (argc >= 8) {
+		if (sscanf(argv[7], "%u", &set_granule) != 1 ||
+		    !set_granule || (set_granule & (set_granule - 1)) ||
+		    set_granule > dmc->assoc) {
+			ti->error = "flashcache: Invalid set hash granule";
+			r = -EINVAL;
+			goto bad5;
+		}
+	} else
+		set_granule = dmc->assoc;
+	dmc->granule_shift = ffs(set_granule) - 1;
+	dmc->set_shift = dmc->block_shift + dmc->granule_shift;
+
+	/* Md journal size in sectors, 0 for none. Rounded down to whole records */
+	if (argc >= 9) {
+		if (sscanf(argv[8], "%d", &journal_sectors) != 1 ||
+		    (journal_sectors && 
+		     (journal_sectors < FLASHCACHE_JOURNAL_MIN_SECT ||
+		      journal_sectors > FLASHCACHE_JOURNAL_MAX_SECT))) {
+			ti->error = "flashcache: Invalid md journal size";
+			r = -EINVAL;
+			goto bad5;
+		}
+		journal_sectors -= journal_sectors % FLASHCACHE_JOURNAL_RECORD_SECT;
+	}
+
+	if (argc >= 10) {
+		if (sscanf(argv[9], "%u", &dmc->md_block_size) != 1 ||
+		    (dmc->md_block_size != FLASHCACHE_MD_BLOCK_512 &&
+		     dmc->md_block_size != FLASHCACHE_MD_BLOCK_4K)) {
+			ti->error = "flashcache: Invalid md block size";
+			r = -EINVAL;
+			goto bad5;
+		}
+	} else
+		dmc->md_block_size = FLASHCACHE_MD_BLOCK_512;
+
+	if (argc >= 11) {
+		if (sscanf(argv[10], "%d", &dmc->warm) != 1 ||
+		    (dmc->warm != 0 && dmc->warm != 1)) {
+			ti->error = "flashcache: Invalid warm setting";
+			r = -EINVAL;
+			goto bad5;
+		}
+	}
+
 	if (persistence == CACHE_CREATE) {
-		if (flashcache_md_create(dmc, 0)) {
+		if (flashcache_md_create(dmc, 0, journal_sectors)) {
 			ti->error = "flashcache: Cache Create Failed";
 			r = -EINVAL;
 			goto bad5;
 		}
 	} else {
-		if (flashcache_md_create(dmc, 1)) {
+		if (flashcache_md_create(dmc, 1, journal_sectors)) {
 			ti->error = "flashcache: Cache Force Create Failed";
 			r = -EINVAL;
 			goto bad5;
@@ -1366,50 +2890,169 @@ flashcache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 
 init:
+	dmc->md_summary_shift = flashcache_md_summary_shift(dmc);
+	/*
+	 * The in-core dbns are kept as 32 bit set relative tags. Make sure 
+	 * every sector of the source device can be represented.
+	 */
+	if (dmc->set_shift >= 32 ||
+	    flashcache_dbn_to_tag_overflows(dmc, 
+			to_sector(dmc->disk_dev->bdev->bd_inode->i_size))) {
+		ti->error = "flashcache: Source device too large for cache geometry";
+		r = -EINVAL;
+		vfree((void *)dmc->cache);
+		vfree((void *)dmc->cache_tag);
+		goto bad5;
+	}
 	order = (dmc->size >> dmc->consecutive_shift) * sizeof(struct cache_set);
 	dmc->cache_sets = (struct cache_set *)vmalloc(order);
 	if (!dmc->cache_sets) {
 		ti->error = "Unable to allocate memory";
 		r = -ENOMEM;
 		vfree((void *)dmc->cache);
+		vfree((void *)dmc->cache_tag);
 		goto bad5;
 	}				
 
-	for (i = 0 ; i < (dmc->size >> dmc->consecutive_shift) ; i++) {
-		dmc->cache_sets[i].set_fifo_next = i * dmc->assoc;
-		dmc->cache_sets[i].set_clean_next = i * dmc->assoc;
-		dmc->cache_sets[i].nr_dirty = 0;
-		dmc->cache_sets[i].clean_inprog = 0;
-		dmc->cache_sets[i].lru_tail = FLASHCACHE_LRU_NULL;
-		dmc->cache_sets[i].lru_head = FLASHCACHE_LRU_NULL;
-	}
-
-	/* Push all blocks into the set specific LRUs */
-	for (i = 0 ; i < dmc->size ; i++) {
-		dmc->cache[i].lru_prev = FLASHCACHE_LRU_NULL;
-		dmc->cache[i].lru_next = FLASHCACHE_LRU_NULL;
-		flashcache_reclaim_lru_movetail(dmc, i);
-	}
-
-	order = (dmc->md_sectors - 1) * sizeof(struct cache_md_sector_head);
+	nr_md_blocks = INDEX_TO_MD_BLOCK(dmc, dmc->size) + 1;
+	order = nr_md_blocks * sizeof(struct cache_md_sector_head);
 	dmc->md_sectors_buf = (struct cache_md_sector_head *)vmalloc(order);
 	if (!dmc->md_sectors_buf) {
 		ti->error = "Unable to allocate memory";
 		r = -ENOMEM;
 		vfree((void *)dmc->cache);
+		vfree((void *)dmc->cache_tag);
 		vfree((void *)dmc->cache_sets);
 		goto bad5;
 	}		
 
-	for (i = 0 ; i < dmc->md_sectors - 1 ; i++) {
+	for (i = 0 ; i < nr_md_blocks ; i++) {
 		dmc->md_sectors_buf[i].nr_in_prog = 0;
 		dmc->md_sectors_buf[i].queued_updates = NULL;
 	}
+	/* 
+	 * Every md block has at most one write in flight, so reserve enough 
+	 * buffers for all of them, up to FLASHCACHE_MD_POOL_SIZE. Past that,
+	 * md writes wait on md_wq for buffers to come back, they don't fail.
+	 */
+	dmc->md_sector_pool = mempool_create(min_t(int, nr_md_blocks, 
+						   FLASHCACHE_MD_POOL_SIZE),
+					     mempool_alloc_slab, mempool_free_slab,
+					     (dmc->md_block_size == FLASHCACHE_MD_BLOCK_4K ?
+					      _md_block_cache : _md_sector_cache));
+	if (!dmc->md_sector_pool) {
+		ti->error = "Unable to allocate memory";
+		r = -ENOMEM;
+		vfree((void *)dmc->cache);
+		vfree((void *)dmc->cache_tag);
+		vfree((void *)dmc->cache_sets);
+		vfree((void *)dmc->md_sectors_buf);
+		goto bad5;
+	}
+
+	/* Per set dbn hash, assoc/2 buckets per set (at least 2) */
+	if (dmc->assoc > 4)
+		dmc->hash_bits = dmc->consecutive_shift - 1;
+	else
+		dmc->hash_bits = 1;
+	order = (dmc->size >> dmc->consecutive_shift) << dmc->hash_bits;
+	dmc->hash_buckets = (u_int16_t *)vmalloc(order * sizeof(u_int16_t));
+	dmc->hash_next = (u_int16_t *)vmalloc(dmc->size * sizeof(u_int16_t));
+	/* Free and dirty block bitmaps, searched a set (index range) at a time */
+	order = BITS_TO_LONGS(dmc->size) * sizeof(unsigned long);
+	dmc->free_map = (unsigned long *)vmalloc(order);
+	dmc->dirty_map = (unsigned long *)vmalloc(order);
+	/* 
+	 * Lock stripes cover whole sets and whole md blocks. Don't have more
+	 * stripes than there are stripe sized runs of blocks.
+	 */
+	dmc->stripe_shift = max(dmc->consecutive_shift, 
+				(unsigned int)ffs(MD_SLOTS_PER_BLOCK(dmc->md_block_size)) - 1);
+	dmc->nr_stripes = FLASHCACHE_LOCK_STRIPES;
+	while (dmc->nr_stripes > 1 &&
+	       ((sector_t)dmc->nr_stripes << dmc->stripe_shift) >= 2 * dmc->size)
+		dmc->nr_stripes >>= 1;
+	dmc->stripes = (struct flashcache_stripe *)
+		vmalloc(dmc->nr_stripes * sizeof(struct flashcache_stripe));
+	dmc->pending_job_buckets = (struct pending_job **)
+		vmalloc(FLASHCACHE_PENDING_BUCKETS(dmc) * sizeof(struct pending_job *));
+	/* 
+	 * Warm caches track the slots that may be VALID on flash, the others
+	 * keep the dirty summary.
+	 */
+	if (!dmc->warm)
+		dmc->md_summary_count = (int *)
+			vmalloc(FLASHCACHE_SB_SUMMARY_BITS * sizeof(int));
+	else {
+		dmc->md_valid_map = (unsigned long *)vmalloc(order);
+		dmc->md_warm_map = (unsigned long *)
+			vmalloc(BITS_TO_LONGS(nr_md_blocks) * sizeof(unsigned long));
+	}
+	if (!dmc->hash_buckets || !dmc->hash_next || 
+	    !dmc->free_map || !dmc->dirty_map || !dmc->stripes ||
+	    !dmc->pending_job_buckets || 
+	    (dmc->warm && (!dmc->md_valid_map || !dmc->md_warm_map)) ||
+	    (!dmc->warm && !dmc->md_summary_count)) {
+		ti->error = "Unable to allocate memory";
+		r = -ENOMEM;
+		vfree((void *)dmc->md_summary_count);
+		vfree((void *)dmc->md_valid_map);
+		vfree((void *)dmc->md_warm_map);
+		vfree((void *)dmc->pending_job_buckets);
+		vfree((void *)dmc->stripes);
+		vfree((void *)dmc->hash_buckets);
+		vfree((void *)dmc->hash_next);
+		vfree((void *)dmc->free_map);
+		vfree((void *)dmc->dirty_map);
+		vfree((void *)dmc->cache);
+		vfree((void *)dmc->cache_tag);
+		vfree((void *)dmc->cache_sets);
+		vfree((void *)dmc->md_sectors_buf);
+		goto bad5;
+	}
+	memset(dmc->free_map, 0, order);
+	memset(dmc->dirty_map, 0, order);
+	if (dmc->warm) {
+		memset(dmc->md_valid_map, 0, order);
+		memset(dmc->md_warm_map, 0, 
+		       BITS_TO_LONGS(nr_md_blocks) * sizeof(unsigned long));
+	} else
+		memset(dmc->md_summary_count, 0, FLASHCACHE_SB_SUMMARY_BITS * sizeof(int));
+	spin_lock_init(&dmc->md_summary_lock);
+	bitmap_zero(dmc->md_summary_want, FLASHCACHE_SB_SUMMARY_BITS);
+	bitmap_zero(dmc->md_summary_flash, FLASHCACHE_SB_SUMMARY_BITS);
+	dmc->md_summary_waiters = NULL;
+	dmc->md_summary_inprog = 0;
+	if (dmc->md_load && dmc->md_summary_count) {
+		/* flashcache_md_load() wrote out the old summary, it only grows until loaded */
+		bitmap_copy(dmc->md_summary_want, dmc->md_load->summary, 
+			    FLASHCACHE_SB_SUMMARY_BITS);
+		bitmap_copy(dmc->md_summary_flash, dmc->md_load->summary, 
+			    FLASHCACHE_SB_SUMMARY_BITS);
+		dmc->md_summary_loading = 1;
+	}
+	spin_lock_init(&dmc->md_load_lock);
+	init_waitqueue_head(&dmc->md_load_wait);
+	for (i = 0 ; i < 2 ; i++) {
+		dmc->md_load_bios[i] = NULL;
+		dmc->md_load_bios_tail[i] = &dmc->md_load_bios[i];
+	}
+	memset(dmc->pending_job_buckets, 0, 
+	       FLASHCACHE_PENDING_BUCKETS(dmc) * sizeof(struct pending_job *));
+	atomic_set(&dmc->pending_jobs_count, 0);
+	dmc->pending_jobs_max = 0;
 
 	spin_lock_init(&dmc->cache_spin_lock);
+	spin_lock_init(&dmc->md_commit_lock);
+	dmc->md_commit_jobs = NULL;
+	dmc->md_commit_nr = 0;
+	for (i = 0 ; i < dmc->nr_stripes ; i++)
+		spin_lock_init(&dmc->stripes[i].lock);
 
 	dmc->sync_index = 0;
-	dmc->clean_inprog = 0;
+	atomic_set(&dmc->clean_inprog, 0);
+	atomic_set(&dmc->nr_dirty, 0);
+	atomic_set(&dmc->cached_blocks, 0);
 
 	ti->split_io = dmc->block_size;
 	ti->private = dmc;
@@ -1427,32 +3070,79 @@ init:
 	smp_mb__after_clear_bit();
 	wake_up_bit(&flashcache_control->synch_flags, FLASHCACHE_UPDATE_LIST);
 
-	for (i = 0 ; i < dmc->size ; i++) {
-		if (dmc->cache[i].cache_state & VALID)
-			dmc->cached_blocks++;
-		if (dmc->cache[i].cache_state & DIRTY) {
-			dmc->cache_sets[i / dmc->assoc].nr_dirty++;
-			dmc->nr_dirty++;
+	if (dmc->md_load)
+		/* flashcache_md_loader() sets up each chunk's sets as it loads */
+		dmc->md_loading = 1;
+	else {
+		flashcache_sets_init(dmc);
+		DMINFO("flashcache_ctr: %lu blocks set up in %ums", 
+		       dmc->size, jiffies_to_msecs(jiffies - start));
+	}
+	/* 
+	 * The superblock written at create or load has no dirty summary,
+	 * write the one sets_init() counted up. Without it, a crash costs a
+	 * read of the whole slot table, as before. A lazy cache can't do 
+	 * without, the summary work formats the runs DIRTY slots go to.
+	 */
+	if (dmc->md_summary_count && !dmc->md_loading) {
+		if (flashcache_md_summary_store(dmc, dmc->md_summary_want) == 0)
+			bitmap_copy(dmc->md_summary_flash, dmc->md_summary_want, 
+				    FLASHCACHE_SB_SUMMARY_BITS);
+		else if (!dmc->md_lazy) {
+			vfree((void *)dmc->md_summary_count);
+			dmc->md_summary_count = NULL;
 		}
 	}
+	/* 
+	 * Track the md blocks changed from here on, for an incremental md 
+	 * store. Without it every store writes the whole slot table.
+	 */
+	order = BITS_TO_LONGS(nr_md_blocks) * sizeof(unsigned long);
+	dmc->md_changed = (unsigned long *)vmalloc(order);
+	if (dmc->md_changed)
+		memset(dmc->md_changed, 0, order);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 	INIT_WORK(&dmc->delayed_clean, flashcache_clean_all_sets, dmc);
 	INIT_WORK(&dmc->readfill_wq, flashcache_do_readfill, dmc);
+	INIT_WORK(&dmc->md_commit_work, flashcache_md_commit_flush, dmc);
 #else
 	INIT_DELAYED_WORK(&dmc->delayed_clean, flashcache_clean_all_sets);
 	INIT_WORK(&dmc->readfill_wq, flashcache_do_readfill);
+	INIT_DELAYED_WORK(&dmc->md_commit_work, flashcache_md_commit_flush);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&dmc->warm_flush_work, flashcache_warm_flush, dmc);
+#else
+	INIT_DELAYED_WORK(&dmc->warm_flush_work, flashcache_warm_flush);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&dmc->md_summary_work, flashcache_md_summary_update, dmc);
+#else
+	INIT_WORK(&dmc->md_summary_work, flashcache_md_summary_update);
 #endif
+	if (dmc->warm)
+		schedule_delayed_work(&dmc->warm_flush_work, 
+				      max(sysctl_flashcache_warm_flush_secs, 1) * HZ);
+
+	flashcache_pid_lists_init(dmc);
 
-	dmc->whitelist_head = NULL;
-	dmc->whitelist_tail = NULL;
-	dmc->blacklist_head = NULL;
-	dmc->blacklist_tail = NULL;
-	dmc->num_whitelist_pids = 0;
-	dmc->num_blacklist_pids = 0;
+	if (dmc->md_loading) {
+		if (!IS_ERR(kthread_run(flashcache_md_loader, dmc, "flashcache_load")))
+			DMINFO("flashcache_ctr: Up in %ums, slot table loading in the background", 
+			       jiffies_to_msecs(jiffies - start));
+		else {
+			DMERR("flashcache_ctr: Could not start the md loader, loading here");
+			flashcache_md_loader(dmc);
+		}
+	}
 
 	return 0;
 
 bad5:
+	flashcache_md_load_destroy(dmc);
+	if (dmc->md_sector_pool)
+		mempool_destroy(dmc->md_sector_pool);
+	flashcache_journal_destroy(dmc);
 	flashcache_kcached_client_destroy(dmc);
 bad4:
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
@@ -1468,6 +3158,7 @@ bad3:
 bad2:
 	dm_put_device(ti, dmc->disk_dev);
 bad1:
+	free_percpu(dmc->cpu_stats);
 	kfree(dmc);
 bad:
 	return r;
@@ -1476,37 +3167,50 @@ bad:
 static void
 flashcache_zero_stats(struct cache_c *dmc)
 {
-	dmc->reads = 0;
-	dmc->writes = 0;
-	dmc->read_hits = 0;
-	dmc->write_hits = 0;
-	dmc->dirty_write_hits = 0;
-	dmc->replace = 0;
-	dmc->wr_replace = 0;
-	dmc->wr_invalidates = 0;
-	dmc->rd_invalidates = 0;
-	dmc->pending_inval = 0;
-	dmc->enqueues = 0;
-	dmc->cleanings = 0;
-	dmc->noroom = 0;
-	dmc->md_write_dirty = 0;
-	dmc->md_write_clean = 0;
-	dmc->md_write_batch = 0;
-	dmc->md_ssd_writes = 0;
-#ifdef FLASHCACHE_DO_CHECKSUMS
-	dmc->checksum_store = 0;
-	dmc->checksum_valid = 0;
-	dmc->checksum_invalid = 0;
-#endif
-	dmc->clean_set_calls = dmc->clean_set_less_dirty = 0;
-	dmc->clean_set_fails = dmc->clean_set_ios = 0;
-	dmc->set_limit_reached = dmc->total_limit_reached = 0;
-	dmc->front_merge = dmc->back_merge = 0;
-	dmc->pid_drops = dmc->pid_adds = dmc->pid_dels = dmc->expiry = 0;
-	dmc->uncached_reads = dmc->uncached_writes = 0;
-	dmc->disk_reads = dmc->disk_writes = 0;
-	dmc->ssd_reads = dmc->ssd_writes = 0;
-	dmc->ssd_readfills = dmc->ssd_readfill_unplugs = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dmc->cpu_stats, cpu), 0, 
+		       sizeof(struct flashcache_cpu_stats));
+	dmc->pending_jobs_max = atomic_read(&dmc->pending_jobs_count);
+	dmc->readfill_batch_max = 0;
+}
+
+/* The stats are all unsigned longs, so sum them up as arrays */
+void
+flashcache_get_stats(struct cache_c *dmc, struct flashcache_stats *stats)
+{
+	unsigned long *sum = (unsigned long *)stats, *cpu_stat;
+	int cpu, i;
+
+	memset(stats, 0, sizeof(struct flashcache_stats));
+	for_each_possible_cpu(cpu) {
+		cpu_stat = (unsigned long *)&per_cpu_ptr(dmc->cpu_stats, cpu)->stats;
+		for (i = 0 ; i < sizeof(struct flashcache_stats) / sizeof(unsigned long) ; i++)
+			sum[i] += cpu_stat[i];
+	}
+}
+
+static unsigned long
+flashcache_get_size_hist(struct cache_c *dmc, int sectors)
+{
+	unsigned long count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(dmc->cpu_stats, cpu)->size_hist[sectors];
+	return count;
+}
+
+static unsigned long
+flashcache_get_md_write_size(struct cache_c *dmc, int order)
+{
+	unsigned long count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(dmc->cpu_stats, cpu)->md_write_size[order];
+	return count;
 }
 
 /*
@@ -1519,15 +3223,24 @@ flashcache_dtr(struct dm_target *ti)
 	struct cache_c **nodepp;
 	int i;
 	int nr_queued = 0;
+	struct flashcache_stats stats;
 
 	flashcache_sync_for_remove(dmc);
 	flashcache_md_store(dmc);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
 	dm_io_put(FLASHCACHE_ASYNC_SIZE); /* Must be done after md_store() */
 #endif
-	if (!sysctl_flashcache_fast_remove && dmc->nr_dirty > 0)
+	/* All jobs are done, this waits for the last workers to return */
+	cancel_delayed_work(&dmc->md_commit_work);
+	destroy_workqueue(dmc->md_wq);
+	destroy_workqueue(dmc->kcached_wq);
+	VERIFY(flashcache_job_queues_empty(dmc));
+	free_percpu(dmc->job_queues);
+	/* md_store() wrote the whole slot table, nothing is left to checkpoint */
+	flashcache_journal_destroy(dmc);
+	if (!sysctl_flashcache_fast_remove && atomic_read(&dmc->nr_dirty) > 0)
 		DMERR("Could not sync %d blocks to disk, cache still dirty", 
-		      dmc->nr_dirty);
+		      atomic_read(&dmc->nr_dirty));
 	DMINFO("cache jobs %d, pending jobs %d", atomic_read(&nr_cache_jobs), 
 	       atomic_read(&nr_pending_jobs));
 	for (i = 0 ; i < dmc->size ; i++)
@@ -1538,7 +3251,8 @@ flashcache_dtr(struct dm_target *ti)
 #else
 	dm_kcopyd_client_destroy(dmc->kcp_client);
 #endif
-	if ((dmc->reads > 0) && (dmc->writes > 0)) {
+	flashcache_get_stats(dmc, &stats);
+	if ((stats.reads > 0) && (stats.writes > 0)) {
 #ifdef FLASHCACHE_DO_CHECKSUMS
 		DMINFO("stats: reads(%lu), writes(%lu), read hits(%lu), write hits(%lu), " \
 		       "read hit percent(%ld), replacement(%lu), write invalidates(%lu), " \
@@ -1546,23 +3260,23 @@ flashcache_dtr(struct dm_target *ti)
 		       "pending inval(%lu) cleanings(%lu), " \
 		       "checksum invalid(%ld), checksum store(%ld), checksum valid(%ld)" \
 		       "front merge(%ld) back merge(%ld)",
-		       dmc->reads, dmc->writes, dmc->read_hits, dmc->write_hits,
-		       dmc->read_hits*100/dmc->reads,
-		       dmc->replace, dmc->wr_invalidates, dmc->rd_invalidates,
-		       dmc->wr_replace, dmc->enqueues, dmc->pending_inval, dmc->cleanings,
-		       dmc->checksum_store, dmc->checksum_valid, dmc->checksum_invalid,
-		       dmc->front_merge, dmc->back_merge);
+		       stats.reads, stats.writes, stats.read_hits, stats.write_hits,
+		       stats.read_hits*100/stats.reads,
+		       stats.replace, stats.wr_invalidates, stats.rd_invalidates,
+		       stats.wr_replace, stats.enqueues, stats.pending_inval, stats.cleanings,
+		       stats.checksum_store, stats.checksum_valid, stats.checksum_invalid,
+		       stats.front_merge, stats.back_merge);
 #else
 		DMINFO("stats: reads(%lu), writes(%lu), read hits(%lu), write hits(%lu), " \
 		       "read hit percent(%ld), replacement(%lu), write invalidates(%lu), " \
 		       "read invalidates(%lu), write replacement(%lu), pending enqueues(%lu), " \
 		       "pending inval(%lu) cleanings(%lu)" \
 		       "front merge(%ld) back merge(%ld)",
-		       dmc->reads, dmc->writes, dmc->read_hits, dmc->write_hits,
-		       dmc->read_hits*100/dmc->reads,
-		       dmc->replace, dmc->wr_invalidates, dmc->rd_invalidates,
-		       dmc->wr_replace, dmc->enqueues, dmc->pending_inval, dmc->cleanings,
-		       dmc->front_merge, dmc->back_merge);
+		       stats.reads, stats.writes, stats.read_hits, stats.write_hits,
+		       stats.read_hits*100/stats.reads,
+		       stats.replace, stats.wr_invalidates, stats.rd_invalidates,
+		       stats.wr_replace, stats.enqueues, stats.pending_inval, stats.cleanings,
+		       stats.front_merge, stats.back_merge);
 #endif
 
 	}
@@ -1571,19 +3285,32 @@ flashcache_dtr(struct dm_target *ti)
 		       "total blocks(%lu), cached blocks(%lu), cache percent(%ld), dirty blocks(%d)",
 		       dmc->size*dmc->block_size>>11, dmc->assoc,
 		       dmc->block_size>>(10-SECTOR_SHIFT), 
-		       dmc->size, dmc->cached_blocks, 
-		       (dmc->cached_blocks*100)/dmc->size, dmc->nr_dirty);
+		       dmc->size, (unsigned long)atomic_read(&dmc->cached_blocks), 
+		       (atomic_read(&dmc->cached_blocks)*100L)/dmc->size, 
+		       atomic_read(&dmc->nr_dirty));
 	}
 	vfree((void *)dmc->cache);
+	vfree((void *)dmc->cache_tag);
 	vfree((void *)dmc->cache_sets);
 	vfree((void *)dmc->md_sectors_buf);
+	mempool_destroy(dmc->md_sector_pool);
+	vfree((void *)dmc->hash_buckets);
+	vfree((void *)dmc->hash_next);
+	vfree((void *)dmc->free_map);
+	vfree((void *)dmc->dirty_map);
+	vfree((void *)dmc->md_changed);
+	vfree((void *)dmc->md_valid_map);
+	vfree((void *)dmc->md_warm_map);
+	vfree((void *)dmc->md_summary_count);
+	vfree((void *)dmc->md_load_done);
+	vfree((void *)dmc->md_load_dirty);
+	vfree((void *)dmc->md_load_failed);
+	vfree((void *)dmc->stripes);
+	vfree((void *)dmc->pending_job_buckets);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
 	dm_io_client_destroy(dmc->io_client);
 #endif
-	flashcache_del_all_pids(dmc, FLASHCACHE_WHITELIST, 1);
-	flashcache_del_all_pids(dmc, FLASHCACHE_BLACKLIST, 1);
-	VERIFY(dmc->num_whitelist_pids == 0);
-	VERIFY(dmc->num_blacklist_pids == 0);
+	flashcache_pid_lists_destroy(dmc);
 	dm_put_device(ti, dmc->disk_dev);
 	dm_put_device(ti, dmc->cache_dev);
 	(void)wait_on_bit_lock(&flashcache_control->synch_flags, 
@@ -1601,6 +3328,7 @@ flashcache_dtr(struct dm_target *ti)
 	clear_bit(FLASHCACHE_UPDATE_LIST, &flashcache_control->synch_flags);
 	smp_mb__after_clear_bit();
 	wake_up_bit(&flashcache_control->synch_flags, FLASHCACHE_UPDATE_LIST);
+	free_percpu(dmc->cpu_stats);
 	kfree(dmc);
 }
 
@@ -1610,19 +3338,21 @@ flashcache_status_info(struct cache_c *dmc, status_type_t type,
 {
 	int read_hit_pct, write_hit_pct, dirty_write_hit_pct;
 	int sz = 0; /* DMEMIT */
+	struct flashcache_stats stats;
 	
-	if (dmc->reads > 0)
-		read_hit_pct = dmc->read_hits * 100 / dmc->reads;
+	flashcache_get_stats(dmc, &stats);
+	if (stats.reads > 0)
+		read_hit_pct = stats.read_hits * 100 / stats.reads;
 	else
 		read_hit_pct = 0;
-	if (dmc->writes > 0) {
-		write_hit_pct = dmc->write_hits * 100 / dmc->writes;
-		dirty_write_hit_pct = dmc->dirty_write_hits * 100 / dmc->writes;		
+	if (stats.writes > 0) {
+		write_hit_pct = stats.write_hits * 100 / stats.writes;
+		dirty_write_hit_pct = stats.dirty_write_hits * 100 / stats.writes;		
 	} else {
 		write_hit_pct = 0;
 		dirty_write_hit_pct = 0;
 	}
-	DMEMIT("stats: \n\treads(%lu), writes(%lu)\n", dmc->reads, dmc->writes);
+	DMEMIT("stats: \n\treads(%lu), writes(%lu)\n", stats.reads, stats.writes);
 #ifdef FLASHCACHE_DO_CHECKSUMS
 	DMEMIT("\tread hits(%lu), read hit percent(%d)\n"		\
 	       "\twrite hits(%lu) write hit percent(%d)\n" 		\
@@ -1630,53 +3360,69 @@ flashcache_status_info(struct cache_c *dmc, status_type_t type,
 	       "\treplacement(%lu), write replacement(%lu)\n"		\
 	       "\twrite invalidates(%lu), read invalidates(%lu)\n"	\
 	       "\tchecksum store(%ld), checksum valid(%ld), checksum invalid(%ld)\n" \
-	       "\tpending enqueues(%lu), pending inval(%lu)\n"		\
+	       "\tpending enqueues(%lu), pending inval(%lu), aligned inval skips(%lu)\n" \
 	       "\tmetadata dirties(%lu), metadata cleans(%lu)\n" \
-	       "\tmetadata batch(%lu) metadata ssd writes(%lu)\n" \
+	       "\tmetadata batch(%lu) metadata ssd writes(%lu) metadata buffer waits(%lu)\n" \
+	       "\tmetadata fences(%lu) metadata warm(%lu) dirty summary writes(%lu) lazy formats(%lu)\n" \
+	       "\tjournal writes(%lu) journal updates(%lu) checkpoints(%lu)\n" \
 	       "\tcleanings(%lu), no room(%lu) front merge(%lu) back merge(%lu)\n" \
 	       "\tdisk reads(%lu), disk writes(%lu) ssd reads(%lu) ssd writes(%lu)\n" \
 	       "\tuncached reads(%lu), uncached writes(%lu)\n" \
-	       "\treadfills(%lu), readfill unplugs(%lu)\n" \
+	       "\tload waits(%lu), load passthru(%lu)\n" \
+	       "\treadfills(%lu), readfill unplugs(%lu), readfill merges(%lu), max readfill batch(%d)\n" \
 	       "\tpid_adds(%lu), pid_dels(%lu), pid_drops(%lu) pid_expiry(%lu)",
-	       dmc->read_hits, read_hit_pct, 
-	       dmc->write_hits, write_hit_pct,
-	       dmc->dirty_write_hits, dirty_write_hit_pct,
-	       dmc->replace, dmc->wr_replace, dmc->wr_invalidates, dmc->rd_invalidates,
-	       dmc->checksum_store, dmc->checksum_valid, dmc->checksum_invalid,
-	       dmc->enqueues, dmc->pending_inval, 
-	       dmc->md_write_dirty, dmc->md_write_clean, 
-	       dmc->md_write_batch, dmc->md_ssd_writes,
-	       dmc->cleanings, dmc->noroom, dmc->front_merge, dmc->back_merge,
-	       dmc->disk_reads, dmc->disk_writes, dmc->ssd_reads, dmc->ssd_writes,
-	       dmc->uncached_reads, dmc->uncached_writes,
-	       dmc->ssd_readfills, dmc->ssd_readfill_unplugs,
-	       dmc->pid_adds, dmc->pid_dels, dmc->pid_drops, dmc->expiry);
+	       stats.read_hits, read_hit_pct, 
+	       stats.write_hits, write_hit_pct,
+	       stats.dirty_write_hits, dirty_write_hit_pct,
+	       stats.replace, stats.wr_replace, stats.wr_invalidates, stats.rd_invalidates,
+	       stats.checksum_store, stats.checksum_valid, stats.checksum_invalid,
+	       stats.enqueues, stats.pending_inval, stats.aligned_inval_skips,
+	       stats.md_write_dirty, stats.md_write_clean, 
+	       stats.md_write_batch, stats.md_ssd_writes, stats.md_alloc_waits,
+	       stats.md_write_fence, stats.md_write_warm, stats.md_summary_writes,
+	       stats.md_formats,
+	       stats.md_journal_writes, stats.md_journal_entries, stats.md_checkpoints,
+	       stats.cleanings, stats.noroom, stats.front_merge, stats.back_merge,
+	       stats.disk_reads, stats.disk_writes, stats.ssd_reads, stats.ssd_writes,
+	       stats.uncached_reads, stats.uncached_writes,
+	       stats.md_load_waits, stats.md_load_passthru,
+	       stats.ssd_readfills, stats.ssd_readfill_unplugs,
+	       stats.ssd_readfill_merges, dmc->readfill_batch_max,
+	       stats.pid_adds, stats.pid_dels, stats.pid_drops, stats.expiry);
 #else
 	DMEMIT("\tread hits(%lu), read hit percent(%d)\n"		\
 	       "\twrite hits(%lu) write hit percent(%d)\n" 		\
 	       "\tdirty write hits(%lu) dirty write hit percent(%d)\n" 	\
 	       "\treplacement(%lu) write replacement(%lu)\n"		\
 	       "\twrite invalidates(%lu) read invalidates(%lu)\n"	\
-	       "\tpending enqueues(%lu) pending inval(%lu)\n"		\
+	       "\tpending enqueues(%lu) pending inval(%lu) aligned inval skips(%lu)\n" \
 	       "\tmetadata dirties(%lu) metadata cleans(%lu)\n" \
-	       "\tmetadata batch(%lu) metadata ssd writes(%lu)\n" \
+	       "\tmetadata batch(%lu) metadata ssd writes(%lu) metadata buffer waits(%lu)\n" \
+	       "\tmetadata fences(%lu) metadata warm(%lu) dirty summary writes(%lu) lazy formats(%lu)\n" \
+	       "\tjournal writes(%lu) journal updates(%lu) checkpoints(%lu)\n" \
 	       "\tcleanings(%lu) no room(%lu) front merge(%lu) back merge(%lu)\n" \
 	       "\tdisk reads(%lu) disk writes(%lu) ssd reads(%lu) ssd writes(%lu)\n" \
 	       "\tuncached reads(%lu) uncached writes(%lu)\n" \
-	       "\treadfills(%lu) readfill unplugs(%lu)\n" \
+	       "\tload waits(%lu) load passthru(%lu)\n" \
+	       "\treadfills(%lu) readfill unplugs(%lu) readfill merges(%lu) max readfill batch(%d)\n" \
 	       "\tpid_adds(%lu) pid_dels(%lu) pid_drops(%lu) pid_expiry(%lu)",
-	       dmc->read_hits, read_hit_pct, 
-	       dmc->write_hits, write_hit_pct,
-	       dmc->dirty_write_hits, dirty_write_hit_pct,
-	       dmc->replace, dmc->wr_replace, dmc->wr_invalidates, dmc->rd_invalidates,
-	       dmc->enqueues, dmc->pending_inval, 
-	       dmc->md_write_dirty, dmc->md_write_clean, 
-	       dmc->md_write_batch, dmc->md_ssd_writes,
-	       dmc->cleanings, dmc->noroom, dmc->front_merge, dmc->back_merge,
-	       dmc->disk_reads, dmc->disk_writes, dmc->ssd_reads, dmc->ssd_writes,
-	       dmc->uncached_reads, dmc->uncached_writes,
-	       dmc->ssd_readfills, dmc->ssd_readfill_unplugs,
-	       dmc->pid_adds, dmc->pid_dels, dmc->pid_drops, dmc->expiry);
+	       stats.read_hits, read_hit_pct, 
+	       stats.write_hits, write_hit_pct,
+	       stats.dirty_write_hits, dirty_write_hit_pct,
+	       stats.replace, stats.wr_replace, stats.wr_invalidates, stats.rd_invalidates,
+	       stats.enqueues, stats.pending_inval, stats.aligned_inval_skips,
+	       stats.md_write_dirty, stats.md_write_clean, 
+	       stats.md_write_batch, stats.md_ssd_writes, stats.md_alloc_waits,
+	       stats.md_write_fence, stats.md_write_warm, stats.md_summary_writes,
+	       stats.md_formats,
+	       stats.md_journal_writes, stats.md_journal_entries, stats.md_checkpoints,
+	       stats.cleanings, stats.noroom, stats.front_merge, stats.back_merge,
+	       stats.disk_reads, stats.disk_writes, stats.ssd_reads, stats.ssd_writes,
+	       stats.uncached_reads, stats.uncached_writes,
+	       stats.md_load_waits, stats.md_load_passthru,
+	       stats.ssd_readfills, stats.ssd_readfill_unplugs,
+	       stats.ssd_readfill_merges, dmc->readfill_batch_max,
+	       stats.pid_adds, stats.pid_dels, stats.pid_drops, stats.expiry);
 #endif
 }
 
@@ -1689,8 +3435,8 @@ flashcache_status_table(struct cache_c *dmc, status_type_t type,
 	int sz = 0; /* DMEMIT */
 
 	if (dmc->size > 0) {
-		dirty_pct = (dmc->nr_dirty * 100.0) / dmc->size;
-		cache_pct = (dmc->cached_blocks * 100.0) / dmc->size;
+		dirty_pct = (atomic_read(&dmc->nr_dirty) * 100.0) / dmc->size;
+		cache_pct = (atomic_read(&dmc->cached_blocks) * 100.0) / dmc->size;
 	} else {
 		cache_pct = 0;
 		dirty_pct = 0;
@@ -1703,13 +3449,32 @@ flashcache_status_table(struct cache_c *dmc, status_type_t type,
 	       dmc->cache_devname, dmc->disk_devname,
 	       dmc->size*dmc->block_size>>11, dmc->assoc,
 	       dmc->block_size>>(10-SECTOR_SHIFT), 
-	       dmc->size, dmc->cached_blocks, 
-	       (int)cache_pct, dmc->nr_dirty, (int)dirty_pct);
-	DMEMIT("\tnr_queued(%lu)\n", dmc->pending_jobs_count);
+	       dmc->size, (unsigned long)atomic_read(&dmc->cached_blocks), 
+	       (int)cache_pct, atomic_read(&dmc->nr_dirty), (int)dirty_pct);
+	DMEMIT("\tset hash(%s), set hash granule(%u)\n",
+	       (dmc->set_hash == FLASHCACHE_SET_HASH_XOR ? "xor" :
+		(dmc->set_hash == FLASHCACHE_SET_HASH_MULT ? "mult" : "contig")),
+	       1 << dmc->granule_shift);
+	DMEMIT("\tlock stripes(%u)\n", dmc->nr_stripes);
+	DMEMIT("\tmd block size(%u)\n", dmc->md_block_size * 512);
+	if (dmc->journal)
+		DMEMIT("\tmd journal(%dK)\n", 
+		       dmc->journal->nr_records * (FLASHCACHE_JOURNAL_RECORD_SIZE >> 10));
+	DMEMIT("\tnr_queued(%d), max_queued(%d)\n", 
+	       atomic_read(&dmc->pending_jobs_count), dmc->pending_jobs_max);
 	DMEMIT("Size Hist: ");
 	for (i = 1 ; i <= 32 ; i++) {
-		if (size_hist[i] > 0)
-			DMEMIT("%d:%llu ", i*512, size_hist[i]);
+		unsigned long count = flashcache_get_size_hist(dmc, i);
+
+		if (count > 0)
+			DMEMIT("%d:%lu ", i*512, count);
+	}
+	DMEMIT("\nMd Write Hist: ");
+	for (i = 0 ; i < FLASHCACHE_MD_WRITE_HIST ; i++) {
+		unsigned long count = flashcache_get_md_write_size(dmc, i);
+
+		if (count > 0)
+			DMEMIT("%d:%lu ", 1 << i, count);
 	}
 }
 
@@ -1749,6 +3514,19 @@ static struct target_type flashcache_target = {
 static void
 flashcache_sync_for_remove(struct cache_c *dmc)
 {
+	/* 
+	 * The loader has to be done with the slot table, and gone: it wakes 
+	 * us up under md_load_lock.
+	 */
+	wait_event(dmc->md_load_wait, !dmc->md_loading);
+	spin_lock_irq(&dmc->md_load_lock);
+	spin_unlock_irq(&dmc->md_load_lock);
+	/* md_store() writes out whatever the warm flush hasn't */
+	dmc->warm_flush_stop = 1;
+	cancel_delayed_work(&dmc->warm_flush_work);
+	flush_scheduled_work();
+	cancel_delayed_work(&dmc->warm_flush_work);
+	flush_scheduled_work();
 	do {
 		cancel_delayed_work(&dmc->delayed_clean);
 		flush_scheduled_work();
@@ -1757,7 +3535,8 @@ flashcache_sync_for_remove(struct cache_c *dmc)
 			 * Kick off cache cleaning. client_destroy will wait for cleanings
 			 * to finish.
 			 */
-			printk(KERN_ALERT "Cleaning %d blocks please WAIT", dmc->nr_dirty);
+			printk(KERN_ALERT "Cleaning %d blocks please WAIT", 
+			       atomic_read(&dmc->nr_dirty));
 			/* Tune up the cleaning parameters to clean very aggressively */
 			dmc->max_clean_ios_total = 20;
 			dmc->max_clean_ios_set = 10;
@@ -1766,7 +3545,7 @@ flashcache_sync_for_remove(struct cache_c *dmc)
 			/* Needed to abort any in-progress cleanings, leave blocks DIRTY */
 			atomic_set(&dmc->fast_remove_in_prog, 1);
 			printk(KERN_ALERT "Fast flashcache remove Skipping cleaning of %d blocks", 
-			       dmc->nr_dirty);
+			       atomic_read(&dmc->nr_dirty));
 		}
 		/* 
 		 * We've prevented new cleanings from starting (for the fast remove case)
@@ -1777,7 +3556,10 @@ flashcache_sync_for_remove(struct cache_c *dmc)
 		msleep(FLASHCACHE_SYNC_REMOVE_DELAY);
 		/* Wait for all the dirty blocks to get written out, and any other IOs */
 		wait_event(dmc->destroyq, !atomic_read(&dmc->nr_jobs));
-	} while (!sysctl_flashcache_fast_remove && dmc->nr_dirty > 0);
+	} while (!sysctl_flashcache_fast_remove && atomic_read(&dmc->nr_dirty) > 0);
+	/* A dirty summary write must not land after md_store()'s superblock */
+	flush_workqueue(dmc->kcached_wq);
+	flush_workqueue(dmc->md_wq);
 }
 
 static int 
@@ -1830,39 +3612,41 @@ flashcache_stats_show(struct seq_file *seq, void *v)
 	     dmc != NULL ; 
 	     dmc = dmc->next_cache) {
 		int read_hit_pct, write_hit_pct, dirty_write_hit_pct;
+		struct flashcache_stats stats;
 
-		if (dmc->reads > 0)
-			read_hit_pct = dmc->read_hits * 100 / dmc->reads;
+		flashcache_get_stats(dmc, &stats);
+		if (stats.reads > 0)
+			read_hit_pct = stats.read_hits * 100 / stats.reads;
 		else
 			read_hit_pct = 0;
-		if (dmc->writes > 0) {
-			write_hit_pct = dmc->write_hits * 100 / dmc->writes;
-			dirty_write_hit_pct = dmc->dirty_write_hits * 100 / dmc->writes;		
+		if (stats.writes > 0) {
+			write_hit_pct = stats.write_hits * 100 / stats.writes;
+			dirty_write_hit_pct = stats.dirty_write_hits * 100 / stats.writes;		
 		} else {
 			write_hit_pct = 0;
 			dirty_write_hit_pct = 0;
 		}
-		seq_printf(seq, "reads=%lu writes=%lu ", dmc->reads, dmc->writes);
+		seq_printf(seq, "reads=%lu writes=%lu ", stats.reads, stats.writes);
 		seq_printf(seq, "read_hits=%lu read_hit_percent=%d write_hits=%lu write_hit_percent=%d ",
-			   dmc->read_hits, read_hit_pct, dmc->write_hits, write_hit_pct);
+			   stats.read_hits, read_hit_pct, stats.write_hits, write_hit_pct);
 		seq_printf(seq, "dirty_write_hits=%lu dirty_write_hit_percent=%d ",
-			   dmc->dirty_write_hits, dirty_write_hit_pct);
+			   stats.dirty_write_hits, dirty_write_hit_pct);
 		seq_printf(seq, "replacement=%lu write_replacement=%lu ", 
-			   dmc->replace, dmc->wr_replace);
+			   stats.replace, stats.wr_replace);
 		seq_printf(seq, "write_invalidates=%lu read_invalidates=%lu ", 
-			   dmc->wr_invalidates, dmc->rd_invalidates);
-		seq_printf(seq, "pending_enqueues=%lu pending_inval=%lu ", 
-			   dmc->enqueues, dmc->pending_inval);
+			   stats.wr_invalidates, stats.rd_invalidates);
+		seq_printf(seq, "pending_enqueues=%lu pending_inval=%lu aligned_inval_skips=%lu ", 
+			   stats.enqueues, stats.pending_inval, stats.aligned_inval_skips);
 		seq_printf(seq, "metadata_dirties=%lu metadata_cleans=%lu ", 
-			   dmc->md_write_dirty, dmc->md_write_clean);
+			   stats.md_write_dirty, stats.md_write_clean);
 		seq_printf(seq, "cleanings=%lu no_room=%lu front_merge=%lu back_merge=%lu ",
-			   dmc->cleanings, dmc->noroom, dmc->front_merge, dmc->back_merge);
+			   stats.cleanings, stats.noroom, stats.front_merge, stats.back_merge);
 		seq_printf(seq, "pid_adds=%lu pid_dels=%lu pid_drops=%lu pid_expiry=%lu ",
-			   dmc->pid_adds, dmc->pid_dels, dmc->pid_drops, dmc->expiry);
+			   stats.pid_adds, stats.pid_dels, stats.pid_drops, stats.expiry);
 		seq_printf(seq, "disk_reads=%lu disk_writes=%lu ssd_reads=%lu ssd_writes=%lu ",
-			   dmc->disk_reads, dmc->disk_writes, dmc->ssd_reads, dmc->ssd_writes);
+			   stats.disk_reads, stats.disk_writes, stats.ssd_reads, stats.ssd_writes);
 		seq_printf(seq, "uncached_reads=%lu uncached_writes=%lu\n",
-			   dmc->uncached_reads, dmc->uncached_writes);
+			   stats.uncached_reads, stats.uncached_writes);
 
 	}
 	clear_bit(FLASHCACHE_UPDATE_LIST, &flashcache_control->synch_flags);
@@ -1929,12 +3713,26 @@ static struct file_operations flashcache_errors_operations = {
 static int 
 flashcache_iosize_hist_show(struct seq_file *seq, void *v)
 {
+	struct cache_c *dmc;
+	unsigned long count;
 	int i;
 	
+	(void)wait_on_bit_lock(&flashcache_control->synch_flags, 
+			       FLASHCACHE_UPDATE_LIST,
+			       flashcache_wait_schedule, 
+			       TASK_UNINTERRUPTIBLE);
 	for (i = 1 ; i <= 32 ; i++) {
-		seq_printf(seq, "%d:%llu ", i*512, size_hist[i]);
+		count = 0;
+		for (dmc = cache_list_head ; 
+		     dmc != NULL ; 
+		     dmc = dmc->next_cache)
+			count += flashcache_get_size_hist(dmc, i);
+		seq_printf(seq, "%d:%lu ", i*512, count);
 	}
 	seq_printf(seq, "\n");
+	clear_bit(FLASHCACHE_UPDATE_LIST, &flashcache_control->synch_flags);
+	smp_mb__after_clear_bit();
+	wake_up_bit(&flashcache_control->synch_flags, FLASHCACHE_UPDATE_LIST);
 	return 0;
 }
 
@@ -2036,13 +3834,6 @@ flashcache_init(void)
 		return r;
 	atomic_set(&nr_cache_jobs, 0);
 	atomic_set(&nr_pending_jobs, 0);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
-	INIT_WORK(&_kcached_wq, do_work, NULL);
-#else
-	INIT_WORK(&_kcached_wq, do_work);
-#endif
-	for (r = 0 ; r < 33 ; r++)
-		size_hist[r] = 0;
 	r = dm_register_target(&flashcache_target);
 	if (r < 0) {
 		DMERR("cache: register failed %d", r);
@@ -2098,6 +3889,8 @@ flashcache_exit(void)
 #endif
 	unregister_reboot_notifier(&flashcache_notifier);
 	flashcache_jobs_exit();
+	/* Pids removed from the lists are freed after an RCU grace period */
+	rcu_barrier();
 #ifdef CONFIG_PROC_FS
 	unregister_sysctl_table(flashcache_table_header);
 	remove_proc_entry("flashcache_stats", NULL);
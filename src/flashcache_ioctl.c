@@ -38,6 +38,8 @@
 #include <linux/sysctl.h>
 #include <linux/version.h>
 #include <linux/pid.h>
+#include <linux/rcupdate.h>
+#include <linux/timer.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 #include "dm.h"
@@ -57,76 +59,143 @@
 
 extern int sysctl_flashcache_max_pids;
 extern int sysctl_pid_expiry_check;
+extern int sysctl_pid_do_expiry;
 extern int sysctl_cache_all;
 
-static int flashcache_find_pid_locked(struct cache_c *dmc, pid_t pid, 
-				      int which_list);
-static void flashcache_del_pid_locked(struct cache_c *dmc, pid_t pid, 
-				      int which_list);
-
+/*
+ * The white/black lists are each kept twice : a list in the order the pids
+ * were added (for dropping and listing pids), and a hash keyed by pid for
+ * the lookups done on every IO. Both are updated under cache_spin_lock. The
+ * lookups are lockless, under rcu_read_lock(), so pids are freed after a
+ * grace period.
+ */
 static int
-flashcache_find_pid_locked(struct cache_c *dmc, pid_t pid, 
-			   int which_list)
+flashcache_find_pid(struct cache_c *dmc, pid_t pid, int which_list)
 {
-	struct flashcache_cachectl_pid *pid_list;
+	struct flashcache_cachectl_pid *node;
+	struct hlist_node *pos;
 	
-	pid_list = ((which_list == FLASHCACHE_WHITELIST) ? 
-		    dmc->whitelist_head : dmc->blacklist_head);
-	for ( ; pid_list != NULL ; pid_list = pid_list->next) {
-		if (pid_list->pid == pid)
+	hlist_for_each_entry_rcu(node, pos, 
+				 &dmc->pid_hash[which_list][FLASHCACHE_PID_HASH(pid)], 
+				 hash) {
+		if (node->pid == pid)
 			return 1;
 	}
 	return 0;	
 }
 
+static void
+flashcache_free_pid_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct flashcache_cachectl_pid, rcu));
+}
+
+static void
+flashcache_unlink_pid_locked(struct cache_c *dmc, 
+			     struct flashcache_cachectl_pid *node, 
+			     int which_list)
+{
+	struct flashcache_cachectl_pid **head, **tail;
+	
+	if (which_list == FLASHCACHE_WHITELIST) {
+		VERIFY(dmc->num_whitelist_pids > 0);
+		head = &dmc->whitelist_head;
+		tail = &dmc->whitelist_tail;
+		dmc->num_whitelist_pids--;
+	} else {
+		VERIFY(dmc->num_blacklist_pids > 0);
+		head = &dmc->blacklist_head;
+		tail = &dmc->blacklist_tail;
+		dmc->num_blacklist_pids--;
+	}
+	if (node->prev == NULL)
+		*head = node->next;
+	else
+		node->prev->next = node->next;
+	if (node->next == NULL)
+		*tail = node->prev;
+	else
+		node->next->prev = node->prev;
+	hlist_del_rcu(&node->hash);
+	call_rcu(&node->rcu, flashcache_free_pid_rcu);
+}
+
 static void
 flashcache_drop_pids(struct cache_c *dmc, int which_list)
 {
 	if (which_list == FLASHCACHE_WHITELIST) {
 		while (dmc->num_whitelist_pids >= sysctl_flashcache_max_pids) {
 			VERIFY(dmc->whitelist_head != NULL);
-			flashcache_del_pid_locked(dmc, dmc->whitelist_tail->pid,
-						  which_list);
-			dmc->pid_drops++;
+			flashcache_unlink_pid_locked(dmc, dmc->whitelist_tail,
+						     which_list);
+			FLASHCACHE_STATS_INC(dmc, pid_drops);
 		}
 	} else {
 		while (dmc->num_blacklist_pids >= sysctl_flashcache_max_pids) {
 			VERIFY(dmc->blacklist_head != NULL);
-			flashcache_del_pid_locked(dmc, dmc->blacklist_tail->pid,
-						  which_list);
-			dmc->pid_drops++;
+			flashcache_unlink_pid_locked(dmc, dmc->blacklist_tail,
+						     which_list);
+			FLASHCACHE_STATS_INC(dmc, pid_drops);
 		}		
 	}
 }
 
-static void
-flashcache_add_pid(struct cache_c *dmc, pid_t pid, int which_list)
+/* 
+ * Add a batch of pids to a list. The pids are allocated up front, so the 
+ * lock is taken once for the whole batch.
+ */
+static int
+flashcache_add_pids(struct cache_c *dmc, pid_t *pids, int nr_pids, 
+		    int which_list)
 {
-	struct flashcache_cachectl_pid *new;
+	struct flashcache_cachectl_pid *new, *batch = NULL;
+	struct flashcache_cachectl_pid **head, **tail;
  	unsigned long flags;
+	int i;
 
-	new = kmalloc(sizeof(struct flashcache_cachectl_pid), GFP_KERNEL);
-	new->pid = pid;
-	new->next = NULL;
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	for (i = nr_pids - 1 ; i >= 0 ; i--) {
+		new = kmalloc(sizeof(struct flashcache_cachectl_pid), GFP_KERNEL);
+		if (new == NULL) {
+			while (batch != NULL) {
+				new = batch;
+				batch = batch->next;
+				kfree(new);
+			}
+			return -ENOMEM;
+		}
+		new->pid = pids[i];
+		new->next = batch;
+		batch = new;
+	}
 	if (which_list == FLASHCACHE_WHITELIST) {
-		if (dmc->num_whitelist_pids > sysctl_flashcache_max_pids)
-			flashcache_drop_pids(dmc, which_list);
+		head = &dmc->whitelist_head;
+		tail = &dmc->whitelist_tail;
 	} else {
-		if (dmc->num_blacklist_pids > sysctl_flashcache_max_pids)
-			flashcache_drop_pids(dmc, which_list);		
+		head = &dmc->blacklist_head;
+		tail = &dmc->blacklist_tail;
 	}
-	if (flashcache_find_pid_locked(dmc, pid, which_list) == 0) {
-		struct flashcache_cachectl_pid **head, **tail;
-		
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	while (batch != NULL) {
+		new = batch;
+		batch = batch->next;
 		if (which_list == FLASHCACHE_WHITELIST) {
-			head = &dmc->whitelist_head;
-			tail = &dmc->whitelist_tail;
+			if (dmc->num_whitelist_pids > sysctl_flashcache_max_pids)
+				flashcache_drop_pids(dmc, which_list);
 		} else {
-			head = &dmc->blacklist_head;
-			tail = &dmc->blacklist_tail;
+			if (dmc->num_blacklist_pids > sysctl_flashcache_max_pids)
+				flashcache_drop_pids(dmc, which_list);		
+		}
+		if (flashcache_find_pid(dmc, new->pid, which_list)) {
+			kfree(new);
+			continue;
 		}
+		/* When adding the first pid to either list, start the expiry timer */
+		if (dmc->num_whitelist_pids == 0 && dmc->num_blacklist_pids == 0)
+			mod_timer(&dmc->pid_expiry_timer, 
+				  jiffies + (sysctl_pid_expiry_check + 1) * HZ);
+		new->expiry = jiffies + sysctl_pid_expiry_check * HZ;
 		/* Add the new pid to the tail */
+		new->next = NULL;
 		new->prev = *tail;
 		if (*head == NULL) {
 			VERIFY(*tail == NULL);
@@ -136,70 +205,45 @@ flashcache_add_pid(struct cache_c *dmc, pid_t pid, int which_list)
 			(*tail)->next = new;
 		}
 		*tail = new;
+		hlist_add_head_rcu(&new->hash, 
+				   &dmc->pid_hash[which_list][FLASHCACHE_PID_HASH(new->pid)]);
 		if (which_list == FLASHCACHE_WHITELIST)
 			dmc->num_whitelist_pids++;
 		else
 			dmc->num_blacklist_pids++;
-		dmc->pid_adds++;
-		/* When adding the first entry to list, set expiry check timeout */
-		if (*head == new)
-			dmc->pid_expire_check = 
-				jiffies + ((sysctl_pid_expiry_check + 1) * HZ);
-	} else
-		kfree(new);
+		FLASHCACHE_STATS_INC(dmc, pid_adds);
+	}
 	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-	return;
+	return 0;
 }
 
 static void
 flashcache_del_pid_locked(struct cache_c *dmc, pid_t pid, int which_list)
 {
 	struct flashcache_cachectl_pid *node;
-	struct flashcache_cachectl_pid **head, **tail;
+	struct hlist_node *pos;
 	
-	if (which_list == FLASHCACHE_WHITELIST) {
-		head = &dmc->whitelist_head;
-		tail = &dmc->whitelist_tail;
-	} else {
-		head = &dmc->blacklist_head;
-		tail = &dmc->blacklist_tail;
-	}
-	for (node = *tail ; node != NULL ; node = node->prev) {
-		if (which_list == FLASHCACHE_WHITELIST)
-			VERIFY(dmc->num_whitelist_pids > 0);
-		else
-			VERIFY(dmc->num_blacklist_pids > 0);
+	hlist_for_each_entry(node, pos, 
+			     &dmc->pid_hash[which_list][FLASHCACHE_PID_HASH(pid)], 
+			     hash) {
 		if (node->pid == pid) {
-			if (node->prev == NULL) {
-				*head = node->next;
-				if (node->next)
-					node->next->prev = NULL;
-			} else
-				node->prev->next = node->next;
-			if (node->next == NULL) {
-				*tail = node->prev;
-				if (node->prev)
-					node->prev->next = NULL;
-			} else
-				node->next->prev = node->prev;
-			kfree(node);
-			dmc->pid_dels++;
-			if (which_list == FLASHCACHE_WHITELIST)
-				dmc->num_whitelist_pids--;
-			else
-				dmc->num_blacklist_pids--;
+			flashcache_unlink_pid_locked(dmc, node, which_list);
+			FLASHCACHE_STATS_INC(dmc, pid_dels);
 			return;
 		}
 	}
 }
 
 static void
-flashcache_del_pid(struct cache_c *dmc, pid_t pid, int which_list)
+flashcache_del_pids(struct cache_c *dmc, pid_t *pids, int nr_pids, 
+		    int which_list)
 {
 	unsigned long flags;
+	int i;
 
 	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-	flashcache_del_pid_locked(dmc, pid, which_list);
+	for (i = 0 ; i < nr_pids ; i++)
+		flashcache_del_pid_locked(dmc, pids[i], which_list);
 	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
 }
 
@@ -240,7 +284,8 @@ flashcache_del_all_pids(struct cache_c *dmc, int which_list, int force)
 			}
 		}
 #endif
-		flashcache_del_pid_locked(dmc, node->pid, which_list);
+		flashcache_unlink_pid_locked(dmc, node, which_list);
+		FLASHCACHE_STATS_INC(dmc, pid_dels);
 		node = *tail;
 	}
 	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
@@ -250,51 +295,69 @@ flashcache_del_all_pids(struct cache_c *dmc, int which_list, int force)
 static void
 flashcache_pid_expiry_list_locked(struct cache_c *dmc, int which_list)
 {
-	struct flashcache_cachectl_pid **head, **tail, *node;
+	struct flashcache_cachectl_pid *node, *next;
 	
-	if (which_list == FLASHCACHE_WHITELIST) {
-		head = &dmc->whitelist_head;
-		tail = &dmc->whitelist_tail;
-	} else {
-		head = &dmc->blacklist_head;
-		tail = &dmc->blacklist_tail;
-	}
-	for (node = *head ; node != NULL ; node = node->next) {
-		if (which_list == FLASHCACHE_WHITELIST)
-			VERIFY(dmc->num_whitelist_pids > 0);
-		else
-			VERIFY(dmc->num_blacklist_pids > 0);
+	if (which_list == FLASHCACHE_WHITELIST)
+		node = dmc->whitelist_head;
+	else
+		node = dmc->blacklist_head;
+	for ( ; node != NULL ; node = next) {
+		next = node->next;
 		if (time_after(node->expiry, jiffies))
 			continue;
-		if (node->prev == NULL) {
-			*head = node->next;
-			if (node->next)
-				node->next->prev = NULL;
-		} else
-			node->prev->next = node->next;
-		if (node->next == NULL) {
-			*tail = node->prev;
-			if (node->prev)
-				node->prev->next = NULL;
-		} else
-			node->next->prev = node->prev;
-		kfree(node);
-		if (which_list == FLASHCACHE_WHITELIST)
-			dmc->num_whitelist_pids--;
-		else
-			dmc->num_blacklist_pids--;
-		dmc->expiry++;
+		flashcache_unlink_pid_locked(dmc, node, which_list);
+		FLASHCACHE_STATS_INC(dmc, expiry);
 	}
 }
 
+/*
+ * Expire pids off the lists. Runs from a timer while any pids are listed,
+ * so the IO path never does this.
+ */
+static void
+flashcache_pid_expiry_all(unsigned long data)
+{
+	struct cache_c *dmc = (struct cache_c *)data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	if (sysctl_pid_do_expiry) {
+		flashcache_pid_expiry_list_locked(dmc, FLASHCACHE_WHITELIST);
+		flashcache_pid_expiry_list_locked(dmc, FLASHCACHE_BLACKLIST);
+	}
+	if (dmc->num_whitelist_pids > 0 || dmc->num_blacklist_pids > 0)
+		mod_timer(&dmc->pid_expiry_timer, 
+			  jiffies + (sysctl_pid_expiry_check + 1) * HZ);
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+}
+
+void
+flashcache_pid_lists_init(struct cache_c *dmc)
+{
+	int i;
+
+	dmc->whitelist_head = NULL;
+	dmc->whitelist_tail = NULL;
+	dmc->blacklist_head = NULL;
+	dmc->blacklist_tail = NULL;
+	dmc->num_whitelist_pids = 0;
+	dmc->num_blacklist_pids = 0;
+	for (i = 0 ; i < FLASHCACHE_PID_HASH_SIZE ; i++) {
+		INIT_HLIST_HEAD(&dmc->pid_hash[FLASHCACHE_WHITELIST][i]);
+		INIT_HLIST_HEAD(&dmc->pid_hash[FLASHCACHE_BLACKLIST][i]);
+	}
+	setup_timer(&dmc->pid_expiry_timer, flashcache_pid_expiry_all, 
+		    (unsigned long)dmc);
+}
+
 void
-flashcache_pid_expiry_all_locked(struct cache_c *dmc)
+flashcache_pid_lists_destroy(struct cache_c *dmc)
 {
-	if (likely(time_before(jiffies, dmc->pid_expire_check)))
-		return;
-	flashcache_pid_expiry_list_locked(dmc, FLASHCACHE_WHITELIST);
-	flashcache_pid_expiry_list_locked(dmc, FLASHCACHE_BLACKLIST);
-	dmc->pid_expire_check = jiffies + (sysctl_pid_expiry_check + 1) * HZ;
+	del_timer_sync(&dmc->pid_expiry_timer);
+	flashcache_del_all_pids(dmc, FLASHCACHE_WHITELIST, 1);
+	flashcache_del_all_pids(dmc, FLASHCACHE_BLACKLIST, 1);
+	VERIFY(dmc->num_whitelist_pids == 0);
+	VERIFY(dmc->num_blacklist_pids == 0);
 }
 
 /*
@@ -312,49 +375,90 @@ flashcache_uncacheable(struct cache_c *dmc)
 {
 	int dontcache;
 	
+	rcu_read_lock();
 	if (sysctl_cache_all) {
 		/* If the tid has been blacklisted, we don't cache at all.
 		   This overrides everything else */
-		dontcache = flashcache_find_pid_locked(dmc, current->pid, 
-						       FLASHCACHE_BLACKLIST);
+		dontcache = flashcache_find_pid(dmc, current->pid, 
+						FLASHCACHE_BLACKLIST);
 		if (dontcache)
 			goto out;
 		/* Is the tgid in the blacklist ? */
-		dontcache = flashcache_find_pid_locked(dmc, current->tgid, 
-						       FLASHCACHE_BLACKLIST);
+		dontcache = flashcache_find_pid(dmc, current->tgid, 
+						FLASHCACHE_BLACKLIST);
 		/* 
 		 * If we found the tgid in the blacklist, is there a whitelist
 		 * exception entered for this thread ?
 		 */
 		if (dontcache) {
-			if (flashcache_find_pid_locked(dmc, current->pid, 
-						       FLASHCACHE_WHITELIST))
+			if (flashcache_find_pid(dmc, current->pid, 
+						FLASHCACHE_WHITELIST))
 				dontcache = 0;
 		}
 	} else { /* cache nothing */
 		/* If the tid has been whitelisted, we cache 
 		   This overrides everything else */
-		dontcache = !flashcache_find_pid_locked(dmc, current->pid, 
-							FLASHCACHE_WHITELIST);
+		dontcache = !flashcache_find_pid(dmc, current->pid, 
+						 FLASHCACHE_WHITELIST);
 		if (!dontcache)
 			goto out;
 		/* Is the tgid in the whitelist ? */
-		dontcache = !flashcache_find_pid_locked(dmc, current->tgid, 
-							FLASHCACHE_WHITELIST);
+		dontcache = !flashcache_find_pid(dmc, current->tgid, 
+						 FLASHCACHE_WHITELIST);
 		/* 
 		 * If we found the tgid in the whitelist, is there a black list 
 		 * exception entered for this thread ?
 		 */
 		if (!dontcache) {
-			if (flashcache_find_pid_locked(dmc, current->pid, 
-						       FLASHCACHE_BLACKLIST))
+			if (flashcache_find_pid(dmc, current->pid, 
+						FLASHCACHE_BLACKLIST))
 				dontcache = 1;
 		}
 	}
 out:
+	rcu_read_unlock();
 	return dontcache;
 }
 
+static int
+flashcache_pid_batch_ioctl(struct cache_c *dmc, unsigned int cmd, 
+			   unsigned long arg)
+{
+	struct flashcache_pid_batch batch;
+	pid_t *pids;
+	int r = 0;
+
+	if (copy_from_user(&batch, (struct flashcache_pid_batch *)arg, 
+			   sizeof(batch)))
+		return -EFAULT;
+	if (batch.nr_pids == 0 || batch.nr_pids > FLASHCACHE_PID_BATCH_MAX)
+		return -EINVAL;
+	pids = kmalloc(batch.nr_pids * sizeof(pid_t), GFP_KERNEL);
+	if (pids == NULL)
+		return -ENOMEM;
+	if (copy_from_user(pids, (pid_t *)(unsigned long)batch.pids, 
+			   batch.nr_pids * sizeof(pid_t))) {
+		kfree(pids);
+		return -EFAULT;
+	}
+	switch (cmd) {
+	case FLASHCACHEADDBLACKLISTBATCH:
+		r = flashcache_add_pids(dmc, pids, batch.nr_pids, FLASHCACHE_BLACKLIST);
+		break;
+	case FLASHCACHEDELBLACKLISTBATCH:
+		flashcache_del_pids(dmc, pids, batch.nr_pids, FLASHCACHE_BLACKLIST);
+		break;
+	case FLASHCACHEADDWHITELISTBATCH:
+		r = flashcache_add_pids(dmc, pids, batch.nr_pids, FLASHCACHE_WHITELIST);
+		break;
+	case FLASHCACHEDELWHITELISTBATCH:
+		flashcache_del_pids(dmc, pids, batch.nr_pids, FLASHCACHE_WHITELIST);
+		break;
+	}
+	kfree(pids);
+	return r;
+}
+
 /*
  * Add/del pids whose IOs should be non-cacheable.
  * We limit this number to 100 (arbitrary and sysctl'able).
@@ -384,12 +488,11 @@ flashcache_ioctl(struct dm_target *ti, unsigned int cmd, unsigned long arg)
 	case FLASHCACHEADDBLACKLIST:
 		if (copy_from_user(&pid, (pid_t *)arg, sizeof(pid_t)))
 			return -EFAULT;
-		flashcache_add_pid(dmc, pid, FLASHCACHE_BLACKLIST);
-		return 0;
+		return flashcache_add_pids(dmc, &pid, 1, FLASHCACHE_BLACKLIST);
 	case FLASHCACHEDELBLACKLIST:
 		if (copy_from_user(&pid, (pid_t *)arg, sizeof(pid_t)))
 			return -EFAULT;
-		flashcache_del_pid(dmc, pid, FLASHCACHE_BLACKLIST);
+		flashcache_del_pids(dmc, &pid, 1, FLASHCACHE_BLACKLIST);
 		return 0;
 	case FLASHCACHEDELALLBLACKLIST:
 		flashcache_del_all_pids(dmc, FLASHCACHE_BLACKLIST, 0);
@@ -397,16 +500,20 @@ flashcache_ioctl(struct dm_target *ti, unsigned int cmd, unsigned long arg)
 	case FLASHCACHEADDWHITELIST:
 		if (copy_from_user(&pid, (pid_t *)arg, sizeof(pid_t)))
 			return -EFAULT;
-		flashcache_add_pid(dmc, pid, FLASHCACHE_WHITELIST);
-		return 0;
+		return flashcache_add_pids(dmc, &pid, 1, FLASHCACHE_WHITELIST);
 	case FLASHCACHEDELWHITELIST:
 		if (copy_from_user(&pid, (pid_t *)arg, sizeof(pid_t)))
 			return -EFAULT;
-		flashcache_del_pid(dmc, pid, FLASHCACHE_WHITELIST);
+		flashcache_del_pids(dmc, &pid, 1, FLASHCACHE_WHITELIST);
 		return 0;
 	case FLASHCACHEDELALLWHITELIST:
 		flashcache_del_all_pids(dmc, FLASHCACHE_WHITELIST, 0);
 		return 0;
+	case FLASHCACHEADDBLACKLISTBATCH:
+	case FLASHCACHEDELBLACKLISTBATCH:
+	case FLASHCACHEADDWHITELISTBATCH:
+	case FLASHCACHEDELWHITELISTBATCH:
+		return flashcache_pid_batch_ioctl(dmc, cmd, arg);
 	default:
 		fake_file.f_mode = dmc->disk_dev->mode;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
@@ -36,6 +36,22 @@ enum {
 	FLASHCACHEADDWHITELIST_CMD,
 	FLASHCACHEDELWHITELIST_CMD,
 	FLASHCACHEDELWHITELISTALL_CMD,
+	FLASHCACHEADDBLACKLISTBATCH_CMD,
+	FLASHCACHEDELBLACKLISTBATCH_CMD,
+	FLASHCACHEADDWHITELISTBATCH_CMD,
+	FLASHCACHEDELWHITELISTBATCH_CMD,
+};
+
+/* 
+ * Add/del up to FLASHCACHE_PID_BATCH_MAX pids to/from a list in one call.
+ * pids is a user pointer to an array of nr_pids pid_t's.
+ */
+#define FLASHCACHE_PID_BATCH_MAX	4096
+
+struct flashcache_pid_batch {
+	u_int32_t	nr_pids;
+	u_int32_t	pad;
+	u_int64_t	pids;
 };
 
 #define FLASHCACHEADDNCPID	_IOW(FLASHCACHE_IOCTL, FLASHCACHEADDNCPID_CMD, pid_t)
@@ -50,6 +66,11 @@ enum {
 #define FLASHCACHEDELWHITELIST		_IOW(FLASHCACHE_IOCTL, FLASHCACHEDELWHITELIST_CMD, pid_t)
 #define FLASHCACHEDELALLWHITELIST	_IOW(FLASHCACHE_IOCTL, FLASHCACHEDELWHITELISTALL_CMD, pid_t)
 
+#define FLASHCACHEADDBLACKLISTBATCH	_IOW(FLASHCACHE_IOCTL, FLASHCACHEADDBLACKLISTBATCH_CMD, struct flashcache_pid_batch)
+#define FLASHCACHEDELBLACKLISTBATCH	_IOW(FLASHCACHE_IOCTL, FLASHCACHEDELBLACKLISTBATCH_CMD, struct flashcache_pid_batch)
+#define FLASHCACHEADDWHITELISTBATCH	_IOW(FLASHCACHE_IOCTL, FLASHCACHEADDWHITELISTBATCH_CMD, struct flashcache_pid_batch)
+#define FLASHCACHEDELWHITELISTBATCH	_IOW(FLASHCACHE_IOCTL, FLASHCACHEDELWHITELISTBATCH_CMD, struct flashcache_pid_batch)
+
 #ifdef __KERNEL__
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,27)
 int flashcache_ioctl(struct dm_target *ti, struct inode *inode,
@@ -59,7 +80,8 @@ int flashcache_ioctl(struct dm_target *ti, struct inode *inode,
 int flashcache_ioctl(struct dm_target *ti, unsigned int cmd,
  		     unsigned long arg);
 #endif
-void flashcache_pid_expiry_all_locked(struct cache_c *dmc);
+void flashcache_pid_lists_init(struct cache_c *dmc);
+void flashcache_pid_lists_destroy(struct cache_c *dmc);
 int flashcache_uncacheable(struct cache_c *dmc);
 void flashcache_del_all_pids(struct cache_c *dmc, int which_list, int force);
 #endif /* __KERNEL__ */
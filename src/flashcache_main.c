@@ -38,6 +38,7 @@
 #include <linux/sysctl.h>
 #include <linux/version.h>
 #include <linux/pid.h>
+#include <linux/crc32c.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,21)
@@ -68,10 +69,8 @@
  * 1) sysctls : Create per-cache device sysctls instead of global sysctls.
  * 2) Management of non cache pids : Needs improvement. Remove registration
  * on process exits (with  a pseudo filesstem'ish approach perhaps) ?
- * 3) Breaking up the cache spinlock : Right now contention on the spinlock
- * is not a problem. Might need change in future.
- * 4) Use the standard linked list manipulation macros instead rolling our own.
- * 5) Fix a security hole : A malicious process with 'ro' access to a file can 
+ * 3) Use the standard linked list manipulation macros instead rolling our own.
+ * 4) Fix a security hole : A malicious process with 'ro' access to a file can 
  * potentially corrupt file data. This can be fixed by copying the data on a
  * cache read miss.
  */
@@ -79,23 +78,61 @@
 #define FLASHCACHE_SW_VERSION "flashcache-1.0"
 char *flashcache_sw_version = FLASHCACHE_SW_VERSION;
 
+/* 
+ * A bio, with the cached blocks it overlaps, can span the sets of up to 3
+ * granules. These are the lock stripes of those sets, sorted and distinct.
+ */
+#define FLASHCACHE_BIO_STRIPES		3
+
+struct flashcache_bio_stripes {
+	int	nr;
+	int	stripe[FLASHCACHE_BIO_STRIPES];
+};
+
 static void flashcache_read_miss(struct cache_c *dmc, struct bio* bio,
 				 int index);
 static void flashcache_write(struct cache_c *dmc, struct bio* bio);
-static int flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio);
+static int flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio,
+				   struct flashcache_bio_stripes *stripes);
+static void flashcache_bio_stripes(struct cache_c *dmc, struct bio *bio,
+				   struct flashcache_bio_stripes *stripes);
+static void flashcache_stripes_lock(struct cache_c *dmc, 
+				    struct flashcache_bio_stripes *stripes);
+static void flashcache_stripes_unlock(struct cache_c *dmc, 
+				      struct flashcache_bio_stripes *stripes);
 static void flashcache_dirty_writeback(struct cache_c *dmc, int index);
 void flashcache_sync_blocks(struct cache_c *dmc);
 static void flashcache_start_uncached_io(struct cache_c *dmc, struct bio *bio);
 static void flashcache_enqueue_readfill(struct cache_c *dmc, 
 					struct kcached_job *job);
+static void flashcache_journal_write(struct cache_c *dmc, 
+				     struct flashcache_journal_record *rec);
+static void flashcache_read_miss_io(struct kcached_job *job);
+static void flashcache_write_miss_io(struct kcached_job *job);
+static void flashcache_md_write_queue(struct kcached_job *job);
+static int flashcache_md_summary_hold(struct kcached_job *job);
+static void flashcache_md_summary_clean(struct cache_c *dmc, int index);
 
-extern struct work_struct _kcached_wq;
-extern u_int64_t size_hist[];
 
 extern int sysctl_flashcache_error_inject;
 extern int sysctl_flashcache_stop_sync;
 extern int sysctl_flashcache_reclaim_policy;
-extern int sysctl_pid_do_expiry;
+extern int sysctl_cache_all;
+extern int sysctl_flashcache_md_commit_usecs;
+extern int sysctl_flashcache_md_commit_max;
+extern int sysctl_flashcache_warm_flush_secs;
+
+/*
+ * Warm caches. A slot that may say VALID on flash (md_valid_map) is not 
+ * reused for another block, nor invalidated ahead of a disk write to its
+ * block, until an md write has put INVALID in its place. Otherwise a crash
+ * could leave the slot trusted for data that is no longer there.
+ */
+static inline int
+flashcache_md_fence_wanted(struct cache_c *dmc, int index)
+{
+	return dmc->warm && test_bit(index, dmc->md_valid_map);
+}
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
 int dm_io_async_bvec(unsigned int num_regions, 
@@ -143,13 +180,13 @@ flashcache_io_callback(unsigned long error, void *context)
 	case READDISK:
 		DPRINTK("flashcache_io_callback: READDISK  %d",
 			index);
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 		if (unlikely(sysctl_flashcache_error_inject & READDISK_ERROR)) {
 			job->error = error = -EIO;
 			sysctl_flashcache_error_inject &= ~READDISK_ERROR;
 		}
 		VERIFY(cacheblk->cache_state & DISKREADINPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		if (likely(error == 0)) {
 			/* Kick off the write to the cache */
 			job->action = READFILL;
@@ -163,13 +200,13 @@ flashcache_io_callback(unsigned long error, void *context)
 	case READCACHE:
 		DPRINTK("flashcache_io_callback: READCACHE %d",
 			index);
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 		if (unlikely(sysctl_flashcache_error_inject & READCACHE_ERROR)) {
 			job->error = error = -EIO;
 			sysctl_flashcache_error_inject &= ~READCACHE_ERROR;
 		}
 		VERIFY(cacheblk->cache_state & CACHEREADINPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		if (unlikely(error))
 			dmc->ssd_read_errors++;
 #ifdef FLASHCACHE_DO_CHECKSUMS
@@ -186,7 +223,7 @@ flashcache_io_callback(unsigned long error, void *context)
 	case READFILL:
 		DPRINTK("flashcache_io_callback: READFILL %d",
 			index);
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 		if (unlikely(sysctl_flashcache_error_inject & READFILL_ERROR)) {
 			job->error = error = -EIO;
 			sysctl_flashcache_error_inject &= ~READFILL_ERROR;
@@ -194,13 +231,13 @@ flashcache_io_callback(unsigned long error, void *context)
 		if (unlikely(error))
 			dmc->ssd_write_errors++;
 		VERIFY(cacheblk->cache_state & DISKREADINPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		flashcache_bio_endio(bio, error);
 		break;
 	case WRITECACHE:
 		DPRINTK("flashcache_io_callback: WRITECACHE %d",
 			index);
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 		if (unlikely(sysctl_flashcache_error_inject & WRITECACHE_ERROR)) {
 			job->error = error = -EIO;
 			sysctl_flashcache_error_inject &= ~WRITECACHE_ERROR;
@@ -208,8 +245,8 @@ flashcache_io_callback(unsigned long error, void *context)
 		VERIFY(cacheblk->cache_state & CACHEWRITEINPROG);
 		if (likely(error == 0)) {
 #ifdef FLASHCACHE_DO_CHECKSUMS
-			dmc->checksum_store++;
-			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+			FLASHCACHE_STATS_INC(dmc, checksum_store);
+			spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 			flashcache_store_checksum(job);
 			/* 
 			 * We need to update the metadata on a DIRTY->DIRTY as well 
@@ -218,7 +255,7 @@ flashcache_io_callback(unsigned long error, void *context)
 			flashcache_md_write(job);
 			return;
 #else
-			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+			spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 			/* Only do cache metadata update on a non-DIRTY->DIRTY transition */
 			if ((cacheblk->cache_state & DIRTY) == 0) {
 				flashcache_md_write(job);
@@ -227,7 +264,7 @@ flashcache_io_callback(unsigned long error, void *context)
 #endif
 		} else {
 			dmc->ssd_write_errors++;			
-			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+			spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		}
 		flashcache_bio_endio(bio, error);
 		break;
@@ -237,14 +274,16 @@ flashcache_io_callback(unsigned long error, void *context)
 	 * processed. We need to loop the pending requests back to a workqueue. We have the job,
 	 * add it to the pending req queue.
 	 */
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 	if (unlikely(error || cacheblk->nr_queued > 0)) {
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		push_pending(job);
-		schedule_work(&_kcached_wq);
 	} else {
 		cacheblk->cache_state &= ~BLOCK_IO_INPROG;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		/* The next flashcache_warm_flush() puts the readfill on flash */
+		if (job->action == READFILL && dmc->warm)
+			set_bit(INDEX_TO_MD_BLOCK(dmc, index), dmc->md_warm_map);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		flashcache_free_cache_job(job);
 		if (atomic_dec_and_test(&dmc->nr_jobs))
 			wake_up(&dmc->destroyq);
@@ -257,7 +296,7 @@ flashcache_free_pending_jobs(struct cache_c *dmc, struct cacheblock *cacheblk,
 {
 	struct pending_job *pending_job, *freelist = NULL;
 
-	VERIFY(spin_is_locked(&dmc->cache_spin_lock));
+	VERIFY(spin_is_locked(flashcache_index_lock(dmc, cacheblk - &dmc->cache[0])));
 	freelist = flashcache_deq_pending(dmc, cacheblk - &dmc->cache[0]);
 	while (freelist != NULL) {
 		pending_job = freelist;
@@ -270,6 +309,33 @@ flashcache_free_pending_jobs(struct cache_c *dmc, struct cacheblock *cacheblk,
 	VERIFY(cacheblk->nr_queued == 0);
 }
 
+/* 
+ * Write the slot of a clean block out INVALID. When that is done, the 
+ * block is invalidated and its pending IOs run (flashcache_md_fence_done).
+ * The caller has marked the block MDFENCEINPROG.
+ */
+static void
+flashcache_md_fence(struct cache_c *dmc, int index)
+{
+	struct kcached_job *job;
+	unsigned long flags;
+	struct cacheblock *cacheblk = &dmc->cache[index];
+
+	job = new_kcached_job(dmc, NULL, index);
+	if (unlikely(job == NULL)) {
+		DMERR("flashcache: Md fence failed ! Can't allocate memory, block %lu", 
+		      flashcache_get_dbn(dmc, index));
+		spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
+		flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
+		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
+		return;
+	}
+	job->action = MDFENCE;
+	atomic_inc(&dmc->nr_jobs);
+	flashcache_md_write(job);
+}
+
 /* 
  * Common error handling for everything.
  * 1) If the block isn't dirty, invalidate it.
@@ -285,18 +351,19 @@ flashcache_do_pending_error(struct kcached_job *job)
 
 	DMERR("flashcache_do_pending_error: error %d block %lu action %d", 
 	      -job->error, job->disk.sector, job->action);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(flashcache_index_lock(dmc, job->index), flags);
 	VERIFY(cacheblk->cache_state & VALID);
 	/* Invalidate block if possible */
 	if ((cacheblk->cache_state & DIRTY) == 0) {
-		dmc->cached_blocks--;
-		dmc->pending_inval++;
+		atomic_dec(&dmc->cached_blocks);
+		FLASHCACHE_STATS_INC(dmc, pending_inval);
+		flashcache_hash_remove(dmc, job->index);
 		cacheblk->cache_state &= ~VALID;
 		cacheblk->cache_state |= INVALID;
 	}
 	flashcache_free_pending_jobs(dmc, cacheblk, job->error);
 	cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	spin_unlock_irqrestore(flashcache_index_lock(dmc, job->index), flags);
 	flashcache_free_cache_job(job);
 	if (atomic_dec_and_test(&dmc->nr_jobs))
 		wake_up(&dmc->destroyq);
@@ -311,20 +378,30 @@ flashcache_do_pending_noerror(struct kcached_job *job)
 	struct pending_job *pending_job, *freelist;
 	int queued;
 	struct cacheblock *cacheblk = &dmc->cache[index];
+	struct flashcache_bio_stripes stripes;
 
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 	if (cacheblk->cache_state & DIRTY) {
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
 		cacheblk->cache_state |= DISKWRITEINPROG;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		flashcache_dirty_writeback(dmc, index);
 		goto out;
 	}
 	DPRINTK("flashcache_do_pending: Index %d %lx",
 		index, cacheblk->cache_state);
 	VERIFY(cacheblk->cache_state & VALID);
-	dmc->cached_blocks--;
-	dmc->pending_inval++;
+	if (flashcache_md_fence_wanted(dmc, index)) {
+		/* Pending IOs may write the disk, fence the slot first */
+		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
+		cacheblk->cache_state |= MDFENCEINPROG;
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
+		flashcache_md_fence(dmc, index);
+		goto out;
+	}
+	atomic_dec(&dmc->cached_blocks);
+	FLASHCACHE_STATS_INC(dmc, pending_inval);
+	flashcache_hash_remove(dmc, index);
 	cacheblk->cache_state &= ~VALID;
 	cacheblk->cache_state |= INVALID;
 	freelist = flashcache_deq_pending(dmc, cacheblk - &dmc->cache[0]);
@@ -334,11 +411,16 @@ flashcache_do_pending_noerror(struct kcached_job *job)
 		freelist = pending_job->next;
 		VERIFY(cacheblk->nr_queued > 0);
 		cacheblk->nr_queued--;
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		if (pending_job->action == INVALIDATE) {
 			DPRINTK("flashcache_do_pending: INVALIDATE  %llu",
 				next_job->bio->bi_sector);
 			VERIFY(pending_job->bio != NULL);
-			queued = flashcache_inval_blocks(dmc, pending_job->bio);
+			/* The bio can overlap blocks in other stripes too */
+			flashcache_bio_stripes(dmc, pending_job->bio, &stripes);
+			flashcache_stripes_lock(dmc, &stripes);
+			queued = flashcache_inval_blocks(dmc, pending_job->bio, &stripes);
+			flashcache_stripes_unlock(dmc, &stripes);
 			if (queued) {
 				if (unlikely(queued < 0)) {
 					/*
@@ -348,20 +430,20 @@ flashcache_do_pending_noerror(struct kcached_job *job)
 					flashcache_bio_endio(pending_job->bio, -EIO);
 				}
 				flashcache_free_pending_job(pending_job);
+				spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 				continue;
 			}
 		}
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
 		DPRINTK("flashcache_do_pending: Sending down IO %llu",
 			pending_job->bio->bi_sector);
 		/* Start uncached IO */
 		flashcache_start_uncached_io(dmc, pending_job->bio);
 		flashcache_free_pending_job(pending_job);
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 	}
 	VERIFY(cacheblk->nr_queued == 0);
 	cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 out:
 	flashcache_free_cache_job(job);
 	if (atomic_dec_and_test(&dmc->nr_jobs))
@@ -379,30 +461,120 @@ flashcache_do_pending(struct kcached_job *job)
 
 /*
  * Cache miss support. We read the data from disk, write it to the ssd.
- * To avoid doing 1 IO at a time to the ssd, when the IO is kicked off, 
- * we enqueue it to a "readfill" queue in the cache in cache sector order.
- * The worker thread can then issue all of these IOs and do 1 unplug to 
- * start them all.
+ * To avoid doing 1 IO at a time to the ssd, when the disk read completes,
+ * we stage the job on a per CPU "readfill" list. The worker takes all the
+ * staged jobs at once, sorts them in cache sector order, writes runs of
+ * adjacent blocks with one IO each and does 1 unplug to start them all.
  */
 static void
 flashcache_enqueue_readfill(struct cache_c *dmc, struct kcached_job *job)
 {
-	unsigned long flags;
-	struct kcached_job **j1, *next;
-	int do_schedule = 0;
-
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-	/* Insert job in sorted order of cache sector */
-	j1 = &dmc->readfill_queue;
-	while (*j1 != NULL && (*j1)->cache.sector < job->cache.sector)
-		j1 = &(*j1)->next;
-	next = *j1;
-	*j1 = job;
-	job->next = next;
-	do_schedule = (dmc->readfill_in_prog == 0);
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);	
-	if (do_schedule)
-		schedule_work(&dmc->readfill_wq);
+	push_readfill(job);
+}
+
+static struct kcached_job *
+flashcache_merge_readfills(struct kcached_job *a, struct kcached_job *b)
+{
+	struct kcached_job *head = NULL, **tailp = &head;
+
+	while (a != NULL && b != NULL) {
+		if (a->cache.sector <= b->cache.sector) {
+			*tailp = a;
+			a = a->next;
+		} else {
+			*tailp = b;
+			b = b->next;
+		}
+		tailp = &(*tailp)->next;
+	}
+	*tailp = (a != NULL) ? a : b;
+	return head;
+}
+
+/* Merge sort the readfill jobs (linked through job->next) by cache sector */
+static struct kcached_job *
+flashcache_sort_readfills(struct kcached_job *joblist)
+{
+	struct kcached_job *slow, *fast, *back;
+
+	if (joblist == NULL || joblist->next == NULL)
+		return joblist;
+	slow = joblist;
+	fast = joblist->next;
+	while (fast != NULL && fast->next != NULL) {
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	back = slow->next;
+	slow->next = NULL;
+	return flashcache_merge_readfills(flashcache_sort_readfills(joblist),
+					  flashcache_sort_readfills(back));
+}
+
+/* Completion of a write of a run of readfills, complete each block */
+static void
+flashcache_readfill_callback(unsigned long error, void *context)
+{
+	struct kcached_job *job = (struct kcached_job *)context;
+	struct kcached_job *next;
+
+	kfree(job->readfill_bvecs);
+	job->readfill_bvecs = NULL;
+	for ( ; job != NULL ; job = next) {
+		next = job->next;
+		flashcache_io_callback(error, job);
+	}
+}
+
+/* 
+ * Write out a run of readfills to adjacent cache blocks. A run of 1, or 
+ * a run we can't get memory to coalesce, goes out a block at a time.
+ */
+static void
+flashcache_readfill_run(struct cache_c *dmc, struct kcached_job *run, 
+			int nr_jobs)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+	struct io_region where;
+#else
+	struct dm_io_region where;
+#endif
+	struct kcached_job *job, *next;
+	struct bio_vec *bvecs = NULL;
+	struct bio *bio;
+	int nr_bvecs = 0, r;
+
+	if (nr_jobs > 1) {
+		for (job = run ; job != NULL ; job = job->next)
+			nr_bvecs += job->bio->bi_vcnt - job->bio->bi_idx;
+		bvecs = kmalloc(nr_bvecs * sizeof(struct bio_vec), GFP_NOIO);
+	}
+	if (bvecs == NULL) {
+		for (job = run ; job != NULL ; job = next) {
+			next = job->next;
+			bio = job->bio;
+			r = dm_io_async_bvec(1, &job->cache, WRITE, 
+					     bio->bi_io_vec + bio->bi_idx,
+					     flashcache_io_callback, job);
+			/* In our case, dm_io_async_bvec() must always return 0 */
+			VERIFY(r == 0);
+		}
+		return;
+	}
+	nr_bvecs = 0;
+	for (job = run ; job != NULL ; job = job->next) {
+		bio = job->bio;
+		memcpy(&bvecs[nr_bvecs], bio->bi_io_vec + bio->bi_idx,
+		       (bio->bi_vcnt - bio->bi_idx) * sizeof(struct bio_vec));
+		nr_bvecs += bio->bi_vcnt - bio->bi_idx;
+	}
+	FLASHCACHE_STATS_ADD(dmc, ssd_readfill_merges, nr_jobs - 1);
+	run->readfill_bvecs = bvecs;
+	where = run->cache;
+	where.count = nr_jobs * dmc->block_size;
+	r = dm_io_async_bvec(1, &where, WRITE, bvecs,
+			     flashcache_readfill_callback, run);
+	VERIFY(r == 0);
 }
 
 void 
@@ -412,45 +584,67 @@ flashcache_do_readfill(struct cache_c *dmc)
 flashcache_do_readfill(struct work_struct *work)
 #endif
 {
-	struct kcached_job *job, *joblist;
-	int r = 0;
-	struct bio *bio;
-	unsigned long flags;
+	struct kcached_job *job, *joblist, *next, *run, *last;
+	struct flashcache_job_queue *jq;
+	int cpu, nr_jobs, nr_run;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 	struct cache_c *dmc = container_of(work, struct cache_c, readfill_wq);
 #endif
 
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-	if (dmc->readfill_in_prog)
-		goto out;
-	dmc->readfill_in_prog = 1;
-	while (dmc->readfill_queue != NULL) {
-		joblist = dmc->readfill_queue;
-		dmc->readfill_queue = NULL;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-		for (job = joblist ; job != NULL ; job = job->next) {
-			VERIFY(job->action == READFILL);
-			/* Write to cache device */
+	if (test_and_set_bit(0, &dmc->readfill_in_prog))
+		return;
+	for (;;) {
+		/* Take the jobs staged on every CPU */
+		joblist = NULL;
+		nr_jobs = 0;
+		for_each_possible_cpu(cpu) {
+			jq = per_cpu_ptr(dmc->job_queues, cpu);
+			for (job = pop(&jq->readfill_jobs) ; job != NULL ; job = next) {
+				next = job->qnext;
+				job->next = joblist;
+				joblist = job;
+				nr_jobs++;
+			}
+		}
+		if (joblist == NULL) {
+			clear_bit(0, &dmc->readfill_in_prog);
+			smp_mb__after_clear_bit();
+			/* Recheck for jobs staged while we were clearing the flag */
+			if (!flashcache_readfills_staged(dmc) ||
+			    test_and_set_bit(0, &dmc->readfill_in_prog))
+				return;
+			continue;
+		}
+		if (nr_jobs > dmc->readfill_batch_max)
+			dmc->readfill_batch_max = nr_jobs;
+		joblist = flashcache_sort_readfills(joblist);
+		while (joblist != NULL) {
+			/* Cut off the run of jobs to adjacent cache blocks */
+			run = last = joblist;
+			nr_run = 1;
+			while (last->next != NULL && 
+			       nr_run < FLASHCACHE_READFILL_MAX_RUN &&
+			       last->next->cache.sector == last->cache.sector + dmc->block_size) {
+				last = last->next;
+				nr_run++;
+			}
+			joblist = last->next;
+			last->next = NULL;
+			for (job = run ; job != NULL ; job = job->next) {
+				VERIFY(job->action == READFILL);
+				/* Write to cache device */
 #ifdef FLASHCACHE_DO_CHECKSUMS
-			flashcache_store_checksum(job);
-			dmc->checksum_store++;
+				flashcache_store_checksum(job);
+				FLASHCACHE_STATS_INC(dmc, checksum_store);
 #endif
-			dmc->ssd_writes++;
-			dmc->ssd_readfills++;
-			bio = job->bio;
-			r = dm_io_async_bvec(1, &job->cache, WRITE, 
-					     bio->bi_io_vec + bio->bi_idx,
-					     flashcache_io_callback, job);
-			/* In our case, dm_io_async_bvec() must always return 0 */
-			VERIFY(r == 0);
+				FLASHCACHE_STATS_INC(dmc, ssd_writes);
+				FLASHCACHE_STATS_INC(dmc, ssd_readfills);
+			}
+			flashcache_readfill_run(dmc, run, nr_run);
 		}
-		dmc->ssd_readfill_unplugs++;
+		FLASHCACHE_STATS_INC(dmc, ssd_readfill_unplugs);
 		flashcache_unplug_device(dmc->cache_dev->bdev);
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
 	}
-	dmc->readfill_in_prog = 0;
-out:
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);	
 }
 
 /*
@@ -459,33 +653,62 @@ out:
 static unsigned long 
 hash_block(struct cache_c *dmc, sector_t dbn)
 {
-	unsigned long set_number, value;
+	unsigned long set_number;
 
-	value = (unsigned long)
-		(dbn >> (dmc->block_shift + dmc->consecutive_shift));
-	set_number = value % (dmc->size >> dmc->consecutive_shift);
-	DPRINTK("Hash: %llu(%lu)->%lu", dbn, value, set_number);
+	set_number = flashcache_hash_set(dmc->set_hash, dmc->set_shift,
+					 dmc->size >> dmc->consecutive_shift, dbn);
+	DPRINTK("Hash: %llu->%lu", dbn, set_number);
 	return set_number;
 }
 
+/*
+ * Find the lock stripes of every set holding blocks that a bio can hit or
+ * overlap, the same granules flashcache_inval_blocks() walks.
+ */
 static void
-find_valid_dbn(struct cache_c *dmc, sector_t dbn, 
-	       int start_index, int *index)
+flashcache_bio_stripes(struct cache_c *dmc, struct bio *bio, 
+		       struct flashcache_bio_stripes *stripes)
+{
+	sector_t granule, end_granule;
+	int stripe, i;
+
+	granule = flashcache_overlap_start(dmc, bio->bi_sector) >> dmc->set_shift;
+	end_granule = (bio->bi_sector + to_sector(bio->bi_size) - 1) >> dmc->set_shift;
+	stripes->nr = 0;
+	for ( ; granule <= end_granule ; granule++) {
+		stripe = flashcache_stripe(dmc, 
+			hash_block(dmc, granule << dmc->set_shift) * dmc->assoc);
+		for (i = 0 ; i < stripes->nr && stripes->stripe[i] < stripe ; i++)
+			;
+		if (i < stripes->nr && stripes->stripe[i] == stripe)
+			continue;
+		VERIFY(stripes->nr < FLASHCACHE_BIO_STRIPES);
+		memmove(&stripes->stripe[i + 1], &stripes->stripe[i], 
+			(stripes->nr - i) * sizeof(int));
+		stripes->stripe[i] = stripe;
+		stripes->nr++;
+	}
+}
+
+/* Stripes are always taken in ascending order, which keeps this deadlock free */
+static void
+flashcache_stripes_lock(struct cache_c *dmc, struct flashcache_bio_stripes *stripes)
 {
 	int i;
-	int end_index = start_index + dmc->assoc;
 
-	for (i = start_index ; i < end_index ; i++) {
-		if (dbn == dmc->cache[i].dbn &&
-		    (dmc->cache[i].cache_state & VALID)) {
-			*index = i;
-			if (sysctl_flashcache_reclaim_policy == FLASHCACHE_LRU &&
-			    ((dmc->cache[i].cache_state & BLOCK_IO_INPROG) == 0))
-				flashcache_reclaim_lru_movetail(dmc, i);
-			return;
-		}
-	}
-	*index = -1;
+	local_irq_disable();
+	for (i = 0 ; i < stripes->nr ; i++)
+		spin_lock_nested(&dmc->stripes[stripes->stripe[i]].lock, i);
+}
+
+static void
+flashcache_stripes_unlock(struct cache_c *dmc, struct flashcache_bio_stripes *stripes)
+{
+	int i;
+
+	for (i = stripes->nr - 1 ; i >= 0 ; i--)
+		spin_unlock(&dmc->stripes[stripes->stripe[i]].lock);
+	local_irq_enable();
 }
 
 static int
@@ -494,8 +717,14 @@ find_invalid_dbn(struct cache_c *dmc, int start_index)
 	int i;
 	int end_index = start_index + dmc->assoc;
 	
-	/* Find INVALID slot that we can reuse */
-	for (i = start_index ; i < end_index ; i++) {
+	/* 
+	 * Find INVALID slot that we can reuse. A block just invalidated by 
+	 * do_pending can still be draining its pending IOs with the lock 
+	 * dropped, skip it.
+	 */
+	for (i = find_next_bit(dmc->free_map, end_index, start_index) ;
+	     i < end_index ;
+	     i = find_next_bit(dmc->free_map, end_index, i + 1)) {
 		if (dmc->cache[i].cache_state == INVALID) {
 			if (sysctl_flashcache_reclaim_policy == FLASHCACHE_LRU)
 				flashcache_reclaim_lru_movetail(dmc, i);
@@ -552,30 +781,77 @@ find_reclaim_dbn(struct cache_c *dmc, int start_index, int *index)
 	}
 }
 
+/*
+ * A bio that is exactly one block and block aligned can only partially
+ * overlap cached blocks that are not block aligned. Those start less than
+ * a block before the bio, so live in the bio's set or, at a granule 
+ * boundary, in the previous granule's set. If neither set holds such a 
+ * block, the only possible overlap is a block cached at the bio's dbn.
+ */
+static int
+flashcache_aligned_only(struct cache_c *dmc, struct bio *bio, int set)
+{
+	sector_t dbn = bio->bi_sector;
+
+	if ((dbn & dmc->block_mask) || 
+	    to_sector(bio->bi_size) != dmc->block_size)
+		return 0;
+	if (dmc->cache_sets[set].nr_unaligned)
+		return 0;
+	if (dbn > 0 && ((dbn - 1) >> dmc->set_shift) != (dbn >> dmc->set_shift) &&
+	    dmc->cache_sets[hash_block(dmc, dbn - 1)].nr_unaligned)
+		return 0;
+	return 1;
+}
+
 /* 
  * dbn is the starting sector, io_size is the number of sectors.
+ * On a miss, *inval tells whether the IO may overlap cached blocks, which
+ * flashcache_inval_blocks() then has to deal with.
  */
 static int 
-flashcache_lookup(struct cache_c *dmc, struct bio *bio, int *index)
+flashcache_lookup(struct cache_c *dmc, struct bio *bio, int *index, 
+		  int *inval)
 {
 	sector_t dbn = bio->bi_sector;
-#if DMC_DEBUG
 	int io_size = to_sector(bio->bi_size);
-#endif
 	unsigned long set_number = hash_block(dmc, dbn);
 	int invalid, oldest_clean = -1;
-	int start_index;
+	int start_index, i, aligned_only;
 
 	start_index = dmc->assoc * set_number;
 	DPRINTK("Cache lookup : dbn %llu(%lu), set = %d",
 		dbn, io_size, set_number);
-	find_valid_dbn(dmc, dbn, start_index, index);
-	if (*index > 0) {
+	/* 
+	 * A single probe of the set's dbn hash finds the hit, and on a miss
+	 * any block that the IO overlaps, so the miss path need not scan
+	 * the set again to invalidate. In the common case of an aligned IO
+	 * and no unaligned blocks around, only the exact dbn need be probed.
+	 */
+	aligned_only = flashcache_aligned_only(dmc, bio, set_number);
+	if (aligned_only)
+		i = flashcache_hash_lookup(dmc, set_number, dbn);
+	else
+		i = flashcache_hash_overlap(dmc, set_number, dbn, dbn + io_size - 1);
+	if (i >= 0 && flashcache_get_dbn(dmc, i) == dbn) {
+		if (sysctl_flashcache_reclaim_policy == FLASHCACHE_LRU &&
+		    ((dmc->cache[i].cache_state & BLOCK_IO_INPROG) == 0))
+			flashcache_reclaim_lru_movetail(dmc, i);
+		*index = i;
 		DPRINTK("Cache lookup HIT: Block %llu(%lu): VALID index %d",
 			     dbn, io_size, *index);
 		/* We found the exact range of blocks we are looking for */
 		return VALID;
 	}
+	if (aligned_only) {
+		FLASHCACHE_STATS_INC(dmc, aligned_inval_skips);
+		*inval = 0;
+	} else {
+		/* An overlapping block might also live in the previous granule's set */
+		*inval = (i >= 0) || 
+			((flashcache_overlap_start(dmc, dbn) >> dmc->set_shift) !=
+			 ((dbn + io_size - 1) >> dmc->set_shift));
+	}
 	invalid = find_invalid_dbn(dmc, start_index);
 	if (invalid == -1) {
 		/* We didn't find an invalid entry, search for oldest valid entry */
@@ -602,7 +878,7 @@ flashcache_lookup(struct cache_c *dmc, struct bio *bio, int *index)
 	if (*index < (start_index + dmc->assoc))
 		return INVALID;
 	else {
-		dmc->noroom++;
+		FLASHCACHE_STATS_INC(dmc, noroom);
 		return -1;
 	}
 }
@@ -617,238 +893,900 @@ flashcache_md_write_callback(unsigned long error, void *context)
 
 	job->error = error;
 	push_md_complete(job);
-	schedule_work(&_kcached_wq);
 }
 
+/*
+ * Md sector buffers come from the cache's pool. The kcached workers, which
+ * also free the buffers as md writes complete, never wait for one 
+ * (GFP_ATOMIC). Off the reserve, the md write waits on the md workqueue
+ * (GFP_NOIO) instead, see flashcache_md_alloc_wait().
+ */
 static int
-flashcache_alloc_md_sector(struct kcached_job *job)
+flashcache_alloc_md_sector(struct kcached_job *job, gfp_t gfp_mask)
 {
-	struct page *page;
+	void *md_sector;
 	
-	if (likely((sysctl_flashcache_error_inject & MD_ALLOC_SECTOR_ERROR) == 0))
-		page = alloc_pages(GFP_NOIO, 0);
-	else {
-		sysctl_flashcache_error_inject &= ~MD_ALLOC_SECTOR_ERROR;
-		page = NULL;
-	}
-	job->md_io_bvec.bv_page = page;
-	if (unlikely(page == NULL)) {
-		job->dmc->memory_alloc_errors++;
+	md_sector = mempool_alloc(job->dmc->md_sector_pool, gfp_mask);
+	job->md_sector = (struct flash_cacheblock *)md_sector;
+	if (unlikely(md_sector == NULL))
 		return -ENOMEM;
-	}
-	job->md_io_bvec.bv_len = 512;
-	job->md_io_bvec.bv_offset = 0;
-	job->md_sector = (struct flash_cacheblock *)page_address(page);
+	job->md_io_bvec.bv_page = virt_to_page(md_sector);
+	job->md_io_bvec.bv_len = job->dmc->md_block_size * 512;
+	job->md_io_bvec.bv_offset = offset_in_page(md_sector);
 	return 0;
 }
 
 static void
 flashcache_free_md_sector(struct kcached_job *job)
 {
-	if (job->md_io_bvec.bv_page != NULL)
-		__free_page(job->md_io_bvec.bv_page);
+	if (job->md_sector != NULL)
+		mempool_free(job->md_sector, job->dmc->md_sector_pool);
 }
 
+/*
+ * Copy the in-core state of the blocks covered by slot table md block 
+ * "sector" out in on flash format. The caller holds the md block's stripe
+ * lock if the cache is live. A clean block whose data is still on its way
+ * to the ssd (or that is being fenced) goes out INVALID.
+ */
 void
-flashcache_md_write_kickoff(struct kcached_job *job)
+flashcache_md_fill_sector(struct cache_c *dmc, struct flash_cacheblock *md_sector,
+			  int sector)
+{
+	int slots = MD_SLOTS_PER_BLOCK(dmc->md_block_size);
+	int md_sector_ix = sector * slots;
+	int i;
+	u_int16_t state;
+
+	for (i = 0 ; 
+	     i < slots && md_sector_ix < dmc->size ; 
+	     i++, md_sector_ix++) {
+		md_sector[i].dbn = flashcache_get_dbn(dmc, md_sector_ix);
+#ifdef FLASHCACHE_DO_CHECKSUMS
+		md_sector[i].checksum = dmc->cache[md_sector_ix].checksum;
+#endif
+		state = dmc->cache[md_sector_ix].cache_state;
+		if (!(state & DIRTY) &&
+		    (state & (DISKREADINPROG | CACHEWRITEINPROG | MDFENCEINPROG)))
+			state = INVALID;
+		md_sector[i].cache_state = state & (VALID | INVALID | DIRTY);
+		if (dmc->warm && (state & VALID))
+			set_bit(md_sector_ix, dmc->md_valid_map);
+	}
+}
+
+/* Set the slot of the block an md update is for, in its md block */
+static void
+flashcache_md_set_slot(struct cache_c *dmc, struct flash_cacheblock *md_sector,
+		       struct kcached_job *job)
+{
+	struct flash_cacheblock *slot = 
+		&md_sector[INDEX_TO_MD_BLOCK_OFFSET(dmc, job->index)];
+
+	switch (job->action) {
+	case MDFENCE:
+		slot->cache_state = INVALID;
+		return;
+	case MDFLUSH:
+		/* The md block goes out as it is in-core */
+		return;
+	case WRITECACHE:
+		/* DIRTY the cache block */
+		slot->cache_state = (VALID | DIRTY);
+		break;
+	default: /* WRITEDISK* */
+		/* un-DIRTY the cache block */
+		slot->cache_state = VALID;
+		break;
+	}
+	if (dmc->warm)
+		set_bit(job->index, dmc->md_valid_map);
+}
+
+/*
+ * Group commit of md sector writes. With md_commit_usecs set, a sector that
+ * is ready to go out waits that long (or until md_commit_max sectors are 
+ * staged) for others to join it. Runs of adjacent sectors then go out as 
+ * one write, and the jobs of every sector complete when the write lands.
+ */
+static int
+flashcache_md_commit_max(void)
+{
+	if (sysctl_flashcache_md_commit_max < 1)
+		return 1;
+	if (sysctl_flashcache_md_commit_max > FLASHCACHE_MD_COMMIT_MAX)
+		return FLASHCACHE_MD_COMMIT_MAX;
+	return sysctl_flashcache_md_commit_max;
+}
+
+static void
+flashcache_md_commit_callback(unsigned long error, void *context)
+{
+	struct kcached_job *job = (struct kcached_job *)context;
+	struct kcached_job *next;
+
+	kfree(job->md_bvecs);
+	job->md_bvecs = NULL;
+	for ( ; job != NULL ; job = next) {
+		next = job->next;
+		flashcache_md_write_callback(error, job);
+	}
+}
+
+/* 
+ * Write out a run of adjacent md sectors. A run we can't get memory to
+ * coalesce goes out a sector at a time.
+ */
+static void
+flashcache_md_commit_run(struct cache_c *dmc, struct kcached_job *run, int nr)
 {
-	struct cache_c *dmc = job->dmc;	
-	struct flash_cacheblock *md_sector;
-	int md_sector_ix;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 	struct io_region where;
 #else
 	struct dm_io_region where;
 #endif
+	struct kcached_job *job, *next;
+	struct bio_vec *bvecs = NULL;
 	int i;
-	struct cache_md_sector_head *md_sector_head;
-	struct kcached_job *orig_job = job;
+
+	where.bdev = dmc->cache_dev->bdev;
+	if (nr > 1)
+		bvecs = kmalloc(nr * sizeof(struct bio_vec), GFP_NOIO);
+	if (bvecs == NULL) {
+		for (job = run ; job != NULL ; job = next) {
+			next = job->next;
+			where.sector = MD_BLOCK_TO_SECTOR(dmc, INDEX_TO_MD_BLOCK(dmc, job->index));
+			where.count = dmc->md_block_size;
+			FLASHCACHE_STATS_INC(dmc, ssd_writes);
+			FLASHCACHE_STATS_INC(dmc, md_ssd_writes);
+			FLASHCACHE_STATS_INC(dmc, md_write_size[0]);
+			dm_io_async_bvec(1, &where, WRITE, &job->md_io_bvec,
+					 flashcache_md_write_callback, job);
+		}
+	} else {
+		for (i = 0, job = run ; job != NULL ; job = job->next)
+			bvecs[i++] = job->md_io_bvec;
+		run->md_bvecs = bvecs;
+		where.sector = MD_BLOCK_TO_SECTOR(dmc, INDEX_TO_MD_BLOCK(dmc, run->index));
+		where.count = nr * dmc->md_block_size;
+		FLASHCACHE_STATS_INC(dmc, ssd_writes);
+		FLASHCACHE_STATS_INC(dmc, md_ssd_writes);
+		FLASHCACHE_STATS_INC(dmc, md_write_size[fls(nr) - 1]);
+		dm_io_async_bvec(1, &where, WRITE, bvecs,
+				 flashcache_md_commit_callback, run);
+	}
+	flashcache_unplug_device(dmc->cache_dev->bdev);
+}
+
+/* Write out staged md sectors, in sector order, a run of adjacent ones at a time */
+static void
+flashcache_md_commit_jobs(struct cache_c *dmc, struct kcached_job *jobs)
+{
+	struct kcached_job *sorted = NULL, *job, *last, **nodepp;
+	int nr;
+
+	/* There are no more than md_commit_max of them */
+	while ((job = jobs) != NULL) {
+		jobs = job->next;
+		for (nodepp = &sorted ; 
+		     *nodepp != NULL && (*nodepp)->index < job->index ; 
+		     nodepp = &((*nodepp)->next))
+			;
+		job->next = *nodepp;
+		*nodepp = job;
+	}
+	while (sorted != NULL) {
+		job = last = sorted;
+		for (nr = 1 ; 
+		     last->next != NULL && 
+			     INDEX_TO_MD_BLOCK(dmc, last->next->index) == 
+			     INDEX_TO_MD_BLOCK(dmc, last->index) + 1 ;
+		     nr++)
+			last = last->next;
+		sorted = last->next;
+		last->next = NULL;
+		flashcache_md_commit_run(dmc, job, nr);
+	}
+}
+
+static void
+flashcache_md_commit(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	struct kcached_job *jobs = NULL;
+	int window = sysctl_flashcache_md_commit_usecs;
 	unsigned long flags;
+	int first;
 
-	if (flashcache_alloc_md_sector(job)) {
-		DMERR("flashcache: %d: Cache metadata write failed, cannot alloc page ! block %lu", 
-		      job->action, job->disk.sector);
-		flashcache_md_write_callback(-EIO, job);
+	job->next = NULL;
+	if (window <= 0) {
+		flashcache_md_commit_run(dmc, job, 1);
 		return;
 	}
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(&dmc->md_commit_lock, flags);
+	job->next = dmc->md_commit_jobs;
+	dmc->md_commit_jobs = job;
+	first = (dmc->md_commit_nr++ == 0);
+	if (dmc->md_commit_nr >= flashcache_md_commit_max()) {
+		jobs = dmc->md_commit_jobs;
+		dmc->md_commit_jobs = NULL;
+		dmc->md_commit_nr = 0;
+	}
+	spin_unlock_irqrestore(&dmc->md_commit_lock, flags);
+	if (jobs != NULL)
+		flashcache_md_commit_jobs(dmc, jobs);
+	else if (first)
+		queue_delayed_work(dmc->kcached_wq, &dmc->md_commit_work, 
+				   usecs_to_jiffies(window));
+}
+
+/* The group commit window is up */
+void 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+flashcache_md_commit_flush(struct cache_c *dmc)
+#else
+flashcache_md_commit_flush(struct work_struct *work)
+#endif
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+	struct cache_c *dmc = container_of(work, struct cache_c, md_commit_work.work);
+#endif
+	struct kcached_job *jobs;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dmc->md_commit_lock, flags);
+	jobs = dmc->md_commit_jobs;
+	dmc->md_commit_jobs = NULL;
+	dmc->md_commit_nr = 0;
+	spin_unlock_irqrestore(&dmc->md_commit_lock, flags);
+	if (jobs != NULL)
+		flashcache_md_commit_jobs(dmc, jobs);
+}
+
+/* Copy out the md block of a job with a sector buffer, and write it */
+static void
+flashcache_md_write_start(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;	
+	struct flash_cacheblock *md_sector;
+	struct cache_md_sector_head *md_sector_head;
+	struct kcached_job *orig_job = job;
+	unsigned long flags;
+
+	spin_lock_irqsave(flashcache_index_lock(dmc, orig_job->index), flags);
 	/*
 	 * Transfer whatever is on the pending queue to the md_io_inprog queue.
 	 */
-	md_sector_head = &dmc->md_sectors_buf[INDEX_TO_MD_SECTOR(job->index)];
+	md_sector_head = &dmc->md_sectors_buf[INDEX_TO_MD_BLOCK(dmc, job->index)];
 	md_sector_head->md_io_inprog = md_sector_head->queued_updates;
 	md_sector_head->queued_updates = NULL;
 	md_sector = job->md_sector;
-	md_sector_ix = INDEX_TO_MD_SECTOR(job->index) * MD_BLOCKS_PER_SECTOR;
 	/* First copy out the entire sector */
-	for (i = 0 ; 
-	     i < MD_BLOCKS_PER_SECTOR && md_sector_ix < dmc->size ; 
-	     i++, md_sector_ix++) {
-		md_sector[i].dbn = dmc->cache[md_sector_ix].dbn;
-#ifdef FLASHCACHE_DO_CHECKSUMS
-		md_sector[i].checksum = dmc->cache[md_sector_ix].checksum;
+	flashcache_md_fill_sector(dmc, md_sector, INDEX_TO_MD_BLOCK(dmc, job->index));
+	/* Then set the "current" index, and those of the updates batched with it */
+	flashcache_md_set_slot(dmc, md_sector, job);
+	for (job = md_sector_head->md_io_inprog ; 
+	     job != NULL ;
+	     job = job->next) {
+		FLASHCACHE_STATS_INC(dmc, md_write_batch);
+		flashcache_md_set_slot(dmc, md_sector, job);
+	}
+	spin_unlock_irqrestore(flashcache_index_lock(dmc, orig_job->index), flags);
+	flashcache_md_commit(orig_job);
+}
+
+void
+flashcache_md_write_kickoff(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;	
+	unsigned long flags;
+
+	if (dmc->journal) {
+		/* A journal record punted from interrupt context */
+		flashcache_journal_write(dmc, &dmc->journal->rec[dmc->journal->filling ^ 1]);
+		return;
+	}
+	if (unlikely(sysctl_flashcache_error_inject & MD_ALLOC_SECTOR_ERROR)) {
+		sysctl_flashcache_error_inject &= ~MD_ALLOC_SECTOR_ERROR;
+		dmc->memory_alloc_errors++;
+		DMERR("flashcache: %d: Cache metadata write failed, cannot alloc page ! block %lu", 
+		      job->action, job->disk.sector);
+		flashcache_md_write_callback(-EIO, job);
+		return;
+	}
+	if (likely(flashcache_alloc_md_sector(job, GFP_ATOMIC) == 0)) {
+		flashcache_md_write_start(job);
+		return;
+	}
+	/* Out of reserve buffers, wait for one where sleeping is safe */
+	FLASHCACHE_STATS_INC(dmc, md_alloc_waits);
+	spin_lock_irqsave(&dmc->md_alloc_lock, flags);
+	job->next = dmc->md_alloc_jobs;
+	dmc->md_alloc_jobs = job;
+	spin_unlock_irqrestore(&dmc->md_alloc_lock, flags);
+	queue_work(dmc->md_wq, &dmc->md_alloc_work);
+}
+
+/* 
+ * Md writes that found the pool empty. Buffers go back to it as md writes
+ * complete on the kcached workers, so wait for them here.
+ */
+void 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+flashcache_md_alloc_wait(struct cache_c *dmc)
+#else
+flashcache_md_alloc_wait(struct work_struct *work)
+#endif
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+	struct cache_c *dmc = container_of(work, struct cache_c, md_alloc_work);
 #endif
-		md_sector[i].cache_state = 
-			dmc->cache[md_sector_ix].cache_state & (VALID | INVALID | DIRTY);
+	struct kcached_job *job, *next;
+	unsigned long flags;
+
+	for (;;) {
+		spin_lock_irqsave(&dmc->md_alloc_lock, flags);
+		job = dmc->md_alloc_jobs;
+		dmc->md_alloc_jobs = NULL;
+		spin_unlock_irqrestore(&dmc->md_alloc_lock, flags);
+		if (job == NULL)
+			break;
+		for ( ; job != NULL ; job = next) {
+			next = job->next;
+			job->next = NULL;
+			(void)flashcache_alloc_md_sector(job, GFP_NOIO);
+			flashcache_md_write_start(job);
+		}
 	}
-	/* Then set/clear the DIRTY bit for the "current" index */
-	if (job->action == WRITECACHE) {
-		/* DIRTY the cache block */
-		md_sector[INDEX_TO_MD_SECTOR_OFFSET(job->index)].cache_state = 
-			(VALID | DIRTY);
-	} else { /* job->action == WRITEDISK* */
-		/* un-DIRTY the cache block */
-		md_sector[INDEX_TO_MD_SECTOR_OFFSET(job->index)].cache_state = VALID;
+}
+
+/*
+ * The slot of a fenced block says INVALID on flash (or the write failed).
+ * Invalidations waiting on the fence go through do_pending, misses that
+ * claimed the block and write hits on it go on to their IO.
+ */
+static void
+flashcache_md_fence_done(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	int index = job->index;
+	struct cacheblock *cacheblk = &dmc->cache[index];
+	unsigned long flags;
+	u_int16_t state;
+
+	if (unlikely(job->error)) {
+		DMERR("flashcache: Cache metadata fence failed ! error %d block %lu", 
+		      -job->error, flashcache_get_dbn(dmc, index));
+		dmc->ssd_write_errors++;
+	} else {
+		FLASHCACHE_STATS_INC(dmc, md_write_fence);
+		clear_bit(index, dmc->md_valid_map);
 	}
+	spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
+	state = cacheblk->cache_state;
+	spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
+	if (state & MDFENCEINPROG)
+		flashcache_do_pending(job);
+	else if (unlikely(job->error)) {
+		/* Give up the block the miss (or hit) claimed */
+		flashcache_bio_endio(job->bio, job->error);
+		flashcache_do_pending(job);
+	} else if (state & DISKREADINPROG)
+		flashcache_read_miss_io(job);
+	else {
+		VERIFY(state & CACHEWRITEINPROG);
+		flashcache_write_miss_io(job);
+	}
+}
 
-	for (job = md_sector_head->md_io_inprog ; 
-	     job != NULL ;
-	     job = job->next) {
-		dmc->md_write_batch++;
-		if (job->action == WRITECACHE) {
-			/* DIRTY the cache block */
-			md_sector[INDEX_TO_MD_SECTOR_OFFSET(job->index)].cache_state = 
-				(VALID | DIRTY);
-		} else { /* job->action == WRITEDISK* */
-			/* un-DIRTY the cache block */
-			md_sector[INDEX_TO_MD_SECTOR_OFFSET(job->index)].cache_state = VALID;
+/*
+ * An md update made it to flash (or failed), finish off its job.
+ */
+static void
+flashcache_md_write_job_done(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	int index = job->index;
+	struct cacheblock *cacheblk = &dmc->cache[index];
+	spinlock_t *lock = flashcache_index_lock(dmc, index);
+	unsigned long flags;
+
+	if (job->action == MDFENCE) {
+		flashcache_md_fence_done(job);
+		return;
+	}
+	if (job->action == MDFLUSH) {
+		/* Not a block state change, the flush job doesn't own the block */
+		if (unlikely(job->error))
+			set_bit(INDEX_TO_MD_BLOCK(dmc, index), dmc->md_warm_map);
+		else
+			FLASHCACHE_STATS_INC(dmc, md_write_warm);
+		flashcache_free_cache_job(job);
+		if (atomic_dec_and_test(&dmc->nr_jobs))
+			wake_up(&dmc->destroyq);
+		return;
+	}
+	spin_lock_irqsave(lock, flags);
+	if (job->action == WRITECACHE) {
+		if (unlikely(sysctl_flashcache_error_inject & WRITECACHE_MD_ERROR)) {
+			job->error = -EIO;
+			sysctl_flashcache_error_inject &= ~WRITECACHE_MD_ERROR;
 		}
+		if (likely(job->error == 0)) {
+			if ((cacheblk->cache_state & DIRTY) == 0) {
+				dmc->cache_sets[index / dmc->assoc].nr_dirty++;
+				atomic_inc(&dmc->nr_dirty);
+			} else if (dmc->md_summary_count)
+				/* The slot was counted already */
+				flashcache_md_summary_clean(dmc, index);
+			FLASHCACHE_STATS_INC(dmc, md_write_dirty);
+			cacheblk->cache_state |= DIRTY;
+			set_bit(index, dmc->dirty_map);
+		} else {
+			dmc->ssd_write_errors++;
+			/* The slot isn't (newly) DIRTY on flash, drop the count hold() took */
+			if (dmc->md_summary_count)
+				flashcache_md_summary_clean(dmc, index);
+		}
+		flashcache_bio_endio(job->bio, job->error);
+		if (job->error || cacheblk->nr_queued > 0) {
+			if (job->error) {
+				DMERR("flashcache: WRITE: Cache metadata write failed ! error %d block %lu", 
+				      -job->error, flashcache_get_dbn(dmc, index));
+			}
+			spin_unlock_irqrestore(lock, flags);
+			flashcache_do_pending(job);
+		} else {
+			cacheblk->cache_state &= ~BLOCK_IO_INPROG;
+			spin_unlock_irqrestore(lock, flags);
+			flashcache_free_cache_job(job);
+			if (atomic_dec_and_test(&dmc->nr_jobs))
+				wake_up(&dmc->destroyq);
+		}
+	} else {
+		int action = job->action;
+
+		if (unlikely(sysctl_flashcache_error_inject & WRITEDISK_MD_ERROR)) {
+			job->error = -EIO;
+			sysctl_flashcache_error_inject &= ~WRITEDISK_MD_ERROR;
+		}
+		/*
+		 * If we have an error on a WRITEDISK*, no choice but to preserve the 
+		 * dirty block in cache. Fail any IOs for this block that occurred while
+		 * the block was being cleaned.
+		 */
+		if (likely(job->error == 0)) {
+			FLASHCACHE_STATS_INC(dmc, md_write_clean);
+			cacheblk->cache_state &= ~DIRTY;
+			clear_bit(index, dmc->dirty_map);
+			if (dmc->md_summary_count)
+				flashcache_md_summary_clean(dmc, index);
+			VERIFY(dmc->cache_sets[index / dmc->assoc].nr_dirty > 0);
+			VERIFY(atomic_read(&dmc->nr_dirty) > 0);
+			dmc->cache_sets[index / dmc->assoc].nr_dirty--;
+			atomic_dec(&dmc->nr_dirty);
+		} else 
+			dmc->ssd_write_errors++;
+		VERIFY(dmc->cache_sets[index / dmc->assoc].clean_inprog > 0);
+		VERIFY(atomic_read(&dmc->clean_inprog) > 0);
+		dmc->cache_sets[index / dmc->assoc].clean_inprog--;
+		atomic_dec(&dmc->clean_inprog);
+		if (job->error || cacheblk->nr_queued > 0) {
+			if (job->error) {
+				DMERR("flashcache: CLEAN: Cache metadata write failed ! error %d block %lu", 
+				      -job->error, flashcache_get_dbn(dmc, index));
+			}
+			spin_unlock_irqrestore(lock, flags);
+			flashcache_do_pending(job);
+			/* Kick off more cleanings */
+			if (action == WRITEDISK)
+				flashcache_clean_set(dmc, index / dmc->assoc);
+			else
+				flashcache_sync_blocks(dmc);
+		} else {
+			cacheblk->cache_state &= ~BLOCK_IO_INPROG;
+			spin_unlock_irqrestore(lock, flags);
+			flashcache_free_cache_job(job);
+			if (atomic_dec_and_test(&dmc->nr_jobs))
+				wake_up(&dmc->destroyq);
+			/* Kick off more cleanings */
+			if (action == WRITEDISK)
+				flashcache_clean_set(dmc, index / dmc->assoc);
+			else
+				flashcache_sync_blocks(dmc);
+		}
+		FLASHCACHE_STATS_INC(dmc, cleanings);
+		if (action == WRITEDISK_SYNC)
+			flashcache_update_sync_progress(dmc);
+	}
+}
+
+/*
+ * Md journal, see FLASHCACHE_JOURNAL_MAGIC.
+ */
+
+/* Add the update to the record being filled, 0 if it is full. Journal lock held */
+static int
+flashcache_journal_add(struct cache_c *dmc, struct kcached_job *job)
+{
+	struct flashcache_journal *jnl = dmc->journal;
+	struct flashcache_journal_record *rec = &jnl->rec[jnl->filling];
+	struct flash_journal_entry *entry;
+
+	if (rec->header->nr_entries == FLASHCACHE_JOURNAL_ENTRIES)
+		return 0;
+	entry = &FLASHCACHE_JOURNAL_RECORD_ENTRIES(rec->header)[rec->header->nr_entries++];
+	entry->index = job->index;
+	/* The block stays busy until its md update is done, so the dbn is stable */
+	entry->dbn = flashcache_get_dbn(dmc, job->index);
+#ifdef FLASHCACHE_DO_CHECKSUMS
+	entry->checksum = dmc->cache[job->index].checksum;
+#endif
+	if (job->action == WRITECACHE)
+		entry->cache_state = VALID | DIRTY;
+	else if (job->action == MDFENCE)
+		entry->cache_state = INVALID;
+	else
+		entry->cache_state = VALID;
+	job->next = NULL;
+	*rec->jobs_tail = job;
+	rec->jobs_tail = &job->next;
+	return 1;
+}
+
+/*
+ * Returns the record to write next, if none is in flight, the filling one 
+ * has updates and the ring has room for it. The other record becomes the 
+ * filling one and takes the updates that were waiting. Journal lock held.
+ */
+static struct flashcache_journal_record *
+flashcache_journal_next(struct cache_c *dmc)
+{
+	struct flashcache_journal *jnl = dmc->journal;
+	struct flashcache_journal_record *rec = &jnl->rec[jnl->filling];
+	struct kcached_job *job, *next;
+
+	if (jnl->io_inprog || rec->header->nr_entries == 0 ||
+	    jnl->next_seq > jnl->ckpt_seq + jnl->nr_records)
+		return NULL;
+	rec->header->seq = jnl->next_seq++;
+	rec->slot = jnl->next_slot;
+	if (++jnl->next_slot == jnl->nr_records)
+		jnl->next_slot = 0;
+	jnl->io_inprog = 1;
+	jnl->filling ^= 1;
+	jnl->rec[jnl->filling].header->nr_entries = 0;
+	while (jnl->waiters != NULL) {
+		job = jnl->waiters;
+		next = job->next;
+		if (!flashcache_journal_add(dmc, job))
+			break;
+		jnl->waiters = next;
 	}
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	if (jnl->waiters == NULL)
+		jnl->waiters_tail = &jnl->waiters;
+	return rec;
+}
+
+/* Checkpoint once half the ring is used. Journal lock held */
+static int
+flashcache_journal_want_ckpt(struct flashcache_journal *jnl)
+{
+	if (jnl->ckpt_in_prog || 
+	    jnl->done_seq - jnl->ckpt_seq < jnl->nr_records / 2)
+		return 0;
+	jnl->ckpt_in_prog = 1;
+	return 1;
+}
+
+static void
+flashcache_journal_write(struct cache_c *dmc, struct flashcache_journal_record *rec)
+{
+	struct flashcache_journal *jnl = dmc->journal;
+	struct flash_journal_header *header = rec->header;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+	struct io_region where;
+#else
+	struct dm_io_region where;
+#endif
+
+	VERIFY(!in_interrupt());
+	header->gen = jnl->gen;
+	header->magic = FLASHCACHE_JOURNAL_MAGIC;
+	header->crc = 0;
+	header->crc = crc32c(~0, header, FLASHCACHE_JOURNAL_RECORD_SIZE);
 	where.bdev = dmc->cache_dev->bdev;
-	where.count = 1;
-	where.sector = 1 + INDEX_TO_MD_SECTOR(orig_job->index);
-	dmc->ssd_writes++;
-	dmc->md_ssd_writes++;
-	dm_io_async_bvec(1, &where, WRITE,
-			 &orig_job->md_io_bvec,
-			 flashcache_md_write_callback, orig_job);
+	where.sector = jnl->start + rec->slot * FLASHCACHE_JOURNAL_RECORD_SECT;
+	where.count = FLASHCACHE_JOURNAL_RECORD_SECT;
+	FLASHCACHE_STATS_INC(dmc, ssd_writes);
+	FLASHCACHE_STATS_INC(dmc, md_ssd_writes);
+	FLASHCACHE_STATS_INC(dmc, md_journal_writes);
+	FLASHCACHE_STATS_ADD(dmc, md_journal_entries, header->nr_entries);
+	dm_io_async_bvec(1, &where, WRITE, &rec->bvec,
+			 flashcache_md_write_callback, rec->jobs);
 	flashcache_unplug_device(dmc->cache_dev->bdev);
 }
 
+/*
+ * Queue an md update on the journal instead of its slot table sector. 
+ * If no record is in flight, write it out right away, else it rides the 
+ * next record.
+ */
+static void
+flashcache_journal_append(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	struct flashcache_journal *jnl = dmc->journal;
+	struct flashcache_journal_record *rec;
+	unsigned long flags;
+
+	spin_lock_irqsave(&jnl->lock, flags);
+	if (jnl->waiters != NULL || !flashcache_journal_add(dmc, job)) {
+		job->next = NULL;
+		*jnl->waiters_tail = job;
+		jnl->waiters_tail = &job->next;
+	}
+	rec = flashcache_journal_next(dmc);
+	spin_unlock_irqrestore(&jnl->lock, flags);
+	if (rec != NULL) {
+		/* Punt to the worker thread in interrupt context (see md_write_kickoff) */
+		if (!in_interrupt())
+			flashcache_journal_write(dmc, rec);
+		else
+			push_md_io(rec->jobs);
+	}
+}
+
+/*
+ * A journal record made it to flash (or failed). Finish off its updates, 
+ * then flag their md sectors for the next checkpoint and start the next 
+ * record. The in-core state has to be updated before the sectors are 
+ * flagged and done_seq moves, as a checkpoint copies it out.
+ */
+static void
+flashcache_journal_write_done(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	struct flashcache_journal *jnl = dmc->journal;
+	/* Only the in flight record is not the filling one */
+	struct flashcache_journal_record *rec = &jnl->rec[jnl->filling ^ 1];
+	u_int64_t seq = rec->header->seq;
+	int error = job->error;
+	struct kcached_job *next;
+	unsigned long flags;
+	int index, ckpt;
+
+	VERIFY(jnl->io_inprog && rec->jobs == job);
+	rec->jobs = NULL;
+	rec->jobs_tail = &rec->jobs;
+	for ( ; job != NULL ; job = next) {
+		next = job->next;
+		index = job->index;
+		job->error = error;
+		flashcache_md_write_job_done(job);
+		set_bit(INDEX_TO_MD_BLOCK(dmc, index), jnl->md_dirty);
+	}
+	spin_lock_irqsave(&jnl->lock, flags);
+	jnl->done_seq = seq;
+	jnl->io_inprog = 0;
+	rec = flashcache_journal_next(dmc);
+	ckpt = flashcache_journal_want_ckpt(jnl);
+	spin_unlock_irqrestore(&jnl->lock, flags);
+	if (ckpt)
+		queue_work(dmc->kcached_wq, &jnl->ckpt_work);
+	if (rec != NULL)
+		flashcache_journal_write(dmc, rec);
+}
+
+/*
+ * Write the slot table sectors flagged in md_dirty out from the in-core
+ * state, a run of them per IO. "locked" says the cache is live and the 
+ * stripe locks need taking (not so while it is being loaded). Sectors
+ * that fail to write stay flagged. Returns the number of failed IOs.
+ */
+int
+flashcache_journal_flush_md(struct cache_c *dmc, int locked)
+{
+	struct flashcache_journal *jnl = dmc->journal;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+	struct io_region where;
+#else
+	struct dm_io_region where;
+#endif
+	struct flash_cacheblock *md_sector;
+	unsigned long flags = 0;
+	int sector, count, index, i, error, errors = 0;
+
+	where.bdev = dmc->cache_dev->bdev;
+	sector = find_first_bit(jnl->md_dirty, jnl->nr_md_sectors);
+	while (sector < jnl->nr_md_sectors) {
+		for (count = 0 ; 
+		     count < METADATA_IO_BLOCKSIZE_SECT / dmc->md_block_size && 
+			     sector + count < jnl->nr_md_sectors &&
+			     test_and_clear_bit(sector + count, jnl->md_dirty) ;
+		     count++) {
+			md_sector = (struct flash_cacheblock *)
+				((caddr_t)jnl->ckpt_buf + count * dmc->md_block_size * 512);
+			index = (sector + count) * MD_SLOTS_PER_BLOCK(dmc->md_block_size);
+			if (locked)
+				spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
+			flashcache_md_fill_sector(dmc, md_sector, sector + count);
+			if (locked)
+				spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
+		}
+		where.sector = MD_BLOCK_TO_SECTOR(dmc, sector);
+		where.count = count * dmc->md_block_size;
+		FLASHCACHE_STATS_INC(dmc, ssd_writes);
+		FLASHCACHE_STATS_INC(dmc, md_ssd_writes);
+		error = flashcache_dm_io_sync_vm(dmc, &where, WRITE, jnl->ckpt_buf);
+		if (error) {
+			DMERR("flashcache: Could not checkpoint cache metadata sector %lu error %d !",
+			      where.sector, error);
+			dmc->ssd_write_errors++;
+			errors++;
+			for (i = 0 ; i < count ; i++)
+				set_bit(sector + i, jnl->md_dirty);
+		}
+		sector = find_next_bit(jnl->md_dirty, jnl->nr_md_sectors, sector + count);
+	}
+	return errors;
+}
+
+/*
+ * Write back the md sectors of every record on flash, then let the ring
+ * wrap onto them. If that fails, the sectors are retried next time round 
+ * but the journal is not held up on a failing ssd.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void
+flashcache_journal_checkpoint(void *data)
+{
+	struct flashcache_journal *jnl = (struct flashcache_journal *)data;
+#else
+static void
+flashcache_journal_checkpoint(struct work_struct *work)
+{
+	struct flashcache_journal *jnl = 
+		container_of(work, struct flashcache_journal, ckpt_work);
+#endif
+	struct cache_c *dmc = jnl->dmc;
+	struct flashcache_journal_record *rec;
+	u_int64_t seq;
+	unsigned long flags;
+	int ckpt;
+
+	spin_lock_irqsave(&jnl->lock, flags);
+	seq = jnl->done_seq;
+	spin_unlock_irqrestore(&jnl->lock, flags);
+	flashcache_journal_flush_md(dmc, 1);
+	FLASHCACHE_STATS_INC(dmc, md_checkpoints);
+	spin_lock_irqsave(&jnl->lock, flags);
+	jnl->ckpt_seq = seq;
+	jnl->ckpt_in_prog = 0;
+	rec = flashcache_journal_next(dmc);
+	ckpt = flashcache_journal_want_ckpt(jnl);
+	spin_unlock_irqrestore(&jnl->lock, flags);
+	if (ckpt)
+		queue_work(dmc->kcached_wq, &jnl->ckpt_work);
+	if (rec != NULL)
+		flashcache_journal_write(dmc, rec);
+}
+
+/* 
+ * Set up the in-core journal for a ring of "sectors" at "start". Record 
+ * seqs start over on every load, the gen tells the runs apart.
+ */
+int
+flashcache_journal_alloc(struct cache_c *dmc, sector_t start, int sectors)
+{
+	struct flashcache_journal *jnl;
+	struct page *page;
+	int i;
+
+	jnl = kzalloc(sizeof(struct flashcache_journal), GFP_KERNEL);
+	if (jnl == NULL)
+		return -ENOMEM;
+	dmc->journal = jnl;
+	jnl->dmc = dmc;
+	spin_lock_init(&jnl->lock);
+	jnl->start = start;
+	jnl->nr_records = sectors / FLASHCACHE_JOURNAL_RECORD_SECT;
+	jnl->next_seq = 1;
+	jnl->waiters_tail = &jnl->waiters;
+	for (i = 0 ; i < 2 ; i++) {
+		page = alloc_page(GFP_KERNEL);
+		if (page == NULL)
+			goto nomem;
+		jnl->rec[i].bvec.bv_page = page;
+		jnl->rec[i].bvec.bv_len = FLASHCACHE_JOURNAL_RECORD_SIZE;
+		jnl->rec[i].bvec.bv_offset = 0;
+		jnl->rec[i].header = (struct flash_journal_header *)page_address(page);
+		memset(jnl->rec[i].header, 0, FLASHCACHE_JOURNAL_RECORD_SIZE);
+		jnl->rec[i].jobs_tail = &jnl->rec[i].jobs;
+	}
+	jnl->nr_md_sectors = INDEX_TO_MD_BLOCK(dmc, dmc->size - 1) + 1;
+	jnl->md_dirty = (unsigned long *)
+		vmalloc(BITS_TO_LONGS(jnl->nr_md_sectors) * sizeof(unsigned long));
+	jnl->ckpt_buf = vmalloc(METADATA_IO_BLOCKSIZE);
+	if (jnl->md_dirty == NULL || jnl->ckpt_buf == NULL)
+		goto nomem;
+	memset(jnl->md_dirty, 0, 
+	       BITS_TO_LONGS(jnl->nr_md_sectors) * sizeof(unsigned long));
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&jnl->ckpt_work, flashcache_journal_checkpoint, jnl);
+#else
+	INIT_WORK(&jnl->ckpt_work, flashcache_journal_checkpoint);
+#endif
+	return 0;
+
+nomem:
+	flashcache_journal_destroy(dmc);
+	return -ENOMEM;
+}
+
+void
+flashcache_journal_destroy(struct cache_c *dmc)
+{
+	struct flashcache_journal *jnl = dmc->journal;
+	int i;
+
+	if (jnl == NULL)
+		return;
+	VERIFY(!jnl->io_inprog && !jnl->ckpt_in_prog && jnl->waiters == NULL);
+	for (i = 0 ; i < 2 ; i++)
+		if (jnl->rec[i].bvec.bv_page != NULL)
+			__free_page(jnl->rec[i].bvec.bv_page);
+	vfree((void *)jnl->md_dirty);
+	vfree(jnl->ckpt_buf);
+	kfree(jnl);
+	dmc->journal = NULL;
+}
+
 void
 flashcache_md_write_done(struct kcached_job *job)
 {
 	struct cache_c *dmc = job->dmc;
 	struct cache_md_sector_head *md_sector_head;
-	int index;
 	unsigned long flags;
 	struct kcached_job *job_list;
 	int error = job->error;
 	struct kcached_job *next;
-	struct cacheblock *cacheblk;
+	/* All the jobs here are for blocks in this md sector, so share its stripe */
+	spinlock_t *lock = flashcache_index_lock(dmc, job->index);
 		
 	VERIFY(!in_interrupt());
 	VERIFY(job->action == WRITEDISK || job->action == WRITECACHE || 
-	       job->action == WRITEDISK_SYNC);
+	       job->action == WRITEDISK_SYNC ||
+	       job->action == MDFENCE || job->action == MDFLUSH);
+	if (dmc->journal) {
+		flashcache_journal_write_done(job);
+		return;
+	}
 	flashcache_free_md_sector(job);
 	job->md_sector = NULL;
-	md_sector_head = &dmc->md_sectors_buf[INDEX_TO_MD_SECTOR(job->index)];
+	md_sector_head = &dmc->md_sectors_buf[INDEX_TO_MD_BLOCK(dmc, job->index)];
 	job_list = job;
 	job->next = md_sector_head->md_io_inprog;
 	md_sector_head->md_io_inprog = NULL;
 	for (job = job_list ; job != NULL ; job = next) {
 		next = job->next;
 		job->error = error;
-		index = job->index;
-		cacheblk = &dmc->cache[index];
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-		if (job->action == WRITECACHE) {
-			if (unlikely(sysctl_flashcache_error_inject & WRITECACHE_MD_ERROR)) {
-				job->error = -EIO;
-				sysctl_flashcache_error_inject &= ~WRITECACHE_MD_ERROR;
-			}
-			if (likely(job->error == 0)) {
-				if ((cacheblk->cache_state & DIRTY) == 0) {
-					dmc->cache_sets[index / dmc->assoc].nr_dirty++;
-					dmc->nr_dirty++;
-				}
-				dmc->md_write_dirty++;
-				cacheblk->cache_state |= DIRTY;
-			} else
-				dmc->ssd_write_errors++;
-			flashcache_bio_endio(job->bio, job->error);
-			if (job->error || cacheblk->nr_queued > 0) {
-				if (job->error) {
-					DMERR("flashcache: WRITE: Cache metadata write failed ! error %d block %lu", 
-					      -job->error, cacheblk->dbn);
-				}
-				spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-				flashcache_do_pending(job);
-			} else {
-				cacheblk->cache_state &= ~BLOCK_IO_INPROG;
-				spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-				flashcache_free_cache_job(job);
-				if (atomic_dec_and_test(&dmc->nr_jobs))
-					wake_up(&dmc->destroyq);
-			}
-		} else {
-			int action = job->action;
-
-			if (unlikely(sysctl_flashcache_error_inject & WRITEDISK_MD_ERROR)) {
-				job->error = -EIO;
-				sysctl_flashcache_error_inject &= ~WRITEDISK_MD_ERROR;
-			}
-			/*
-			 * If we have an error on a WRITEDISK*, no choice but to preserve the 
-			 * dirty block in cache. Fail any IOs for this block that occurred while
-			 * the block was being cleaned.
-			 */
-			if (likely(job->error == 0)) {
-				dmc->md_write_clean++;
-				cacheblk->cache_state &= ~DIRTY;
-				VERIFY(dmc->cache_sets[index / dmc->assoc].nr_dirty > 0);
-				VERIFY(dmc->nr_dirty > 0);
-				dmc->cache_sets[index / dmc->assoc].nr_dirty--;
-				dmc->nr_dirty--;
-			} else 
-				dmc->ssd_write_errors++;
-			VERIFY(dmc->cache_sets[index / dmc->assoc].clean_inprog > 0);
-			VERIFY(dmc->clean_inprog > 0);
-			dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-			dmc->clean_inprog--;
-			if (job->error || cacheblk->nr_queued > 0) {
-				if (job->error) {
-					DMERR("flashcache: CLEAN: Cache metadata write failed ! error %d block %lu", 
-					      -job->error, cacheblk->dbn);
-				}
-				spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-				flashcache_do_pending(job);
-				/* Kick off more cleanings */
-				if (action == WRITEDISK)
-					flashcache_clean_set(dmc, index / dmc->assoc);
-				else
-					flashcache_sync_blocks(dmc);
-			} else {
-				cacheblk->cache_state &= ~BLOCK_IO_INPROG;
-				spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-				flashcache_free_cache_job(job);
-				if (atomic_dec_and_test(&dmc->nr_jobs))
-					wake_up(&dmc->destroyq);
-				/* Kick off more cleanings */
-				if (action == WRITEDISK)
-					flashcache_clean_set(dmc, index / dmc->assoc);
-				else
-					flashcache_sync_blocks(dmc);
-			}
-			dmc->cleanings++;
-			if (action == WRITEDISK_SYNC)
-				flashcache_update_sync_progress(dmc);
-		}
+		flashcache_md_write_job_done(job);
 	}
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(lock, flags);
 	if (md_sector_head->queued_updates != NULL) {
 		/* peel off the first job from the pending queue and kick that off */
 		job = md_sector_head->queued_updates;
 		md_sector_head->queued_updates = job->next;
 		job->next = NULL;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(lock, flags);
 		VERIFY(job->action == WRITEDISK || job->action == WRITECACHE ||
-		       job->action == WRITEDISK_SYNC);
+		       job->action == WRITEDISK_SYNC ||
+		       job->action == MDFENCE || job->action == MDFLUSH);
 		flashcache_md_write_kickoff(job);
 	} else {
 		md_sector_head->nr_in_prog = 0;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(lock, flags);
 	}
 }
 
@@ -866,13 +1804,30 @@ void
 flashcache_md_write(struct kcached_job *job)
 {
 	struct cache_c *dmc = job->dmc;
-	struct cache_md_sector_head *md_sector_head;
-	unsigned long flags;
 	
 	VERIFY(job->action == WRITEDISK || job->action == WRITECACHE || 
-	       job->action == WRITEDISK_SYNC);
-	md_sector_head = &dmc->md_sectors_buf[INDEX_TO_MD_SECTOR(job->index)];
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	       job->action == WRITEDISK_SYNC ||
+	       job->action == MDFENCE || job->action == MDFLUSH);
+	if (job->action == WRITECACHE && dmc->md_summary_count &&
+	    flashcache_md_summary_hold(job))
+		return;
+	flashcache_md_write_queue(job);
+}
+
+/* Queue up an md update, past the dirty summary */
+static void
+flashcache_md_write_queue(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	struct cache_md_sector_head *md_sector_head;
+	unsigned long flags;
+
+	if (dmc->journal) {
+		flashcache_journal_append(job);
+		return;
+	}
+	md_sector_head = &dmc->md_sectors_buf[INDEX_TO_MD_BLOCK(dmc, job->index)];
+	spin_lock_irqsave(flashcache_index_lock(dmc, job->index), flags);
 	/* If a write is in progress for this metadata sector, queue this update up */
 	if (md_sector_head->nr_in_prog != 0) {
 		struct kcached_job **nodepp;
@@ -883,10 +1838,10 @@ flashcache_md_write(struct kcached_job *job)
 			nodepp = &((*nodepp)->next);
 		job->next = NULL;
 		*nodepp = job;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, job->index), flags);
 	} else {
 		md_sector_head->nr_in_prog = 1;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, job->index), flags);
 		/*
 		 * If !in_interrupt, we can kick off the write(s) immediately.
 		 * Else punt for the worker thread.
@@ -895,11 +1850,216 @@ flashcache_md_write(struct kcached_job *job)
 			flashcache_md_write_kickoff(job);
 		} else {
 			push_md_io(job);
-			schedule_work(&_kcached_wq);
 		}
 	}
 }
 
+/*
+ * Dirty summary. A slot may only say DIRTY on flash once the superblock 
+ * says its run of md blocks holds dirty slots, so hold a WRITECACHE md 
+ * update until its summary bit is on flash. Returns 1 if the job was held.
+ */
+static int
+flashcache_md_summary_hold(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	int bit = INDEX_TO_MD_SUMMARY(dmc, job->index);
+	unsigned long flags;
+	int kick = 0;
+
+	spin_lock_irqsave(&dmc->md_summary_lock, flags);
+	dmc->md_summary_count[bit]++;
+	set_bit(bit, dmc->md_summary_want);
+	if (test_bit(bit, dmc->md_summary_flash)) {
+		spin_unlock_irqrestore(&dmc->md_summary_lock, flags);
+		return 0;
+	}
+	job->next = dmc->md_summary_waiters;
+	dmc->md_summary_waiters = job;
+	if (!dmc->md_summary_inprog) {
+		dmc->md_summary_inprog = 1;
+		kick = 1;
+	}
+	spin_unlock_irqrestore(&dmc->md_summary_lock, flags);
+	if (kick)
+		queue_work(dmc->md_wq, &dmc->md_summary_work);
+	return 1;
+}
+
+/* 
+ * A slot says VALID on flash again (or was counted twice). A bit no slot
+ * needs stays on flash until the next superblock write setting a bit, so
+ * runs going clean and dirty again don't cost a superblock write each 
+ * way. A crash meanwhile only costs a read of the run.
+ */
+static void
+flashcache_md_summary_clean(struct cache_c *dmc, int index)
+{
+	int bit = INDEX_TO_MD_SUMMARY(dmc, index);
+	unsigned long flags;
+
+	spin_lock_irqsave(&dmc->md_summary_lock, flags);
+	VERIFY(dmc->md_summary_count[bit] > 0);
+	/* While loading, the bit can cover slots not counted yet */
+	if (--dmc->md_summary_count[bit] == 0 && !dmc->md_summary_loading)
+		clear_bit(bit, dmc->md_summary_want);
+	spin_unlock_irqrestore(&dmc->md_summary_lock, flags);
+}
+
+/* Fail md updates held for their summary bits, linked through job->next */
+static void
+flashcache_md_summary_fail(struct kcached_job *jobs, int error)
+{
+	struct kcached_job *job, *next;
+
+	for (job = jobs ; job != NULL ; job = next) {
+		next = job->next;
+		job->next = NULL;
+		job->error = error;
+		flashcache_md_write_job_done(job);
+	}
+}
+
+/*
+ * Write the superblock until it has the summary bits wanted, releasing 
+ * the md updates held for each bit as it makes it. Bits cleared since
+ * the last write go out with it. If the write fails, the held updates 
+ * fail, and so do any held while it was failing. Runs on md_wq, the 
+ * write is synchronous.
+ */
+void 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+flashcache_md_summary_update(struct cache_c *dmc)
+#else
+flashcache_md_summary_update(struct work_struct *work)
+#endif
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+	struct cache_c *dmc = container_of(work, struct cache_c, md_summary_work);
+#endif
+	unsigned long summary[BITS_TO_LONGS(FLASHCACHE_SB_SUMMARY_BITS)];
+	struct kcached_job *job, *next, *ready, **nodepp;
+	unsigned long flags;
+	int error = 0;
+
+	spin_lock_irqsave(&dmc->md_summary_lock, flags);
+	while (!bitmap_subset(dmc->md_summary_want, dmc->md_summary_flash, 
+			      FLASHCACHE_SB_SUMMARY_BITS)) {
+		bitmap_copy(summary, dmc->md_summary_want, FLASHCACHE_SB_SUMMARY_BITS);
+		/* Bits being cleared are off flash as of now */
+		bitmap_and(dmc->md_summary_flash, dmc->md_summary_flash, summary, 
+			   FLASHCACHE_SB_SUMMARY_BITS);
+		spin_unlock_irqrestore(&dmc->md_summary_lock, flags);
+		/* A lazily created cache writes out a run's slots before its first bit */
+		error = 0;
+		if (dmc->md_lazy)
+			error = flashcache_md_format(dmc, summary);
+		if (likely(error == 0))
+			error = flashcache_md_summary_store(dmc, summary);
+		spin_lock_irqsave(&dmc->md_summary_lock, flags);
+		ready = NULL;
+		if (likely(error == 0)) {
+			FLASHCACHE_STATS_INC(dmc, md_summary_writes);
+			bitmap_copy(dmc->md_summary_flash, summary, FLASHCACHE_SB_SUMMARY_BITS);
+			nodepp = &dmc->md_summary_waiters;
+			while ((job = *nodepp) != NULL) {
+				if (test_bit(INDEX_TO_MD_SUMMARY(dmc, job->index), 
+					     dmc->md_summary_flash)) {
+					*nodepp = job->next;
+					job->next = ready;
+					ready = job;
+				} else
+					nodepp = &job->next;
+			}
+		} else {
+			ready = dmc->md_summary_waiters;
+			dmc->md_summary_waiters = NULL;
+		}
+		spin_unlock_irqrestore(&dmc->md_summary_lock, flags);
+		if (unlikely(error))
+			flashcache_md_summary_fail(ready, error);
+		else {
+			for (job = ready ; job != NULL ; job = next) {
+				next = job->next;
+				job->next = NULL;
+				flashcache_md_write_queue(job);
+			}
+		}
+		spin_lock_irqsave(&dmc->md_summary_lock, flags);
+		if (error)
+			break;
+	}
+	/* 
+	 * Holds that came in while the lock was dropped didn't kick the work,
+	 * it was in progress. After a failure nothing else would run them.
+	 */
+	while (unlikely(error) && dmc->md_summary_waiters != NULL) {
+		ready = dmc->md_summary_waiters;
+		dmc->md_summary_waiters = NULL;
+		spin_unlock_irqrestore(&dmc->md_summary_lock, flags);
+		flashcache_md_summary_fail(ready, error);
+		spin_lock_irqsave(&dmc->md_summary_lock, flags);
+	}
+	dmc->md_summary_inprog = 0;
+	spin_unlock_irqrestore(&dmc->md_summary_lock, flags);
+}
+
+/*
+ * Warm caches. Readfilled blocks are VALID in-core only, until something
+ * else writes their md block. Every warm_flush_secs, write out the md blocks
+ * with readfills since the last run, so they survive a crash too.
+ */
+void 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+flashcache_warm_flush(struct cache_c *dmc)
+#else
+flashcache_warm_flush(struct work_struct *work)
+#endif
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+	struct cache_c *dmc = container_of(work, struct cache_c, warm_flush_work.work);
+#endif
+	struct flashcache_journal *jnl = dmc->journal;
+	struct kcached_job *job;
+	unsigned long flags;
+	int md_block, nr_md_blocks, count = 0;
+
+	nr_md_blocks = INDEX_TO_MD_BLOCK(dmc, dmc->size - 1) + 1;
+	for (md_block = find_first_bit(dmc->md_warm_map, nr_md_blocks) ;
+	     md_block < nr_md_blocks && count < FLASHCACHE_WARM_FLUSH_MAX ;
+	     md_block = find_next_bit(dmc->md_warm_map, nr_md_blocks, md_block + 1)) {
+		if (!test_and_clear_bit(md_block, dmc->md_warm_map))
+			continue;
+		if (jnl != NULL) {
+			/* The next checkpoint writes it out */
+			set_bit(md_block, jnl->md_dirty);
+			count++;
+			continue;
+		}
+		job = new_kcached_job(dmc, NULL, md_block * MD_SLOTS_PER_BLOCK(dmc->md_block_size));
+		if (unlikely(job == NULL)) {
+			set_bit(md_block, dmc->md_warm_map);
+			break;
+		}
+		job->action = MDFLUSH;
+		atomic_inc(&dmc->nr_jobs);
+		flashcache_md_write(job);
+		count++;
+	}
+	if (jnl != NULL && count > 0) {
+		spin_lock_irqsave(&jnl->lock, flags);
+		if (jnl->ckpt_in_prog)
+			count = 0;
+		jnl->ckpt_in_prog = 1;
+		spin_unlock_irqrestore(&jnl->lock, flags);
+		if (count > 0)
+			queue_work(dmc->kcached_wq, &jnl->ckpt_work);
+	}
+	if (!dmc->warm_flush_stop)
+		schedule_delayed_work(&dmc->warm_flush_work, 
+				      max(sysctl_flashcache_warm_flush_secs, 1) * HZ);
+}
+
 static void 
 flashcache_kcopyd_callback(int read_err, unsigned int write_err, void *context)
 {
@@ -911,24 +2071,24 @@ flashcache_kcopyd_callback(int read_err, unsigned int write_err, void *context)
 	VERIFY(!in_interrupt());
 	DPRINTK("kcopyd_callback: Index %d", index);
 	VERIFY(job->bio == NULL);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 	VERIFY(dmc->cache[index].cache_state & (DISKWRITEINPROG | VALID | DIRTY));
 	if (unlikely(sysctl_flashcache_error_inject & KCOPYD_CALLBACK_ERROR)) {
 		read_err = -EIO;
 		sysctl_flashcache_error_inject &= ~KCOPYD_CALLBACK_ERROR;
 	}
 	if (likely(read_err == 0 && write_err == 0)) {
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		flashcache_md_write(job);
 	} else {
 		/* Disk write failed. We can not purge this block from flash */
 		DMERR("flashcache: Disk writeback failed ! read error %d write error %d block %lu", 
 		      -read_err, -write_err, job->disk.sector);
 		VERIFY(dmc->cache_sets[index / dmc->assoc].clean_inprog > 0);
-		VERIFY(dmc->clean_inprog > 0);
+		VERIFY(atomic_read(&dmc->clean_inprog) > 0);
 		dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-		dmc->clean_inprog--;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		atomic_dec(&dmc->clean_inprog);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		/* Set the error in the job and let do_pending() handle the error */
 		if (read_err) {
 			dmc->ssd_read_errors++;			
@@ -939,7 +2099,7 @@ flashcache_kcopyd_callback(int read_err, unsigned int write_err, void *context)
 		}
 		flashcache_do_pending(job);
 		flashcache_clean_set(dmc, index / dmc->assoc); /* Kick off more cleanings */
-		dmc->cleanings++;
+		FLASHCACHE_STATS_INC(dmc, cleanings);
 	}
 }
 
@@ -952,12 +2112,12 @@ flashcache_dirty_writeback(struct cache_c *dmc, int index)
 	int device_removal = 0;
 	
 	DPRINTK("flashcache_dirty_writeback: Index %d", index);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 	VERIFY((cacheblk->cache_state & BLOCK_IO_INPROG) == DISKWRITEINPROG);
 	VERIFY(cacheblk->cache_state & DIRTY);
 	dmc->cache_sets[index / dmc->assoc].clean_inprog++;
-	dmc->clean_inprog++;
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	atomic_inc(&dmc->clean_inprog);
+	spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 	job = new_kcached_job(dmc, NULL, index);
 	if (unlikely(sysctl_flashcache_error_inject & DIRTY_WRITEBACK_JOB_ALLOC_FAIL)) {
 		if (job)
@@ -970,28 +2130,28 @@ flashcache_dirty_writeback(struct cache_c *dmc, int index)
 	 */
 	if (unlikely(atomic_read(&dmc->fast_remove_in_prog))) {
 		DMERR("flashcache: Dirty Writeback (for set cleaning) aborted for device removal, block %lu", 
-		      cacheblk->dbn);
+		      flashcache_get_dbn(dmc, index));
 		if (job)
 			flashcache_free_cache_job(job);
 		job = NULL;
 		device_removal = 1;
 	}
 	if (unlikely(job == NULL)) {
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 		dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-		dmc->clean_inprog--;
+		atomic_dec(&dmc->clean_inprog);
 		flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		if (device_removal == 0)
 			DMERR("flashcache: Dirty Writeback (for set cleaning) failed ! Can't allocate memory, block %lu", 
-			      cacheblk->dbn);
+			      flashcache_get_dbn(dmc, index));
 	} else {
 		job->bio = NULL;
 		job->action = WRITEDISK;
 		atomic_inc(&dmc->nr_jobs);
-		dmc->ssd_reads++;
-		dmc->disk_writes++;
+		FLASHCACHE_STATS_INC(dmc, ssd_reads);
+		FLASHCACHE_STATS_INC(dmc, disk_writes);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 		kcopyd_copy(dmc->kcp_client, &job->cache, 1, &job->disk, 0, 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
@@ -1034,6 +2194,10 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 	 */
 	if (atomic_read(&dmc->fast_remove_in_prog))
 		return;
+	/* Not loaded yet (see flashcache_md_load_map()), nothing to look at */
+	if (unlikely(dmc->md_loading) &&
+	    !test_bit(start_index / dmc->md_load_chunk_slots, dmc->md_load_done))
+		return;
 	writes_list = kmalloc(dmc->assoc * sizeof(struct dbn_index_pair), GFP_NOIO);
 	if (unlikely(sysctl_flashcache_error_inject & WRITES_LIST_ALLOC_FAIL)) {
 		if (writes_list)
@@ -1045,11 +2209,11 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 		dmc->memory_alloc_errors++;
 		return;
 	}
-	dmc->clean_set_calls++;
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	FLASHCACHE_STATS_INC(dmc, clean_set_calls);
+	spin_lock_irqsave(flashcache_set_lock(dmc, set), flags);
 	if (dmc->cache_sets[set].nr_dirty < dmc->dirty_thresh_set) {
-		dmc->clean_set_less_dirty++;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		FLASHCACHE_STATS_INC(dmc, clean_set_less_dirty);
+		spin_unlock_irqrestore(flashcache_set_lock(dmc, set), flags);
 		kfree(writes_list);
 		return;
 	} else
@@ -1065,11 +2229,24 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 		DPRINTK("flashcache_clean_set: Set %d", set);
 		while (scanned < dmc->assoc &&
 		       ((dmc->cache_sets[set].clean_inprog + nr_writes) < dmc->max_clean_ios_set) &&
-		       ((nr_writes + dmc->clean_inprog) < dmc->max_clean_ios_total) &&
+		       ((nr_writes + atomic_read(&dmc->clean_inprog)) < dmc->max_clean_ios_total) &&
 		       nr_writes < to_clean) {
+			int next;
+
+			/* Skip over the clean blocks using the dirty bitmap */
+			next = find_next_bit(dmc->dirty_map, end_index, i);
+			if (next >= end_index) {
+				scanned += end_index - i;
+				i = start_index;
+				continue;
+			}
+			scanned += next - i;
+			if (scanned >= dmc->assoc)
+				break;
+			i = next;
 			if ((dmc->cache[i].cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {	
 				dmc->cache[i].cache_state |= DISKWRITEINPROG;
-				writes_list[nr_writes].dbn = dmc->cache[i].dbn;
+				writes_list[nr_writes].dbn = flashcache_get_dbn(dmc, i);
 				writes_list[nr_writes].index = i;
 				nr_writes++;
 			}
@@ -1086,12 +2263,12 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 		lru_rel_index = dmc->cache_sets[set].lru_head;
 		while (lru_rel_index != FLASHCACHE_LRU_NULL && 
 		       ((dmc->cache_sets[set].clean_inprog + nr_writes) < dmc->max_clean_ios_set) &&
-		       ((nr_writes + dmc->clean_inprog) < dmc->max_clean_ios_total) &&
+		       ((nr_writes + atomic_read(&dmc->clean_inprog)) < dmc->max_clean_ios_total) &&
 		       nr_writes < to_clean) {
 			cacheblk = &dmc->cache[lru_rel_index + start_index];			
 			if ((cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
 				cacheblk->cache_state |= DISKWRITEINPROG;
-				writes_list[nr_writes].dbn = cacheblk->dbn;
+				writes_list[nr_writes].dbn = flashcache_get_dbn(dmc, lru_rel_index + start_index);
 				writes_list[nr_writes].index = cacheblk - &dmc->cache[0];
 				nr_writes++;
 			}
@@ -1102,8 +2279,8 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 		int i;
 
 		flashcache_merge_writes(dmc, writes_list, &nr_writes, set);
-		dmc->clean_set_ios += nr_writes;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		FLASHCACHE_STATS_ADD(dmc, clean_set_ios, nr_writes);
+		spin_unlock_irqrestore(flashcache_set_lock(dmc, set), flags);
 		for (i = 0 ; i < nr_writes ; i++)
 			flashcache_dirty_writeback(dmc, writes_list[i].index);
 	} else {
@@ -1111,20 +2288,21 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 
 		if (dmc->cache_sets[set].nr_dirty > dmc->dirty_thresh_set)
 			do_delayed_clean = 1;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_set_lock(dmc, set), flags);
 		if (dmc->cache_sets[set].clean_inprog >= dmc->max_clean_ios_set)
-			dmc->set_limit_reached++;
-		if (dmc->clean_inprog >= dmc->max_clean_ios_total)
-			dmc->total_limit_reached++;
+			FLASHCACHE_STATS_INC(dmc, set_limit_reached);
+		if (atomic_read(&dmc->clean_inprog) >= dmc->max_clean_ios_total)
+			FLASHCACHE_STATS_INC(dmc, total_limit_reached);
 		if (do_delayed_clean)
 			schedule_delayed_work(&dmc->delayed_clean, 1*HZ);
-		dmc->clean_set_fails++;
+		FLASHCACHE_STATS_INC(dmc, clean_set_fails);
 	}
 	kfree(writes_list);
 }
 
 static void
-flashcache_read_hit(struct cache_c *dmc, struct bio* bio, int index)
+flashcache_read_hit(struct cache_c *dmc, struct bio* bio, int index,
+		    struct flashcache_bio_stripes *stripes)
 {
 	struct cacheblock *cacheblk;
 	struct pending_job *pjob;
@@ -1134,8 +2312,8 @@ flashcache_read_hit(struct cache_c *dmc, struct bio* bio, int index)
 		struct kcached_job *job;
 			
 		cacheblk->cache_state |= CACHEREADINPROG;
-		dmc->read_hits++;
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		FLASHCACHE_STATS_INC(dmc, read_hits);
+		flashcache_stripes_unlock(dmc, stripes);
 		DPRINTK("Cache read: Block %llu(%lu), index = %d:%s",
 			bio->bi_sector, bio->bi_size, index, "CACHE HIT");
 		job = new_kcached_job(dmc, bio, index);
@@ -1152,16 +2330,16 @@ flashcache_read_hit(struct cache_c *dmc, struct bio* bio, int index)
 			 * pending jobs.
 			 */
 			DMERR("flashcache: Read (hit) failed ! Can't allocate memory for cache IO, block %lu", 
-			      cacheblk->dbn);
+			      flashcache_get_dbn(dmc, index));
 			flashcache_bio_endio(bio, -EIO);
-			spin_lock_irq(&dmc->cache_spin_lock);
+			spin_lock_irq(flashcache_index_lock(dmc, index));
 			flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 			cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-			spin_unlock_irq(&dmc->cache_spin_lock);
+			spin_unlock_irq(flashcache_index_lock(dmc, index));
 		} else {
 			job->action = READCACHE; /* Fetch data from cache */
 			atomic_inc(&dmc->nr_jobs);
-			dmc->ssd_reads++;
+			FLASHCACHE_STATS_INC(dmc, ssd_reads);
 			dm_io_async_bvec(1, &job->cache, READ,
 					 bio->bi_io_vec + bio->bi_idx,
 					 flashcache_io_callback, job);
@@ -1180,10 +2358,23 @@ flashcache_read_hit(struct cache_c *dmc, struct bio* bio, int index)
 			flashcache_bio_endio(bio, -EIO);
 		else
 			flashcache_enq_pending(dmc, bio, index, READCACHE, pjob);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		flashcache_stripes_unlock(dmc, stripes);
 	}
 }
 
+/* Fetch the data for a read miss from the source device */
+static void
+flashcache_read_miss_io(struct kcached_job *job)
+{
+	struct bio *bio = job->bio;
+
+	job->action = READDISK;
+	FLASHCACHE_STATS_INC(job->dmc, disk_reads);
+	dm_io_async_bvec(1, &job->disk, READ,
+			 bio->bi_io_vec + bio->bi_idx,
+			 flashcache_io_callback, job);
+}
+
 static void
 flashcache_read_miss(struct cache_c *dmc, struct bio* bio,
 		     int index)
@@ -1205,40 +2396,44 @@ flashcache_read_miss(struct cache_c *dmc, struct bio* bio,
 		 * pending jobs.
 		 */
 		DMERR("flashcache: Read (miss) failed ! Can't allocate memory for cache IO, block %lu", 
-		      cacheblk->dbn);
+		      flashcache_get_dbn(dmc, index));
 		flashcache_bio_endio(bio, -EIO);
-		spin_lock_irq(&dmc->cache_spin_lock);
-		dmc->cached_blocks--;
+		spin_lock_irq(flashcache_index_lock(dmc, index));
+		atomic_dec(&dmc->cached_blocks);
+		flashcache_hash_remove(dmc, index);
 		cacheblk->cache_state &= ~VALID;
 		cacheblk->cache_state |= INVALID;
 		flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		spin_unlock_irq(flashcache_index_lock(dmc, index));
 	} else {
-		job->action = READDISK; /* Fetch data from the source device */
 		atomic_inc(&dmc->nr_jobs);
-		dmc->disk_reads++;
-		dm_io_async_bvec(1, &job->disk, READ,
-				 bio->bi_io_vec + bio->bi_idx,
-				 flashcache_io_callback, job);
+		if (flashcache_md_fence_wanted(dmc, index)) {
+			/* The old block's slot goes INVALID before its data does */
+			job->action = MDFENCE;
+			flashcache_md_write(job);
+		} else
+			flashcache_read_miss_io(job);
 		flashcache_clean_set(dmc, index / dmc->assoc);
 	}
 }
 
 static void
-flashcache_read(struct cache_c *dmc, struct bio *bio)
+flashcache_read(struct cache_c *dmc, struct bio *bio, int uncacheable)
 {
 	int index;
 	int res;
 	struct cacheblock *cacheblk;
-	int queued;
+	int queued = 0, inval = 0;
+	struct flashcache_bio_stripes stripes;
 
 	DPRINTK("Got a %s for %llu  %u bytes)",
 	        (bio_rw(bio) == READ ? "READ":"READA"), 
 		bio->bi_sector, bio->bi_size);
 
-	spin_lock_irq(&dmc->cache_spin_lock);
-	res = flashcache_lookup(dmc, bio, &index);
+	flashcache_bio_stripes(dmc, bio, &stripes);
+	flashcache_stripes_lock(dmc, &stripes);
+	res = flashcache_lookup(dmc, bio, &index, &inval);
 	/* 
 	 * Handle Cache Hit case first.
 	 * We need to handle 2 cases, BUSY and !BUSY. If BUSY, we enqueue the
@@ -1247,8 +2442,8 @@ flashcache_read(struct cache_c *dmc, struct bio *bio)
 	if (res > 0) {
 		cacheblk = &dmc->cache[index];
 		if ((cacheblk->cache_state & VALID) && 
-		    (cacheblk->dbn == bio->bi_sector)) {
-			flashcache_read_hit(dmc, bio, index);
+		    (flashcache_get_dbn(dmc, index) == bio->bi_sector)) {
+			flashcache_read_hit(dmc, bio, index, &stripes);
 			return;
 		}
 	}
@@ -1256,16 +2451,17 @@ flashcache_read(struct cache_c *dmc, struct bio *bio)
 	 * In all cases except for a cache hit (and VALID), test for potential 
 	 * invalidations that we need to do.
 	 */
-	queued = flashcache_inval_blocks(dmc, bio);
+	if (inval)
+		queued = flashcache_inval_blocks(dmc, bio, &stripes);
 	if (queued) {
+		flashcache_stripes_unlock(dmc, &stripes);
 		if (unlikely(queued < 0))
 			flashcache_bio_endio(bio, -EIO);
-		spin_unlock_irq(&dmc->cache_spin_lock);
 		return;
 	}
-	if (res == -1 || flashcache_uncacheable(dmc)) {
+	if (res == -1 || uncacheable) {
 		/* No room or non-cacheable */
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		flashcache_stripes_unlock(dmc, &stripes);
 		DPRINTK("Cache read: Block %llu(%lu):%s",
 			bio->bi_sector, bio->bi_size, "CACHE MISS & NO ROOM");
 		if (res == -1)
@@ -1279,13 +2475,15 @@ flashcache_read(struct cache_c *dmc, struct bio *bio)
 	 * And we found cache blocks to replace
 	 * Claim the cache blocks before giving up the spinlock
 	 */
-	if (dmc->cache[index].cache_state & VALID)
-		dmc->replace++;
-	else
-		dmc->cached_blocks++;
+	if (dmc->cache[index].cache_state & VALID) {
+		FLASHCACHE_STATS_INC(dmc, replace);
+		flashcache_hash_remove(dmc, index);
+	} else
+		atomic_inc(&dmc->cached_blocks);
 	dmc->cache[index].cache_state = VALID | DISKREADINPROG;
-	dmc->cache[index].dbn = bio->bi_sector;
-	spin_unlock_irq(&dmc->cache_spin_lock);
+	flashcache_set_dbn(dmc, index, bio->bi_sector);
+	flashcache_hash_insert(dmc, index);
+	flashcache_stripes_unlock(dmc, &stripes);
 
 	DPRINTK("Cache read: Block %llu(%lu), index = %d:%s",
 		bio->bi_sector, bio->bi_size, index, "CACHE MISS & REPLACE");
@@ -1299,144 +2497,162 @@ flashcache_read(struct cache_c *dmc, struct bio *bio)
  */
 static int
 flashcache_inval_block_set(struct cache_c *dmc, int set, struct bio *bio, int rw,
-			   struct pending_job *pjob)
+			   struct pending_job *pjob, 
+			   struct flashcache_bio_stripes *stripes)
 {
 	sector_t io_start = bio->bi_sector;
 	sector_t io_end = bio->bi_sector + (to_sector(bio->bi_size) - 1);
-	int start_index, end_index, i;
+	int i;
 	struct cacheblock *cacheblk;
 	
-	start_index = dmc->assoc * set;
-	end_index = start_index + dmc->assoc;
-	for (i = start_index ; i < end_index ; i++) {
-		sector_t start_dbn = dmc->cache[i].dbn;
-		sector_t end_dbn = start_dbn + dmc->block_size;
-		
+	while ((i = flashcache_hash_overlap(dmc, set, io_start, io_end)) >= 0) {
 		cacheblk = &dmc->cache[i];
-		if (cacheblk->cache_state & INVALID)
+		VERIFY(cacheblk->cache_state & VALID);
+		/* We have a match */
+		if (rw == WRITE)
+			FLASHCACHE_STATS_INC(dmc, wr_invalidates);
+		else
+			FLASHCACHE_STATS_INC(dmc, rd_invalidates);
+		if (!(cacheblk->cache_state & (BLOCK_IO_INPROG | DIRTY)) &&
+		    (cacheblk->nr_queued == 0) && 
+		    !flashcache_md_fence_wanted(dmc, i)) {
+			atomic_dec(&dmc->cached_blocks);			
+			DPRINTK("Cache invalidate (!BUSY): Block %llu %lx",
+				flashcache_get_dbn(dmc, i), cacheblk->cache_state);
+			flashcache_hash_remove(dmc, i);
+			cacheblk->cache_state = INVALID;
 			continue;
-		if ((io_start >= start_dbn && io_start < end_dbn) ||
-		    (io_end >= start_dbn && io_end < end_dbn)) {
-			/* We have a match */
-			if (rw == WRITE)
-				dmc->wr_invalidates++;
-			else
-				dmc->rd_invalidates++;
-			if (!(cacheblk->cache_state & (BLOCK_IO_INPROG | DIRTY)) &&
-			    (cacheblk->nr_queued == 0)) {
-				dmc->cached_blocks--;			
-				DPRINTK("Cache invalidate (!BUSY): Block %llu %lx",
-					start_dbn, cacheblk->cache_state);
-				cacheblk->cache_state = INVALID;
-				continue;
-			}
-			/*
-			 * The conflicting block has either IO in progress or is 
-			 * Dirty. In all cases, we need to add ourselves to the 
-			 * pending queue. Then if the block is dirty, we kick off
-			 * an IO to clean the block. 
-			 * Note that if the block is dirty and IO is in progress
-			 * on it, the do_pending handler will clean the block
-			 * and then process the pending queue.
+		}
+		/*
+		 * The conflicting block has either IO in progress or is 
+		 * Dirty. In all cases, we need to add ourselves to the 
+		 * pending queue. Then if the block is dirty, we kick off
+		 * an IO to clean the block. 
+		 * Note that if the block is dirty and IO is in progress
+		 * on it, the do_pending handler will clean the block
+		 * and then process the pending queue.
+		 */
+		flashcache_enq_pending(dmc, bio, i, INVALIDATE, pjob);
+		if ((cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
+			/* 
+			 * Kick off block write.
+			 * We can't kick off the write under the spinlock.
+			 * Instead, we mark the slot DISKWRITEINPROG, drop 
+			 * the spinlock and kick off the write. A block marked
+			 * DISKWRITEINPROG cannot change underneath us. 
+			 * to enqueue ourselves onto it's pending queue.
+			 *
+			 * XXX - The dropping of the lock here can be avoided if
+			 * we punt the cleaning of the block to the worker thread,
+			 * at the cost of a context switch.
 			 */
-			flashcache_enq_pending(dmc, bio, i, INVALIDATE, pjob);
-			if ((cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
-				/* 
-				 * Kick off block write.
-				 * We can't kick off the write under the spinlock.
-				 * Instead, we mark the slot DISKWRITEINPROG, drop 
-				 * the spinlock and kick off the write. A block marked
-				 * DISKWRITEINPROG cannot change underneath us. 
-				 * to enqueue ourselves onto it's pending queue.
-				 *
-				 * XXX - The dropping of the lock here can be avoided if
-				 * we punt the cleaning of the block to the worker thread,
-				 * at the cost of a context switch.
-				 */
-				cacheblk->cache_state |= DISKWRITEINPROG;
-				spin_unlock_irq(&dmc->cache_spin_lock);
-				flashcache_dirty_writeback(dmc, i); /* Must inc nr_jobs */
-				spin_lock_irq(&dmc->cache_spin_lock);
-			}
-			return 1;
+			cacheblk->cache_state |= DISKWRITEINPROG;
+			flashcache_stripes_unlock(dmc, stripes);
+			flashcache_dirty_writeback(dmc, i); /* Must inc nr_jobs */
+			flashcache_stripes_lock(dmc, stripes);
+		} else if (!(cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) &&
+			   flashcache_md_fence_wanted(dmc, i)) {
+			/* 
+			 * Clean, but its slot may say VALID on flash. The
+			 * block is invalidated (and we're run) once the slot
+			 * has gone INVALID.
+			 */
+			cacheblk->cache_state |= MDFENCEINPROG;
+			flashcache_stripes_unlock(dmc, stripes);
+			flashcache_md_fence(dmc, i);
+			flashcache_stripes_lock(dmc, stripes);
 		}
+		return 1;
 	}
 	return 0;
 }
 
 /* 
  * Since md will break up IO into blocksize pieces, we only really need to check 
- * the start set and the end set for overlaps.
+ * the start set and the end set for overlaps. With a set hash granule smaller 
+ * than the IO, the granules in between can live in other sets too, so walk
+ * every granule an overlapping block can start in.
  */
 static int
-flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio)
+flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio,
+			struct flashcache_bio_stripes *stripes)
 {	
 	sector_t io_start = bio->bi_sector;
 	sector_t io_end = bio->bi_sector + (to_sector(bio->bi_size) - 1);
-	int start_set, end_set;
-	int queued;
-	struct pending_job *pjob1, *pjob2;
+	sector_t granule, end_granule;
+	int queued, set;
+	struct pending_job *pjob;
 
-	pjob1 = flashcache_alloc_pending_job(dmc);
-	if (unlikely(sysctl_flashcache_error_inject & INVAL_PENDING_JOB_ALLOC_FAIL)) {
-		if (pjob1) {
-			flashcache_free_pending_job(pjob1);
-			pjob1 = NULL;
-		}
-		sysctl_flashcache_error_inject &= ~INVAL_PENDING_JOB_ALLOC_FAIL;
-	}
-	if (pjob1 == NULL) {
-		queued = -ENOMEM;
-		goto out;
-	}
-	pjob2 = flashcache_alloc_pending_job(dmc);
-	if (pjob2 == NULL) {
-		flashcache_free_pending_job(pjob1);
-		queued = -ENOMEM;
-		goto out;
+	/* Aligned IO and no unaligned blocks nearby, only look for an exact match */
+	set = hash_block(dmc, io_start);
+	if (flashcache_aligned_only(dmc, bio, set) &&
+	    flashcache_hash_lookup(dmc, set, io_start) < 0) {
+		FLASHCACHE_STATS_INC(dmc, aligned_inval_skips);
+		return 0;
 	}
-	start_set = hash_block(dmc, io_start);
-	end_set = hash_block(dmc, io_end);
-	queued = flashcache_inval_block_set(dmc, start_set, bio, 
-					    bio_data_dir(bio), pjob1);
-	if (queued) {
-		flashcache_free_pending_job(pjob2);
-		goto out;
-	} else
-		flashcache_free_pending_job(pjob1);		
-	if (start_set != end_set) {
-		queued = flashcache_inval_block_set(dmc, end_set, 
-						    bio, bio_data_dir(bio), pjob2);
+	granule = flashcache_overlap_start(dmc, io_start) >> dmc->set_shift;
+	end_granule = io_end >> dmc->set_shift;
+	do {
+		pjob = flashcache_alloc_pending_job(dmc);
+		if (unlikely(sysctl_flashcache_error_inject & INVAL_PENDING_JOB_ALLOC_FAIL)) {
+			if (pjob) {
+				flashcache_free_pending_job(pjob);
+				pjob = NULL;
+			}
+			sysctl_flashcache_error_inject &= ~INVAL_PENDING_JOB_ALLOC_FAIL;
+		}
+		if (pjob == NULL)
+			return -ENOMEM;
+		queued = flashcache_inval_block_set(dmc, 
+						    hash_block(dmc, granule << dmc->set_shift),
+						    bio, bio_data_dir(bio), pjob, stripes);
 		if (!queued)
-			flashcache_free_pending_job(pjob2);
-	} else
-		flashcache_free_pending_job(pjob2);		
-out:
+			flashcache_free_pending_job(pjob);
+	} while (!queued && ++granule <= end_granule);
 	return queued;
 }
 
+/* Write the data for a write miss (or hit) to the ssd */
+static void
+flashcache_write_miss_io(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	struct bio *bio = job->bio;
+
+	job->action = WRITECACHE; 
+	FLASHCACHE_STATS_INC(dmc, ssd_writes);
+	dm_io_async_bvec(1, &job->cache, WRITE, 
+			 bio->bi_io_vec + bio->bi_idx,
+			 flashcache_io_callback, job);
+	flashcache_unplug_device(dmc->cache_dev->bdev);
+}
+
 static void
-flashcache_write_miss(struct cache_c *dmc, struct bio *bio, int index)
+flashcache_write_miss(struct cache_c *dmc, struct bio *bio, int index, 
+		      int inval, struct flashcache_bio_stripes *stripes)
 {
 	struct cacheblock *cacheblk;
 	struct kcached_job *job;
-	int queued;
+	int queued = 0;
 
 	cacheblk = &dmc->cache[index];
-	queued = flashcache_inval_blocks(dmc, bio);
+	if (inval)
+		queued = flashcache_inval_blocks(dmc, bio, stripes);
 	if (queued) {
+		flashcache_stripes_unlock(dmc, stripes);
 		if (unlikely(queued < 0))
 			flashcache_bio_endio(bio, -EIO);
-		spin_unlock_irq(&dmc->cache_spin_lock);
 		return;
 	}
-	if (cacheblk->cache_state & VALID)
-		dmc->wr_replace++;
-	else
-		dmc->cached_blocks++;
+	if (cacheblk->cache_state & VALID) {
+		FLASHCACHE_STATS_INC(dmc, wr_replace);
+		flashcache_hash_remove(dmc, index);
+	} else
+		atomic_inc(&dmc->cached_blocks);
 	cacheblk->cache_state = VALID | CACHEWRITEINPROG;
-	cacheblk->dbn = bio->bi_sector;
-	spin_unlock_irq(&dmc->cache_spin_lock);
+	flashcache_set_dbn(dmc, index, bio->bi_sector);
+	flashcache_hash_insert(dmc, index);
+	flashcache_stripes_unlock(dmc, stripes);
 	job = new_kcached_job(dmc, bio, index);
 	if (unlikely(sysctl_flashcache_error_inject & WRITE_MISS_JOB_ALLOC_FAIL)) {
 		if (job)
@@ -1451,41 +2667,47 @@ flashcache_write_miss(struct cache_c *dmc, struct bio *bio, int index)
 		 * pending jobs.
 		 */
 		DMERR("flashcache: Write (miss) failed ! Can't allocate memory for cache IO, block %lu", 
-		      cacheblk->dbn);
+		      flashcache_get_dbn(dmc, index));
 		flashcache_bio_endio(bio, -EIO);
-		spin_lock_irq(&dmc->cache_spin_lock);
-		dmc->cached_blocks--;
+		spin_lock_irq(flashcache_index_lock(dmc, index));
+		atomic_dec(&dmc->cached_blocks);
+		flashcache_hash_remove(dmc, index);
 		cacheblk->cache_state &= ~VALID;
 		cacheblk->cache_state |= INVALID;
 		flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		spin_unlock_irq(flashcache_index_lock(dmc, index));
 	} else {
-		job->action = WRITECACHE; 
 		atomic_inc(&dmc->nr_jobs);
-		dmc->ssd_writes++;
-		dm_io_async_bvec(1, &job->cache, WRITE, 
-				 bio->bi_io_vec + bio->bi_idx,
-				 flashcache_io_callback, job);
-		flashcache_unplug_device(dmc->cache_dev->bdev);
+		if (flashcache_md_fence_wanted(dmc, index)) {
+			/* The old block's slot goes INVALID before its data does */
+			job->action = MDFENCE;
+			flashcache_md_write(job);
+		} else
+			flashcache_write_miss_io(job);
 		flashcache_clean_set(dmc, index / dmc->assoc);
 	}
 }
 
 static void
-flashcache_write_hit(struct cache_c *dmc, struct bio *bio, int index)
+flashcache_write_hit(struct cache_c *dmc, struct bio *bio, int index,
+		     struct flashcache_bio_stripes *stripes)
 {
 	struct cacheblock *cacheblk;
 	struct pending_job *pjob;
 	struct kcached_job *job;
+	int fence;
 
 	cacheblk = &dmc->cache[index];
 	if (!(cacheblk->cache_state & BLOCK_IO_INPROG) && (cacheblk->nr_queued == 0)) {
 		if (cacheblk->cache_state & DIRTY)
-			dmc->dirty_write_hits++;
-		dmc->write_hits++;
+			FLASHCACHE_STATS_INC(dmc, dirty_write_hits);
+		FLASHCACHE_STATS_INC(dmc, write_hits);
+		/* A clean slot may say VALID on flash, for the data being overwritten */
+		fence = !(cacheblk->cache_state & DIRTY) && 
+			flashcache_md_fence_wanted(dmc, index);
 		cacheblk->cache_state |= CACHEWRITEINPROG;
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		flashcache_stripes_unlock(dmc, stripes);
 		job = new_kcached_job(dmc, bio, index);
 		if (unlikely(sysctl_flashcache_error_inject & WRITE_HIT_JOB_ALLOC_FAIL)) {
 			if (job)
@@ -1500,21 +2722,21 @@ flashcache_write_hit(struct cache_c *dmc, struct bio *bio, int index)
 			 * pending jobs.
 			 */
 			DMERR("flashcache: Write (hit) failed ! Can't allocate memory for cache IO, block %lu", 
-			      cacheblk->dbn);
+			      flashcache_get_dbn(dmc, index));
 			flashcache_bio_endio(bio, -EIO);
-			spin_lock_irq(&dmc->cache_spin_lock);
+			spin_lock_irq(flashcache_index_lock(dmc, index));
 			flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 			cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-			spin_unlock_irq(&dmc->cache_spin_lock);
+			spin_unlock_irq(flashcache_index_lock(dmc, index));
 		} else {
-			job->action = WRITECACHE; /* Write data to the source device */
 			DPRINTK("Queue job for %llu", bio->bi_sector);
 			atomic_inc(&dmc->nr_jobs);
-			dmc->ssd_writes++;
-			dm_io_async_bvec(1, &job->cache, WRITE, 
-					 bio->bi_io_vec + bio->bi_idx,
-					 flashcache_io_callback, job);
-			flashcache_unplug_device(dmc->cache_dev->bdev);
+			if (fence) {
+				/* The slot goes INVALID before the new data goes out */
+				job->action = MDFENCE;
+				flashcache_md_write(job);
+			} else
+				flashcache_write_miss_io(job);
 			flashcache_clean_set(dmc, index / dmc->assoc);
 		}
 	} else {
@@ -1530,7 +2752,7 @@ flashcache_write_hit(struct cache_c *dmc, struct bio *bio, int index)
 			flashcache_bio_endio(bio, -EIO);
 		else
 			flashcache_enq_pending(dmc, bio, index, WRITECACHE, pjob);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		flashcache_stripes_unlock(dmc, stripes);
 	}
 }
 
@@ -1540,10 +2762,12 @@ flashcache_write(struct cache_c *dmc, struct bio *bio)
 	int index;
 	int res;
 	struct cacheblock *cacheblk;
-	int queued;
+	int queued = 0, inval = 0;
+	struct flashcache_bio_stripes stripes;
 	
-	spin_lock_irq(&dmc->cache_spin_lock);
-	res = flashcache_lookup(dmc, bio, &index);
+	flashcache_bio_stripes(dmc, bio, &stripes);
+	flashcache_stripes_lock(dmc, &stripes);
+	res = flashcache_lookup(dmc, bio, &index, &inval);
 	/*
 	 * If cache hit and !BUSY, simply redirty page.
 	 * If cache hit and BUSY, must wait for IO in prog to complete.
@@ -1555,12 +2779,12 @@ flashcache_write(struct cache_c *dmc, struct bio *bio)
 		/* Cache Hit */
 		cacheblk = &dmc->cache[index];		
 		if ((cacheblk->cache_state & VALID) && 
-		    (cacheblk->dbn == bio->bi_sector)) {
+		    (flashcache_get_dbn(dmc, index) == bio->bi_sector)) {
 			/* Cache Hit */
-			flashcache_write_hit(dmc, bio, index);
+			flashcache_write_hit(dmc, bio, index, &stripes);
 		} else {
 			/* Cache Miss, found block to recycle */
-			flashcache_write_miss(dmc, bio, index);
+			flashcache_write_miss(dmc, bio, index, inval, &stripes);
 		}
 		return;
 	}
@@ -1569,8 +2793,9 @@ flashcache_write(struct cache_c *dmc, struct bio *bio)
 	 * send the request to disk. Before we do that, we must check 
 	 * for potential invalidations !
 	 */
-	queued = flashcache_inval_blocks(dmc, bio);
-	spin_unlock_irq(&dmc->cache_spin_lock);
+	if (inval)
+		queued = flashcache_inval_blocks(dmc, bio, &stripes);
+	flashcache_stripes_unlock(dmc, &stripes);
 	if (queued) {
 		if (unlikely(queued < 0))
 			flashcache_bio_endio(bio, -EIO);
@@ -1585,6 +2810,33 @@ flashcache_write(struct cache_c *dmc, struct bio *bio)
 #define bio_barrier(bio)        ((bio)->bi_rw & (1 << BIO_RW_BARRIER))
 #endif
 
+static void
+flashcache_map_bio(struct cache_c *dmc, struct bio *bio, int uncacheable)
+{
+	struct flashcache_bio_stripes stripes;
+	int queued;
+
+	if ((to_sector(bio->bi_size) != dmc->block_size) ||
+	    (bio_data_dir(bio) == WRITE && uncacheable)) {
+		flashcache_bio_stripes(dmc, bio, &stripes);
+		flashcache_stripes_lock(dmc, &stripes);
+		queued = flashcache_inval_blocks(dmc, bio, &stripes);
+		flashcache_stripes_unlock(dmc, &stripes);
+		if (queued) {
+			if (unlikely(queued < 0))
+				flashcache_bio_endio(bio, -EIO);
+		} else {
+			/* Start uncached IO */
+			flashcache_start_uncached_io(dmc, bio);
+		}
+	} else {
+		if (bio_data_dir(bio) == READ)
+			flashcache_read(dmc, bio, uncacheable);
+		else
+			flashcache_write(dmc, bio);
+	}
+}
+
 /*
  * Decide the mapping and perform necessary cache operations for a bio request.
  */
@@ -1594,44 +2846,130 @@ flashcache_map(struct dm_target *ti, struct bio *bio,
 {
 	struct cache_c *dmc = (struct cache_c *) ti->private;
 	int sectors = to_sector(bio->bi_size);
-	int queued;
+	int uncacheable = 0;
+	struct flashcache_cpu_stats *cpu_stats;
+	unsigned long flags;
 	
-	if (sectors <= 32)
-		size_hist[sectors]++;
-
 	if (bio_barrier(bio))
 		return -EOPNOTSUPP;
 
 	VERIFY(to_sector(bio->bi_size) <= dmc->block_size);
 
+	local_irq_save(flags);
+	cpu_stats = per_cpu_ptr(dmc->cpu_stats, smp_processor_id());
+	if (sectors <= 32)
+		cpu_stats->size_hist[sectors]++;
 	if (bio_data_dir(bio) == READ)
-		dmc->reads++;
+		cpu_stats->stats.reads++;
 	else
-		dmc->writes++;
+		cpu_stats->stats.writes++;
+	local_irq_restore(flags);
 
-	spin_lock_irq(&dmc->cache_spin_lock);
-	if (unlikely(sysctl_pid_do_expiry && 
-		     (dmc->whitelist_head || dmc->blacklist_head)))
-		flashcache_pid_expiry_all_locked(dmc);
-	if ((to_sector(bio->bi_size) != dmc->block_size) ||
-	    (bio_data_dir(bio) == WRITE && flashcache_uncacheable(dmc))) {
-		queued = flashcache_inval_blocks(dmc, bio);
-		spin_unlock_irq(&dmc->cache_spin_lock);
-		if (queued) {
-			if (unlikely(queued < 0))
-				flashcache_bio_endio(bio, -EIO);
-		} else {
-			/* Start uncached IO */
-			flashcache_start_uncached_io(dmc, bio);
+	/* 
+	 * With no pids listed and everything cacheable, there is nothing to 
+	 * look up. The lookups themselves are lockless.
+	 */
+	if (!sysctl_cache_all || dmc->whitelist_head || dmc->blacklist_head)
+		uncacheable = flashcache_uncacheable(dmc);
+	if (unlikely(dmc->md_loading) && 
+	    flashcache_md_load_map(dmc, bio, uncacheable))
+		return DM_MAPIO_SUBMITTED;
+	flashcache_map_bio(dmc, bio, uncacheable);
+	return DM_MAPIO_SUBMITTED;
+}
+
+/* The first chunk of the slot table a bio touches not in "skip", or -1 */
+int
+flashcache_md_load_bio_chunk(struct cache_c *dmc, struct bio *bio, 
+			     unsigned long *skip)
+{
+	sector_t granule, end_granule;
+	int chunk;
+
+	granule = flashcache_overlap_start(dmc, bio->bi_sector) >> dmc->set_shift;
+	end_granule = (bio->bi_sector + to_sector(bio->bi_size) - 1) >> dmc->set_shift;
+	for ( ; granule <= end_granule ; granule++) {
+		chunk = (hash_block(dmc, granule << dmc->set_shift) * dmc->assoc) /
+			dmc->md_load_chunk_slots;
+		if (!test_bit(chunk, skip))
+			return chunk;
+	}
+	return -1;
+}
+
+/*
+ * While the slot table loads in the background, the sets of chunks not
+ * loaded yet can't be looked at. Reads that only touch such chunks, none
+ * of which may hold DIRTY blocks, go to disk. Everything else is held 
+ * until its chunks are loaded, the loader reads those next. Writes are 
+ * held too: sent to disk, they would leave a stale copy in the cache once
+ * the set is loaded. Returns 1 if the bio was taken care of here.
+ */
+int
+flashcache_md_load_map(struct cache_c *dmc, struct bio *bio, int uncacheable)
+{
+	sector_t granule, end_granule;
+	int chunk, loaded = 0, unloaded = 0;
+	int hold = (bio_data_dir(bio) == WRITE);
+	unsigned long flags;
+
+	granule = flashcache_overlap_start(dmc, bio->bi_sector) >> dmc->set_shift;
+	end_granule = (bio->bi_sector + to_sector(bio->bi_size) - 1) >> dmc->set_shift;
+	spin_lock_irqsave(&dmc->md_load_lock, flags);
+	if (!dmc->md_loading) {
+		spin_unlock_irqrestore(&dmc->md_load_lock, flags);
+		return 0;
+	}
+	for ( ; granule <= end_granule ; granule++) {
+		chunk = (hash_block(dmc, granule << dmc->set_shift) * dmc->assoc) /
+			dmc->md_load_chunk_slots;
+		if (test_bit(chunk, dmc->md_load_done)) {
+			loaded++;
+			continue;
 		}
-	} else {
-		spin_unlock_irq(&dmc->cache_spin_lock);		
-		if (bio_data_dir(bio) == READ)
-			flashcache_read(dmc, bio);
-		else
-			flashcache_write(dmc, bio);
+		if (test_bit(chunk, dmc->md_load_failed)) {
+			spin_unlock_irqrestore(&dmc->md_load_lock, flags);
+			flashcache_bio_endio(bio, -EIO);
+			return 1;
+		}
+		unloaded++;
+		if (test_bit(chunk, dmc->md_load_dirty))
+			hold = 1;
+	}
+	if (unloaded == 0) {
+		spin_unlock_irqrestore(&dmc->md_load_lock, flags);
+		return 0;
+	}
+	/* A loaded set can have a DIRTY block the IO overlaps */
+	if (hold || loaded) {
+		bio->bi_next = NULL;
+		*dmc->md_load_bios_tail[uncacheable] = bio;
+		dmc->md_load_bios_tail[uncacheable] = &bio->bi_next;
+		spin_unlock_irqrestore(&dmc->md_load_lock, flags);
+		FLASHCACHE_STATS_INC(dmc, md_load_waits);
+		return 1;
+	}
+	spin_unlock_irqrestore(&dmc->md_load_lock, flags);
+	FLASHCACHE_STATS_INC(dmc, md_load_passthru);
+	FLASHCACHE_STATS_INC(dmc, uncached_reads);
+	FLASHCACHE_STATS_INC(dmc, disk_reads);
+	bio->bi_bdev = dmc->disk_dev->bdev;
+	generic_make_request(bio);
+	return 1;
+}
+
+/* Map the bios held for chunks that have loaded (or failed), or hold them again */
+void
+flashcache_md_load_release(struct cache_c *dmc, struct bio *bios, int uncacheable)
+{
+	struct bio *bio;
+
+	while ((bio = bios) != NULL) {
+		bios = bio->bi_next;
+		bio->bi_next = NULL;
+		if (!flashcache_md_load_map(dmc, bio, uncacheable))
+			flashcache_map_bio(dmc, bio, uncacheable);
 	}
-	return DM_MAPIO_SUBMITTED;
 }
 
 /* Block sync support functions */
@@ -1646,20 +2984,20 @@ flashcache_kcopyd_callback_sync(int read_err, unsigned int write_err, void *cont
 	VERIFY(!in_interrupt());
 	DPRINTK("kcopyd_callback_sync: Index %d", index);
 	VERIFY(job->bio == NULL);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 	VERIFY(dmc->cache[index].cache_state & (DISKWRITEINPROG | VALID | DIRTY));
 	if (likely(read_err == 0 && write_err == 0)) {
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		flashcache_md_write(job);
 	} else {
 		/* Disk write failed. We can not purge this cache from flash */
 		DMERR("flashcache: Disk writeback failed ! read error %d write error %d block %lu", 
 		      -read_err, -write_err, job->disk.sector);
 		VERIFY(dmc->cache_sets[index / dmc->assoc].clean_inprog > 0);
-		VERIFY(dmc->clean_inprog > 0);
+		VERIFY(atomic_read(&dmc->clean_inprog) > 0);
 		dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-		dmc->clean_inprog--;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		atomic_dec(&dmc->clean_inprog);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		/* Set the error in the job and let do_pending() handle the error */
 		if (read_err) {
 			dmc->ssd_read_errors++;
@@ -1670,7 +3008,7 @@ flashcache_kcopyd_callback_sync(int read_err, unsigned int write_err, void *cont
 		}
 		flashcache_do_pending(job);
 		flashcache_sync_blocks(dmc);  /* Kick off more cleanings */
-		dmc->cleanings++;
+		FLASHCACHE_STATS_INC(dmc, cleanings);
 	}
 }
 
@@ -1683,40 +3021,40 @@ flashcache_dirty_writeback_sync(struct cache_c *dmc, int index)
 	int device_removal = 0;
 	
 	DPRINTK("flashcache_dirty_writeback_sync: Index %d", index);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 	VERIFY((cacheblk->cache_state & BLOCK_IO_INPROG) == DISKWRITEINPROG);
 	VERIFY(cacheblk->cache_state & DIRTY);
 	dmc->cache_sets[index / dmc->assoc].clean_inprog++;
-	dmc->clean_inprog++;
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	atomic_inc(&dmc->clean_inprog);
+	spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 	job = new_kcached_job(dmc, NULL, index);
 	/*
 	 * If the device is being (fast) removed, do not kick off any more cleanings.
 	 */
 	if (unlikely(atomic_read(&dmc->fast_remove_in_prog))) {
 		DMERR("flashcache: Dirty Writeback (for set cleaning) aborted for device removal, block %lu", 
-		      cacheblk->dbn);
+		      flashcache_get_dbn(dmc, index));
 		if (job)
 			flashcache_free_cache_job(job);
 		job = NULL;
 		device_removal = 1;
 	}
 	if (unlikely(job == NULL)) {
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(flashcache_index_lock(dmc, index), flags);
 		dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-		dmc->clean_inprog--;
+		atomic_dec(&dmc->clean_inprog);
 		flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_index_lock(dmc, index), flags);
 		if (device_removal == 0)
 			DMERR("flashcache: Dirty Writeback (for sync) failed ! Can't allocate memory, block %lu", 
-			      cacheblk->dbn);
+			      flashcache_get_dbn(dmc, index));
 	} else {
 		job->bio = NULL;
 		job->action = WRITEDISK_SYNC;
 		atomic_inc(&dmc->nr_jobs);
-		dmc->ssd_reads++;
-		dmc->disk_writes++;
+		FLASHCACHE_STATS_INC(dmc, ssd_reads);
+		FLASHCACHE_STATS_INC(dmc, disk_writes);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 		kcopyd_copy(dmc->kcp_client, &job->cache, 1, &job->disk, 0, 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
@@ -1761,56 +3099,57 @@ flashcache_sync_blocks(struct cache_c *dmc)
 		return;
 	}
 	nr_writes = 0;
-	set = -1;
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);	
+	set = -1;	/* The set whose lock we hold */
 	index = dmc->sync_index;
 	while (index < dmc->size && 
-	       (nr_writes + dmc->clean_inprog) < dmc->max_clean_ios_total) {
+	       (nr_writes + atomic_read(&dmc->clean_inprog)) < dmc->max_clean_ios_total) {
 		VERIFY(nr_writes <= dmc->assoc);
-		if (((index % dmc->assoc) == 0) && (nr_writes > 0)) {
-			/*
-			 * Crossing a set, sort/merge all the IOs collected so
-			 * far and issue the writes.
-			 */
-			VERIFY(set != -1);
-			flashcache_merge_writes(dmc, writes_list, &nr_writes, set);
-			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-			for (i = 0 ; i < nr_writes ; i++)
-				flashcache_dirty_writeback_sync(dmc, writes_list[i].index);
-			nr_writes = 0;
-			set = -1;
-			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		/* Skip straight to the next dirty block */
+		index = find_next_bit(dmc->dirty_map, dmc->size, index);
+		if (index >= dmc->size)
+			break;
+		if (index / dmc->assoc != set) {
+			if (nr_writes > 0) {
+				/*
+				 * Crossing a set, sort/merge all the IOs collected so
+				 * far and issue the writes.
+				 */
+				flashcache_merge_writes(dmc, writes_list, &nr_writes, set);
+				spin_unlock_irqrestore(flashcache_set_lock(dmc, set), flags);
+				for (i = 0 ; i < nr_writes ; i++)
+					flashcache_dirty_writeback_sync(dmc, writes_list[i].index);
+				nr_writes = 0;
+			} else if (set != -1)
+				spin_unlock_irqrestore(flashcache_set_lock(dmc, set), flags);
+			set = index / dmc->assoc;
+			spin_lock_irqsave(flashcache_set_lock(dmc, set), flags);
 		}
 		cacheblk = &dmc->cache[index];
 		if ((cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
 			cacheblk->cache_state |= DISKWRITEINPROG;
-			writes_list[nr_writes].dbn = cacheblk->dbn;
-			writes_list[nr_writes].index = cacheblk - &dmc->cache[0];
-			set = index / dmc->assoc;
+			writes_list[nr_writes].dbn = flashcache_get_dbn(dmc, index);
+			writes_list[nr_writes].index = index;
 			nr_writes++;
 		}
 		index++;
 	}
 	dmc->sync_index = index;
 	if (nr_writes > 0) {
-		VERIFY(set != -1);
 		flashcache_merge_writes(dmc, writes_list, &nr_writes, set);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(flashcache_set_lock(dmc, set), flags);
 		for (i = 0 ; i < nr_writes ; i++)
 			flashcache_dirty_writeback_sync(dmc, writes_list[i].index);
-	} else
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	} else if (set != -1)
+		spin_unlock_irqrestore(flashcache_set_lock(dmc, set), flags);
 	kfree(writes_list);
 }
 
 void
 flashcache_sync_all(struct cache_c *dmc)
 {
-	unsigned long flags;
-
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	/* The dirty maps are only complete once the slot table is loaded */
+	wait_event(dmc->md_load_wait, !dmc->md_loading);
 	dmc->sync_index = 0;
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);	
 	flashcache_sync_blocks(dmc);
 }
 
@@ -1842,7 +3181,7 @@ void
 flashcache_uncached_io_complete(struct kcached_job *job)
 {
 	struct cache_c *dmc = job->dmc;
-	unsigned long flags;
+	struct flashcache_bio_stripes stripes;
 	int queued;
 	int error = job->error;
 
@@ -1852,9 +3191,10 @@ flashcache_uncached_io_complete(struct kcached_job *job)
 		else
 			dmc->disk_read_errors++;
 	}
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-	queued = flashcache_inval_blocks(dmc, job->bio);
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	flashcache_bio_stripes(dmc, job->bio, &stripes);
+	flashcache_stripes_lock(dmc, &stripes);
+	queued = flashcache_inval_blocks(dmc, job->bio, &stripes);
+	flashcache_stripes_unlock(dmc, &stripes);
 	if (queued) {
 		if (unlikely(queued < 0))
 			flashcache_bio_endio(job->bio, -EIO);
@@ -1880,7 +3220,6 @@ flashcache_uncached_io_callback(unsigned long error, void *context)
 
 	VERIFY(job->index == -1);
 	push_uncached_io_complete(job);
-	schedule_work(&_kcached_wq);
 }
 
 static void
@@ -1890,11 +3229,11 @@ flashcache_start_uncached_io(struct cache_c *dmc, struct bio *bio)
 	struct kcached_job *job;
 	
 	if (is_write) {
-		dmc->uncached_writes++;
-		dmc->disk_writes++;
+		FLASHCACHE_STATS_INC(dmc, uncached_writes);
+		FLASHCACHE_STATS_INC(dmc, disk_writes);
 	} else {
-		dmc->uncached_reads++;
-		dmc->disk_reads++;
+		FLASHCACHE_STATS_INC(dmc, uncached_reads);
+		FLASHCACHE_STATS_INC(dmc, disk_reads);
 	}
 	job = new_kcached_job(dmc, bio, -1);
 	if (unlikely(job == NULL)) {
@@ -55,48 +55,50 @@
 #endif
 #include "flashcache.h"
 
-static DEFINE_SPINLOCK(_job_lock);
-
 extern mempool_t *_job_pool;
 extern mempool_t *_pending_job_pool;
 
 extern atomic_t nr_cache_jobs;
 extern atomic_t nr_pending_jobs;
 
-LIST_HEAD(_pending_jobs);
-LIST_HEAD(_io_jobs);
-LIST_HEAD(_md_io_jobs);
-LIST_HEAD(_md_complete_jobs);
-LIST_HEAD(_uncached_io_complete_jobs);
-
-int
-flashcache_pending_empty(void)
-{
-	return list_empty(&_pending_jobs);
-}
-
-int
-flashcache_io_empty(void)
-{
-	return list_empty(&_io_jobs);
-}
-
-int
-flashcache_md_io_empty(void)
-{
-	return list_empty(&_md_io_jobs);
-}
-
-int
-flashcache_md_complete_empty(void)
-{
-	return list_empty(&_md_complete_jobs);
+void
+flashcache_job_queues_init(struct cache_c *dmc)
+{
+	struct flashcache_job_queue *jq;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		jq = per_cpu_ptr(dmc->job_queues, cpu);
+		jq->md_complete_jobs = NULL;
+		jq->pending_jobs = NULL;
+		jq->md_io_jobs = NULL;
+		jq->uncached_io_complete_jobs = NULL;
+		jq->readfill_jobs = NULL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+		INIT_WORK(&jq->work, do_work, jq);
+#else
+		INIT_WORK(&jq->work, do_work);
+#endif
+		jq->dmc = dmc;
+	}
 }
 
 int
-flashcache_uncached_io_complete_empty(void)
-{
-	return list_empty(&_uncached_io_complete_jobs);
+flashcache_job_queues_empty(struct cache_c *dmc)
+{
+	struct flashcache_job_queue *jq;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		jq = per_cpu_ptr(dmc->job_queues, cpu);
+		if (jq->md_complete_jobs != NULL ||
+		    jq->pending_jobs != NULL ||
+		    jq->md_io_jobs != NULL ||
+		    jq->uncached_io_complete_jobs != NULL ||
+		    jq->readfill_jobs != NULL)
+			return 0;
+	}
+	return 1;
 }
 
 struct kcached_job *
@@ -137,15 +139,17 @@ flashcache_free_pending_job(struct pending_job *job)
 	atomic_dec(&nr_pending_jobs);
 }
 
-#define FLASHCACHE_PENDING_JOB_HASH(INDEX)		((INDEX) % PENDING_JOB_HASH_SIZE)
+#define FLASHCACHE_PENDING_JOB_HASH(INDEX)		((INDEX) >> FLASHCACHE_PENDING_SHIFT)
 
 void 
 flashcache_enq_pending(struct cache_c *dmc, struct bio* bio,
 		       int index, int action, struct pending_job *job)
 {
 	struct pending_job **head;
+	int count, max;
 	
-	head = &dmc->pending_job_hashbuckets[FLASHCACHE_PENDING_JOB_HASH(index)];
+	VERIFY(spin_is_locked(flashcache_index_lock(dmc, index)));
+	head = &dmc->pending_job_buckets[FLASHCACHE_PENDING_JOB_HASH(index)];
 	DPRINTK("flashcache_enq_pending: Queue to pending Q Index %d %llu",
 		index, bio->bi_sector);
 	VERIFY(job != NULL);
@@ -158,8 +162,12 @@ flashcache_enq_pending(struct cache_c *dmc, struct bio* bio,
 		(*head)->prev = job;
 	*head = job;
 	dmc->cache[index].nr_queued++;
-	dmc->enqueues++;
-	dmc->pending_jobs_count++;
+	FLASHCACHE_STATS_INC(dmc, enqueues);
+	count = atomic_inc_return(&dmc->pending_jobs_count);
+	while (unlikely(count > (max = dmc->pending_jobs_max))) {
+		if (cmpxchg(&dmc->pending_jobs_max, max, count) == max)
+			break;
+	}
 }
 
 /*
@@ -172,14 +180,14 @@ flashcache_deq_pending(struct cache_c *dmc, int index)
 	int moved = 0;
 	struct pending_job **head;
 	
-	VERIFY(spin_is_locked(&dmc->cache_spin_lock));
-	head = &dmc->pending_job_hashbuckets[FLASHCACHE_PENDING_JOB_HASH(index)];
+	VERIFY(spin_is_locked(flashcache_index_lock(dmc, index)));
+	head = &dmc->pending_job_buckets[FLASHCACHE_PENDING_JOB_HASH(index)];
 	for (node = *head ; node != NULL ; node = next) {
 		next = node->next;
 		if (node->index == index) {
 			/* 
-			 * Remove pending job from the global list of 
-			 * jobs and move it to the private list for freeing 
+			 * Remove pending job from the bucket and move it 
+			 * to the private list for freeing 
 			 */
 			if (node->prev == NULL) {
 				*head = node->next;
@@ -198,8 +206,8 @@ flashcache_deq_pending(struct cache_c *dmc, int index)
 			moved++;
 		}
 	}
-	VERIFY(dmc->pending_jobs_count >= moved);
-	dmc->pending_jobs_count -= moved;
+	VERIFY(atomic_read(&dmc->pending_jobs_count) >= moved);
+	atomic_sub(moved, &dmc->pending_jobs_count);
 	return movelist;
 }
 
@@ -270,9 +278,9 @@ flashcache_store_checksum(struct kcached_job *job)
 	unsigned long flags;
 	
 	sum = flashcache_compute_checksum(job->bio);
-	spin_lock_irqsave(&job->dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(flashcache_index_lock(job->dmc, job->index), flags);
 	job->dmc->cache[job->index].checksum = sum;
-	spin_unlock_irqrestore(&job->dmc->cache_spin_lock, flags);
+	spin_unlock_irqrestore(flashcache_index_lock(job->dmc, job->index), flags);
 }
 
 int
@@ -283,98 +291,149 @@ flashcache_validate_checksum(struct kcached_job *job)
 	unsigned long flags;
 	
 	sum = flashcache_compute_checksum(job->bio);
-	spin_lock_irqsave(&job->dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(flashcache_index_lock(job->dmc, job->index), flags);
 	if (likely(job->dmc->cache[job->index].checksum == sum)) {
-		job->dmc->checksum_valid++;		
+		FLASHCACHE_STATS_INC(job->dmc, checksum_valid);		
 		retval = 0;
 	} else {
-		job->dmc->checksum_invalid++;
+		FLASHCACHE_STATS_INC(job->dmc, checksum_invalid);
 		retval = 1;
 	}
-	spin_unlock_irqrestore(&job->dmc->cache_spin_lock, flags);
+	spin_unlock_irqrestore(flashcache_index_lock(job->dmc, job->index), flags);
 	return retval;
 }
 #endif
 
 /*
- * Functions to push and pop a job onto the head of a given job list.
+ * Functions to push a job onto a job list and pop the whole list off.
+ * Jobs are pushed onto the lists of the CPU we are running on, and the
+ * work is queued on the same CPU's worker thread. Any number of pushers
+ * (including interrupts) can race with each other and with the worker, 
+ * no lock is needed.
  */
 struct kcached_job *
-pop(struct list_head *jobs)
+pop(struct kcached_job **jobs)
 {
-	struct kcached_job *job = NULL;
-	unsigned long flags;
+	struct kcached_job *job, *next, *prev = NULL;
 
-	spin_lock_irqsave(&_job_lock, flags);
-	if (!list_empty(jobs)) {
-		job = list_entry(jobs->next, struct kcached_job, list);
-		list_del(&job->list);
+	job = xchg(jobs, NULL);
+	/* The list is newest first, reverse it to run jobs in order */
+	while (job != NULL) {
+		next = job->qnext;
+		job->qnext = prev;
+		prev = job;
+		job = next;
 	}
-	spin_unlock_irqrestore(&_job_lock, flags);
-	return job;
+	return prev;
 }
 
+static inline void
+flashcache_push_job(struct kcached_job **jobs, struct kcached_job *job)
+{
+	struct kcached_job *first;
+
+	do {
+		first = *(struct kcached_job * volatile *)jobs;
+		job->qnext = first;
+	} while (cmpxchg(jobs, first, job) != first);
+}
+
+/* list is the offset of the job list in struct flashcache_job_queue */
 void 
-push(struct list_head *jobs, struct kcached_job *job)
+push(struct kcached_job *job, size_t list)
 {
-	unsigned long flags;
+	struct cache_c *dmc = job->dmc;
+	struct flashcache_job_queue *jq;
 
-	spin_lock_irqsave(&_job_lock, flags);
-	list_add_tail(&job->list, jobs);
-	spin_unlock_irqrestore(&_job_lock, flags);
+	jq = per_cpu_ptr(dmc->job_queues, get_cpu());
+	flashcache_push_job((struct kcached_job **)((char *)jq + list), job);
+	queue_work(dmc->kcached_wq, &jq->work);
+	put_cpu();
 }
 
+/* 
+ * Readfills are staged per CPU too, but one worker takes them from all
+ * the CPUs, so it can sort and coalesce them (see flashcache_do_readfill()).
+ */
 void
-push_pending(struct kcached_job *job)
+push_readfill(struct kcached_job *job)
 {
-	push(&_pending_jobs, job);	
+	struct cache_c *dmc = job->dmc;
+
+	flashcache_push_job(&per_cpu_ptr(dmc->job_queues, get_cpu())->readfill_jobs, 
+			    job);
+	put_cpu();
+	queue_work(dmc->kcached_wq, &dmc->readfill_wq);
+}
+
+int
+flashcache_readfills_staged(struct cache_c *dmc)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (per_cpu_ptr(dmc->job_queues, cpu)->readfill_jobs != NULL)
+			return 1;
+	}
+	return 0;
 }
 
 void
-push_io(struct kcached_job *job)
+push_pending(struct kcached_job *job)
 {
-	push(&_io_jobs, job);	
+	push(job, offsetof(struct flashcache_job_queue, pending_jobs));
 }
 
 void
 push_uncached_io_complete(struct kcached_job *job)
 {
-	push(&_uncached_io_complete_jobs, job);	
+	push(job, offsetof(struct flashcache_job_queue, uncached_io_complete_jobs));
 }
 
 void
 push_md_io(struct kcached_job *job)
 {
-	push(&_md_io_jobs, job);	
+	push(job, offsetof(struct flashcache_job_queue, md_io_jobs));
 }
 
 void
 push_md_complete(struct kcached_job *job)
 {
-	push(&_md_complete_jobs, job);	
+	push(job, offsetof(struct flashcache_job_queue, md_complete_jobs));
 }
 
 static void
-process_jobs(struct list_head *jobs,
+process_jobs(struct kcached_job **jobs,
 	     void (*fn) (struct kcached_job *))
 {
-	struct kcached_job *job;
+	struct kcached_job *job, *next;
 
-	while ((job = pop(jobs)))
-		(void)fn(job);
+	while ((job = pop(jobs))) {
+		for ( ; job != NULL ; job = next) {
+			next = job->qnext;
+			(void)fn(job);
+		}
+	}
 }
 
 void 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
-do_work(void *unused)
+do_work(void *data)
 #else
-do_work(struct work_struct *unused)
+do_work(struct work_struct *work)
 #endif
 {
-	process_jobs(&_md_complete_jobs, flashcache_md_write_done);
-	process_jobs(&_pending_jobs, flashcache_do_pending);
-	process_jobs(&_md_io_jobs, flashcache_md_write_kickoff);
-	process_jobs(&_uncached_io_complete_jobs, flashcache_uncached_io_complete);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	struct flashcache_job_queue *jq = (struct flashcache_job_queue *)data;
+#else
+	struct flashcache_job_queue *jq = 
+		container_of(work, struct flashcache_job_queue, work);
+#endif
+
+	process_jobs(&jq->md_complete_jobs, flashcache_md_write_done);
+	process_jobs(&jq->pending_jobs, flashcache_do_pending);
+	process_jobs(&jq->md_io_jobs, flashcache_md_write_kickoff);
+	process_jobs(&jq->uncached_io_complete_jobs, flashcache_uncached_io_complete);
 }
 
 struct kcached_job *
@@ -399,7 +458,7 @@ new_kcached_job(struct cache_c *dmc, struct bio* bio,
 	job->bio = bio;
 	job->disk.bdev = dmc->disk_dev->bdev;
 	if (index != -1) {
-		job->disk.sector = dmc->cache[index].dbn;
+		job->disk.sector = flashcache_get_dbn(dmc, index);
 		job->disk.count = dmc->block_size;
 	} else {
 		job->disk.sector = bio->bi_sector;
@@ -407,6 +466,8 @@ new_kcached_job(struct cache_c *dmc, struct bio* bio,
 	}
 	job->next = NULL;
 	job->md_sector = NULL;
+	job->readfill_bvecs = NULL;
+	job->md_bvecs = NULL;
 	return job;
 }
 
@@ -443,6 +504,121 @@ flashcache_reclaim_lru_movetail(struct cache_c *dmc, int index)
 	dmc->cache_sets[set].lru_tail = my_index;
 }
 
+/*
+ * Per set hash of the VALID blocks in the set, keyed by tag (the set 
+ * relative dbn). Like the LRU pointers, the chain links are set-relative 
+ * offsets, so the index costs 2 bytes per cacheblock plus 2 bytes per 
+ * bucket (assoc/2 buckets per set).
+ * A block is on its set's hash chain iff it is VALID, and its bit in the
+ * free bitmap is set iff it is INVALID, so the two are maintained together.
+ * Called with the cache spinlock held.
+ */
+static inline u_int16_t *
+flashcache_hash_bucket(struct cache_c *dmc, int set, u_int32_t tag)
+{
+	unsigned long bucket;
+
+	bucket = hash_long((unsigned long)(tag >> dmc->block_shift), 
+			   dmc->hash_bits);
+	return &dmc->hash_buckets[((unsigned long)set << dmc->hash_bits) + bucket];
+}
+
+void
+flashcache_hash_insert(struct cache_c *dmc, int index)
+{
+	int set = index / dmc->assoc;
+	u_int16_t *bucket;
+
+	bucket = flashcache_hash_bucket(dmc, set, dmc->cache_tag[index]);
+	dmc->hash_next[index] = *bucket;
+	*bucket = index - set * dmc->assoc;
+	clear_bit(index, dmc->free_map);
+	if (dmc->md_changed)
+		set_bit(INDEX_TO_MD_BLOCK(dmc, index), dmc->md_changed);
+	if (dmc->cache_tag[index] & dmc->block_mask)
+		dmc->cache_sets[set].nr_unaligned++;
+}
+
+void
+flashcache_hash_remove(struct cache_c *dmc, int index)
+{
+	int set = index / dmc->assoc;
+	int start_index = set * dmc->assoc;
+	int my_index = index - start_index;
+	u_int16_t *link;
+
+	link = flashcache_hash_bucket(dmc, set, dmc->cache_tag[index]);
+	while (*link != my_index) {
+		VERIFY(*link != FLASHCACHE_LRU_NULL);
+		link = &dmc->hash_next[*link + start_index];
+	}
+	*link = dmc->hash_next[index];
+	dmc->hash_next[index] = FLASHCACHE_LRU_NULL;
+	set_bit(index, dmc->free_map);
+	if (dmc->md_changed)
+		set_bit(INDEX_TO_MD_BLOCK(dmc, index), dmc->md_changed);
+	if (dmc->cache_tag[index] & dmc->block_mask) {
+		VERIFY(dmc->cache_sets[set].nr_unaligned > 0);
+		dmc->cache_sets[set].nr_unaligned--;
+	}
+}
+
+/* Returns the index of the VALID block caching dbn, -1 if there is none */
+int
+flashcache_hash_lookup(struct cache_c *dmc, int set, sector_t dbn)
+{
+	int start_index = set * dmc->assoc;
+	u_int32_t tag = flashcache_dbn_to_tag(dmc, dbn);
+	int rel_index;
+
+	rel_index = *flashcache_hash_bucket(dmc, set, tag);
+	while (rel_index != FLASHCACHE_LRU_NULL) {
+		if (dmc->cache_tag[rel_index + start_index] == tag) {
+			VERIFY(dmc->cache[rel_index + start_index].cache_state & VALID);
+			return rel_index + start_index;
+		}
+		rel_index = dmc->hash_next[rel_index + start_index];
+	}
+	return -1;
+}
+
+/*
+ * Probe the hash chains for every block number (at most 3) that a block
+ * overlapping [io_start, io_end] can start in and that maps to this set,
+ * rather than scan the set.
+ * Returns the index of the VALID block starting at io_start if there is
+ * one, else the first VALID block found overlapping the range, else -1.
+ */
+int
+flashcache_hash_overlap(struct cache_c *dmc, int set, sector_t io_start, 
+			sector_t io_end)
+{
+	int start_index = set * dmc->assoc;
+	unsigned long num_sets = dmc->size >> dmc->consecutive_shift;
+	sector_t dbn, start_dbn;
+	int rel_index, overlap = -1;
+
+	for (dbn = flashcache_overlap_start(dmc, io_start) ; 
+	     dbn <= io_end ; 
+	     dbn += dmc->block_size) {
+		if (flashcache_hash_set(dmc->set_hash, dmc->set_shift, 
+					num_sets, dbn) != set)
+			continue;
+		rel_index = *flashcache_hash_bucket(dmc, set, 
+						    flashcache_dbn_to_tag(dmc, dbn));
+		while (rel_index != FLASHCACHE_LRU_NULL) {
+			start_dbn = flashcache_get_dbn(dmc, rel_index + start_index);
+			if (start_dbn == io_start)
+				return rel_index + start_index;
+			if (overlap == -1 && start_dbn <= io_end &&
+			    start_dbn + dmc->block_size > io_start)
+				overlap = rel_index + start_index;
+			rel_index = dmc->hash_next[rel_index + start_index];
+		}
+	}
+	return overlap;
+}
+
 static int 
 cmp_dbn(const void *a, const void *b)
 {
@@ -495,7 +671,9 @@ flashcache_merge_writes(struct cache_c *dmc, struct dbn_index_pair *writes_list,
 		goto out;
 	}
 	nr_set_dirty = 0;
-	for (ix = start_index ; ix < end_index ; ix++) {
+	for (ix = find_next_bit(dmc->dirty_map, end_index, start_index) ; 
+	     ix < end_index ; 
+	     ix = find_next_bit(dmc->dirty_map, end_index, ix + 1)) {
 		struct cacheblock *cacheblk = &dmc->cache[ix];
 
 		/*
@@ -503,7 +681,7 @@ flashcache_merge_writes(struct cache_c *dmc, struct dbn_index_pair *writes_list,
 		 * DISKWRITEINPROG already, so we'll skip over those here.
 		 */
 		if ((cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
-			set_dirty_list[nr_set_dirty].dbn = cacheblk->dbn;
+			set_dirty_list[nr_set_dirty].dbn = flashcache_get_dbn(dmc, ix);
 			set_dirty_list[nr_set_dirty].index = ix;
 			nr_set_dirty++;
 		}
@@ -524,13 +702,13 @@ flashcache_merge_writes(struct cache_c *dmc, struct dbn_index_pair *writes_list,
 			int j = 0;
 				
 			insert = 0;
-			if (cacheblk->dbn + dmc->block_size == writes_list[i].dbn) {
+			if (set_dirty_list[ix].dbn + dmc->block_size == writes_list[i].dbn) {
 				/* cacheblk to be inserted above i */
 				insert = 1;
 				j = i;
 				back_merge = j;
 			}
-			if (cacheblk->dbn - dmc->block_size == writes_list[i].dbn ) {
+			if (set_dirty_list[ix].dbn - dmc->block_size == writes_list[i].dbn ) {
 				/* cacheblk to be inserted after i */
 				insert = 1;
 				j = i + 1;
@@ -544,15 +722,15 @@ flashcache_merge_writes(struct cache_c *dmc, struct dbn_index_pair *writes_list,
 				 */
 				for (k = (*nr_writes) - 1 ; k >= j ; k--)
 					writes_list[k + 1] = writes_list[k];
-				writes_list[j].dbn = cacheblk->dbn;
+				writes_list[j].dbn = set_dirty_list[ix].dbn;
 				writes_list[j].index = cacheblk - &dmc->cache[0];
 				(*nr_writes)++;
 				VERIFY(*nr_writes <= dmc->assoc);
 				new_inserts++;
 				if (back_merge == -1)
-					dmc->front_merge++;
+					FLASHCACHE_STATS_INC(dmc, front_merge);
 				else
-					dmc->back_merge++;
+					FLASHCACHE_STATS_INC(dmc, back_merge);
 				VERIFY(*nr_writes <= dmc->assoc);
 				break;
 			}
@@ -577,7 +755,7 @@ flashcache_merge_writes(struct cache_c *dmc, struct dbn_index_pair *writes_list,
 				(*nr_writes)++;
 				VERIFY(*nr_writes <= dmc->assoc);
 				new_inserts++;
-				dmc->back_merge++;
+				FLASHCACHE_STATS_INC(dmc, back_merge);
 				VERIFY(*nr_writes <= dmc->assoc);				
 			}
 		}
@@ -607,6 +785,7 @@ flashcache_dm_io_async_vm(struct cache_c *dmc, unsigned int num_regions,
 		.mem.ptr.vma = data,
 		.mem.offset = 0,
 		.notify.fn = fn,
+		.notify.context = context,
 		.client = dmc->io_client,
 	};
 
@@ -710,15 +889,21 @@ flashcache_dm_io_sync_vm(struct cache_c *dmc, struct dm_io_region *where, int rw
 void
 flashcache_update_sync_progress(struct cache_c *dmc)
 {
-	int dirty_pct;
+	int dirty_pct, nr_dirty, cpu;
+	unsigned long cleanings;
 	
-	if (dmc->cleanings % 1000)
+	/* Good enough to report progress every 1000 cleanings on this CPU */
+	cpu = get_cpu();
+	cleanings = per_cpu_ptr(dmc->cpu_stats, cpu)->stats.cleanings;
+	put_cpu();
+	if (cleanings % 1000)
 		return;
-	if (!dmc->nr_dirty || !dmc->size)
+	nr_dirty = atomic_read(&dmc->nr_dirty);
+	if (!nr_dirty || !dmc->size)
 		return;
-	dirty_pct = (dmc->nr_dirty * 100) / dmc->size;
+	dirty_pct = (nr_dirty * 100) / dmc->size;
 	printk(KERN_INFO "Flashcache: Cleaning %d Dirty blocks, Dirty Blocks pct %d%%", 
-	       dmc->nr_dirty, dirty_pct);
+	       nr_dirty, dirty_pct);
 	printk(KERN_INFO "\r");
 }
 
@@ -741,9 +926,9 @@ EXPORT_SYMBOL(flashcache_free_pending_job);
 EXPORT_SYMBOL(pop);
 EXPORT_SYMBOL(push);
 EXPORT_SYMBOL(push_pending);
-EXPORT_SYMBOL(push_io);
 EXPORT_SYMBOL(push_md_io);
 EXPORT_SYMBOL(push_md_complete);
+EXPORT_SYMBOL(push_readfill);
 EXPORT_SYMBOL(process_jobs);
 EXPORT_SYMBOL(do_work);
 EXPORT_SYMBOL(new_kcached_job);
@@ -752,5 +937,9 @@ EXPORT_SYMBOL(flashcache_dm_io_sync_vm_callback);
 #endif
 EXPORT_SYMBOL(flashcache_dm_io_sync_vm);
 EXPORT_SYMBOL(flashcache_reclaim_lru_movetail);
+EXPORT_SYMBOL(flashcache_hash_insert);
+EXPORT_SYMBOL(flashcache_hash_remove);
+EXPORT_SYMBOL(flashcache_hash_lookup);
+EXPORT_SYMBOL(flashcache_hash_overlap);
 EXPORT_SYMBOL(flashcache_merge_writes);
 EXPORT_SYMBOL(flashcache_enq_pending);
@@ -41,8 +41,16 @@
 void
 usage(char *pname)
 {
-	fprintf(stderr, "Usage: %s [-b block size] [ -s cache size] cachedev ssd_devname disk_devname\n", pname);
-	fprintf(stderr, "Usage : %s Default units for -b, -s are sectors, use k/m/g allowed\n",
+	fprintf(stderr, "Usage: %s [-b block size] [ -s cache size] [-a associativity] [-h contig|xor|mult] [-g set hash granule] [-j md journal size] [-m 512|4k] [-w] cachedev ssd_devname disk_devname\n", pname);
+	fprintf(stderr, "Usage : %s Default units for -b, -s, -j are sectors, use k/m/g allowed\n",
+		pname);
+	fprintf(stderr, "Usage : %s Set hash granule (-g) is in blocks, defaults to the associativity\n",
+		pname);
+	fprintf(stderr, "Usage : %s Md block size (-m) defaults to 512, use 4k for ssds with 4KB pages\n",
+		pname);
+	fprintf(stderr, "Usage : %s Md journal (-j) is off by default, 1m is a good size\n",
+		pname);
+	fprintf(stderr, "Usage : %s Warm (-w) keeps clean blocks across a crash, at an extra md write per replacement\n",
 		pname);
 	exit(1);
 }
@@ -107,6 +115,30 @@ get_cache_size(char *s)
 	return size;
 }
 
+static int
+get_set_hash(char *s)
+{
+	if (!strcmp(s, "contig"))
+		return FLASHCACHE_SET_HASH_CONTIG;
+	if (!strcmp(s, "xor"))
+		return FLASHCACHE_SET_HASH_XOR;
+	if (!strcmp(s, "mult"))
+		return FLASHCACHE_SET_HASH_MULT;
+	fprintf(stderr, "%s: Unknown set hash %s\n", pname, s);
+	exit(1);
+}
+
+static sector_t
+get_md_block_size(char *s)
+{
+	if (!strcmp(s, "512"))
+		return FLASHCACHE_MD_BLOCK_512;
+	if (!strcmp(s, "4k") || !strcmp(s, "4096"))
+		return FLASHCACHE_MD_BLOCK_4K;
+	fprintf(stderr, "%s: Md block size must be 512 or 4k\n", pname);
+	exit(1);
+}
+
 static int 
 module_loaded(void)
 {
@@ -154,11 +186,13 @@ main(int argc, char **argv)
 	char *disk_devname, *ssd_devname, *cachedev;
 	struct flash_superblock *sb = (struct flash_superblock *)buf;
 	sector_t cache_devsize, disk_devsize;
-	sector_t block_size = 0, cache_size = 0;
+	sector_t block_size = 0, cache_size = 0, journal_size = 0, md_block_size = 0;
 	int cache_sectorsize;
+	unsigned int assoc = 0, set_hash = FLASHCACHE_SET_HASH_CONTIG, set_granule = 0;
+	int warm = 0;
 	
 	pname = argv[0];
-	while ((c = getopt(argc, argv, "fs:b:v")) != -1) {
+	while ((c = getopt(argc, argv, "fs:b:va:h:g:j:m:w")) != -1) {
 		switch (c) {
 		case 's':
 			cache_size = get_cache_size(optarg);
@@ -167,6 +201,24 @@ main(int argc, char **argv)
 			block_size = get_block_size(optarg);
 			/* Block size should be a power of 2 */
                         break;
+		case 'a':
+			assoc = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			set_hash = get_set_hash(optarg);
+			break;
+		case 'g':
+			set_granule = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			journal_size = get_cache_size(optarg);
+			break;
+		case 'm':
+			md_block_size = get_md_block_size(optarg);
+			break;
+		case 'w':
+			warm = 1;
+			break;
 		case 'v':
 			verbose = 1;
                         break;			
@@ -181,6 +233,27 @@ main(int argc, char **argv)
 		usage(pname);
 	if (block_size == 0)
 		block_size = 8;		/* 4KB default blocksize */
+	if (assoc == 0)
+		assoc = 512;		/* Default associativity */
+	if (assoc & (assoc - 1)) {
+		fprintf(stderr, "%s: Associativity must be a power of 2\n", pname);
+		exit(1);
+	}
+	if (set_granule == 0)
+		set_granule = assoc;	/* Whole set is one contiguous run */
+	if ((set_granule & (set_granule - 1)) || set_granule > assoc) {
+		fprintf(stderr, "%s: Set hash granule must be a power of 2, no larger than the associativity\n", 
+			pname);
+		exit(1);
+	}
+	if (journal_size &&
+	    (journal_size < FLASHCACHE_JOURNAL_MIN_SECT || journal_size > FLASHCACHE_JOURNAL_MAX_SECT)) {
+		fprintf(stderr, "%s: Md journal size must be between %dk and %dk\n", 
+			pname, FLASHCACHE_JOURNAL_MIN_SECT / 2, FLASHCACHE_JOURNAL_MAX_SECT / 2);
+		exit(1);
+	}
+	if (md_block_size == 0)
+		md_block_size = FLASHCACHE_MD_BLOCK_512;
 	cachedev = argv[optind++];
 	if (optind == argc)
 		usage(pname);
@@ -258,11 +331,29 @@ main(int argc, char **argv)
 	}
 	sprintf(dmsetup_cmd, "echo 0 %lu flashcache %s %s 2 %lu ",
 		disk_devsize, disk_devname, ssd_devname, block_size);
-	if (cache_size > 0) {
+	if (cache_size > 0 || assoc != 512 || 
+	    set_hash != FLASHCACHE_SET_HASH_CONTIG || set_granule != assoc ||
+	    journal_size > 0 || md_block_size != FLASHCACHE_MD_BLOCK_512 || warm) {
 		char cache_size_str[4096];
 		
-		sprintf(cache_size_str, "%lu ", cache_size);
+		sprintf(cache_size_str, "%lu ", cache_size > 0 ? cache_size : cache_devsize);
 		strcat(dmsetup_cmd, cache_size_str);
+		if (assoc != 512 || 
+		    set_hash != FLASHCACHE_SET_HASH_CONTIG || set_granule != assoc ||
+		    journal_size > 0 || md_block_size != FLASHCACHE_MD_BLOCK_512 || warm) {
+			sprintf(cache_size_str, "%u %u %u ", assoc, set_hash, set_granule);
+			strcat(dmsetup_cmd, cache_size_str);
+		}
+		if (journal_size > 0 || md_block_size != FLASHCACHE_MD_BLOCK_512 || warm) {
+			sprintf(cache_size_str, "%lu ", journal_size);
+			strcat(dmsetup_cmd, cache_size_str);
+		}
+		if (md_block_size != FLASHCACHE_MD_BLOCK_512 || warm) {
+			sprintf(cache_size_str, "%lu ", md_block_size);
+			strcat(dmsetup_cmd, cache_size_str);
+		}
+		if (warm)
+			strcat(dmsetup_cmd, "1 ");
 	}
 	/* Go ahead and create the cache.
 	 * XXX - Should use the device mapper library for this.
@@ -49,6 +49,7 @@ usage(char *pname)
 
 char *pname;
 char buf[512];
+char md_buf[FLASHCACHE_MD_BLOCK_4K * 512];
 
 main(int argc, char **argv)
 {
@@ -59,6 +60,8 @@ main(int argc, char **argv)
 	sector_t block_size = 0;
 	u_int64_t cache_size = 0;
 	int dirty_blocks = 0;
+	unsigned int md_block_size = FLASHCACHE_MD_BLOCK_512;
+	int lazy = 0, md_block = 0, format_bit;
 	
 	pname = argv[0];
 	while ((c = getopt(argc, argv, "f")) != -1) {
@@ -92,20 +95,36 @@ main(int argc, char **argv)
 		exit(1);
 	}
 	cache_size = sb->size;
+	if (sb->cache_version >= 4)
+		md_block_size = sb->cache_md_block_size;
+	if (md_block_size != FLASHCACHE_MD_BLOCK_512 && md_block_size != FLASHCACHE_MD_BLOCK_4K) {
+		fprintf(stderr, "%s: Corrupt md block size in superblock on %s\n", 
+			pname, ssd_devname);
+		exit(1);
+	}
+	/* Lazily created, the slots of unformatted runs are INVALID whatever they say */
+	if (sb->cache_version >= 7 && (sb->cache_flags & FLASHCACHE_SB_LAZY))
+		lazy = 1;
+	/* The slot table starts at the second md block */
+	lseek(cache_fd, md_block_size * 512, SEEK_SET);
 	while (cache_size > 0 && dirty_blocks == 0) {
 		struct flash_cacheblock *next_ptr;
 		int j, slots_read;
 		
-		if (cache_size < MD_BLOCKS_PER_SECTOR)
+		if (cache_size < MD_SLOTS_PER_BLOCK(md_block_size))
 			slots_read = cache_size;
 		else
-			slots_read = MD_BLOCKS_PER_SECTOR;			
-		if (read(cache_fd, buf, 512) < 0) {
+			slots_read = MD_SLOTS_PER_BLOCK(md_block_size);
+		if (read(cache_fd, md_buf, md_block_size * 512) < 0) {
 			fprintf(stderr, "Cannot read Flashcache metadata %s\n", ssd_devname);
 			exit(1);		
 		}
-		next_ptr = (struct flash_cacheblock *)buf;
+		next_ptr = (struct flash_cacheblock *)md_buf;
+		format_bit = lazy ? MD_SUMMARY_TO_FORMAT(md_block >> sb->cache_summary_shift) : 0;
+		md_block++;
 		for (j = 0 ; j < slots_read ; j++) {
+			if (lazy && !(sb->cache_formatted[format_bit / 32] & (1 << (format_bit % 32))))
+				break;
 			if (next_ptr->cache_state & DIRTY) {
 				dirty_blocks++;
 				break;
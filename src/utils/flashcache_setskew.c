@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2010, Facebook, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * Neither the name Facebook nor the names of its contributors may be used to
+ * endorse or promote products derived from this software without specific
+ * prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Offline set occupancy report. Reads the text output of blkparse for the
+ * source (disk) device on stdin, and for each set hash shows how the
+ * distinct blocks touched by the trace would be spread over the cache sets.
+ * Sets that are asked to hold more blocks than the associativity are the
+ * ones that thrash (noroom, uncached IO) under that hash.
+ *
+ * blktrace -d /dev/sdb -o - | blkparse -i - | flashcache_setskew -s 100g
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <linux/types.h>
+#include <flashcache.h>
+
+void
+usage(char *pname)
+{
+	fprintf(stderr, "Usage: %s [-b block size] [-a associativity] [-g set hash granule] -s cache size < blkparse output\n", pname);
+	fprintf(stderr, "Usage : %s Default units for -b, -s are sectors, use k/m/g allowed\n",
+		pname);
+	fprintf(stderr, "Usage : %s Set hash granule (-g) is in blocks, defaults to the associativity\n",
+		pname);
+	exit(1);
+}
+
+char *pname;
+char line[8192];
+
+static char *set_hash_names[] = { "contig", "xor", "mult" };
+
+static sector_t
+get_size(char *s)
+{
+	sector_t size;
+	char *c;
+
+	size = strtoll(s, NULL, 0);
+	for (c = s; isdigit (*c); c++)
+		;
+	switch (*c) {
+		case '\0':
+			break;
+		case 'k':
+			size = (size * 1024) / 512;
+			break;
+		case 'm':
+			size = (size * 1024 * 1024) / 512;
+			break;
+		case 'g':
+			size = (size * 1024 * 1024 * 1024) / 512;
+			break;
+		default:
+			fprintf (stderr, "%s: Unknown size type %c\n", pname, *c);
+			exit (1);
+	}
+	return size;
+}
+
+static int
+dbn_compare(const void *a, const void *b)
+{
+	sector_t x = *(sector_t *)a, y = *(sector_t *)b;
+
+	if (x < y)
+		return -1;
+	return (x > y);
+}
+
+static void
+report(int set_hash, unsigned int set_shift, unsigned long num_sets,
+       unsigned int assoc, sector_t *dbns, unsigned long nr_dbns)
+{
+	unsigned long *demand;
+	unsigned long i, used = 0, over = 0, max = 0, excess = 0;
+	double mean, var = 0;
+
+	demand = calloc(num_sets, sizeof(unsigned long));
+	if (!demand) {
+		fprintf(stderr, "%s: Out of memory\n", pname);
+		exit(1);
+	}
+	for (i = 0 ; i < nr_dbns ; i++)
+		demand[flashcache_hash_set(set_hash, set_shift, num_sets, dbns[i])]++;
+	mean = (double)nr_dbns / num_sets;
+	for (i = 0 ; i < num_sets ; i++) {
+		if (demand[i])
+			used++;
+		if (demand[i] > max)
+			max = demand[i];
+		if (demand[i] > assoc) {
+			over++;
+			excess += demand[i] - assoc;
+		}
+		var += (demand[i] - mean) * (demand[i] - mean);
+	}
+	var /= num_sets;
+	printf("%-8s sets used %lu/%lu, max %lu, mean %.1f, stddev %.1f, "
+	       "sets over assoc %lu, blocks over assoc %lu (%.1f%%)\n",
+	       set_hash_names[set_hash], used, num_sets, max, mean, sqrt(var),
+	       over, excess, nr_dbns ? (excess * 100.0) / nr_dbns : 0.0);
+	free(demand);
+}
+
+main(int argc, char **argv)
+{
+	sector_t block_size = 8, cache_size = 0;
+	unsigned int assoc = 512, set_granule = 0, set_shift;
+	unsigned long num_sets, nr_dbns = 0, max_dbns = 0, nr_ios = 0, i, j;
+	sector_t *dbns = NULL;
+	int c, set_hash;
+
+	pname = argv[0];
+	while ((c = getopt(argc, argv, "b:a:g:s:")) != -1) {
+		switch (c) {
+		case 'b':
+			block_size = get_size(optarg);
+			break;
+		case 'a':
+			assoc = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			set_granule = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cache_size = get_size(optarg);
+			break;
+		case '?':
+			usage(pname);
+		}
+	}
+	if (set_granule == 0)
+		set_granule = assoc;
+	if (!block_size || (block_size & (block_size - 1)) ||
+	    !assoc || (assoc & (assoc - 1)) ||
+	    (set_granule & (set_granule - 1)) || set_granule > assoc)
+		usage(pname);
+	num_sets = cache_size / block_size / assoc;
+	if (num_sets == 0)
+		usage(pname);
+	set_shift = (ffs(block_size) - 1) + (ffs(set_granule) - 1);
+	/*
+	 * Pick up the queued IOs, "maj,min cpu seq time pid Q rwbs sector + nsect",
+	 * and note every block they touch.
+	 */
+	while (fgets(line, sizeof(line), stdin)) {
+		char action[16], rwbs[16];
+		unsigned long long sector;
+		unsigned int nsect;
+		sector_t dbn;
+
+		if (sscanf(line, "%*s %*d %*u %*f %*d %15s %15s %llu + %u",
+			   action, rwbs, &sector, &nsect) != 4)
+			continue;
+		if (strcmp(action, "Q") || nsect == 0)
+			continue;
+		nr_ios++;
+		for (dbn = sector & ~(block_size - 1) ; dbn < sector + nsect ; dbn += block_size) {
+			if (nr_dbns == max_dbns) {
+				max_dbns = max_dbns ? max_dbns * 2 : 65536;
+				dbns = realloc(dbns, max_dbns * sizeof(sector_t));
+				if (!dbns) {
+					fprintf(stderr, "%s: Out of memory\n", pname);
+					exit(1);
+				}
+			}
+			dbns[nr_dbns++] = dbn;
+		}
+	}
+	/* Only distinct blocks compete for space in a set */
+	qsort(dbns, nr_dbns, sizeof(sector_t), dbn_compare);
+	for (i = 0, j = 0 ; i < nr_dbns ; i++)
+		if (j == 0 || dbns[i] != dbns[j - 1])
+			dbns[j++] = dbns[i];
+	nr_dbns = j;
+	printf("%lu ios, %lu distinct blocks, %lu sets of %u blocks, block size %lu, granule %u blocks\n",
+	       nr_ios, nr_dbns, num_sets, assoc, block_size, set_granule);
+	for (set_hash = 0 ; set_hash <= FLASHCACHE_SET_HASH_MAX ; set_hash++)
+		report(set_hash, set_shift, num_sets, assoc, dbns, nr_dbns);
+	free(dbns);
+	return 0;
+}